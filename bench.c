@@ -0,0 +1,448 @@
+/*
+ * bench.c
+ *		Microbenchmarks of ptrack hot paths
+ *
+ * Copyright (c) 2019-2022, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/bench.c
+ *
+ * Test-only functions measuring ptrack_mark_block(), the map probe of
+ * ptrack_get_pagemapset() and writing of the map at checkpoint on synthetic
+ * block IDs, so that any change of the map layout or hashing can be measured
+ * apart from full pgbench runs.  They are built only with assertions enabled
+ * or with PTRACK_BENCH defined, and raise an error otherwise.
+ *
+ * # ptrack_bench_mark(nblocks, pattern, nrelations, seed)
+ * 								     --- marks synthetic blocks in the map.
+ * # ptrack_bench_probe('LSN', nblocks, pattern, nrelations, seed)
+ * 								     --- probes the map for synthetic blocks.
+ * # ptrack_bench_flush(iterations)  --- writes the main map to a scratch file.
+ *
+ * Synthetic blocks belong to relations, which do not exist, but they are
+ * marked in the real map, so the functions should be used on test clusters
+ * only.
+ */
+
+#include "postgres.h"
+
+#include <math.h>
+#include <unistd.h>
+
+#include "catalog/pg_tablespace.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "storage/fd.h"
+#include "utils/builtins.h"
+#include "utils/pg_lsn.h"
+
+#include "ptrack.h"
+#include "engine.h"
+
+#if defined(USE_ASSERT_CHECKING) || defined(PTRACK_BENCH)
+#define PTRACK_BENCH_ENABLED
+#endif
+
+#ifdef PTRACK_BENCH_ENABLED
+/*
+ * Operations are timed in batches of pregenerated blocks, since a single one
+ * takes less time than reading the clock.  Percentiles are computed over
+ * mean latencies of batches.
+ */
+#define PTRACK_BENCH_BATCH 64
+
+/* Synthetic relations are numbered from here, away from the real ones */
+#define PTRACK_BENCH_FIRST_REL 4000000000U
+
+/* Size of synthetic relations, 8 GB with 8 KB blocks */
+#define PTRACK_BENCH_REL_BLOCKS (1024 * 1024)
+
+/* Scratch file written by ptrack_bench_flush() to base/pgsql_tmp */
+#define PTRACK_BENCH_MAP_NAME "ptrack_bench.map"
+
+typedef enum PtrackBenchPattern
+{
+	PTRACK_BENCH_SEQUENTIAL,	/* bulk load of relations one by one */
+	PTRACK_BENCH_UNIFORM,		/* random blocks of random relations */
+	PTRACK_BENCH_ZIPF			/* hot set, block ranks follow Zipf's law */
+}			PtrackBenchPattern;
+
+typedef struct PtrackBenchGen
+{
+	PtrackBenchPattern pattern;
+	uint64		nrelations;
+	uint64		state;			/* state of splitmix64 generator */
+	uint64		next;			/* next block of sequential pattern */
+}			PtrackBenchGen;
+
+/*
+ * splitmix64 gives the same sequence for the same seed on every platform
+ * and server version, so results of different builds are comparable.
+ */
+static uint64
+ptrack_bench_random(PtrackBenchGen *gen)
+{
+	uint64		z = (gen->state += UINT64CONST(0x9E3779B97F4A7C15));
+
+	z = (z ^ (z >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+	z = (z ^ (z >> 27)) * UINT64CONST(0x94D049BB133111EB);
+	return z ^ (z >> 31);
+}
+
+static void
+ptrack_bench_init(PtrackBenchGen *gen, const char *pattern, int nrelations,
+				  int seed)
+{
+	if (strcmp(pattern, "sequential") == 0)
+		gen->pattern = PTRACK_BENCH_SEQUENTIAL;
+	else if (strcmp(pattern, "uniform") == 0)
+		gen->pattern = PTRACK_BENCH_UNIFORM;
+	else if (strcmp(pattern, "zipf") == 0)
+		gen->pattern = PTRACK_BENCH_ZIPF;
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("unknown block pattern \"%s\"", pattern),
+				 errhint("Valid patterns are \"sequential\", \"uniform\" and \"zipf\".")));
+
+	if (nrelations <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of relations must be positive")));
+
+	gen->nrelations = nrelations;
+	gen->state = (uint64) seed;
+	gen->next = 0;
+}
+
+/*
+ * Generate the next synthetic block.  Zipf ranks are drawn from the
+ * continuous approximation of the distribution with exponent 1, so that the
+ * first blocks of the first relations are the hottest ones.
+ */
+static void
+ptrack_bench_next(PtrackBenchGen *gen, PtBlockId *bid)
+{
+	uint64		total = gen->nrelations * PTRACK_BENCH_REL_BLOCKS;
+	uint64		n;
+
+	switch (gen->pattern)
+	{
+		case PTRACK_BENCH_SEQUENTIAL:
+			n = gen->next++ % total;
+			break;
+		case PTRACK_BENCH_UNIFORM:
+			n = ptrack_bench_random(gen) % total;
+			break;
+		case PTRACK_BENCH_ZIPF:
+		default:
+			{
+				double		u = (ptrack_bench_random(gen) >> 11) * (1.0 / (UINT64CONST(1) << 53));
+
+				n = (uint64) exp(u * log((double) total));
+				n = Min(n, total) - 1;
+				break;
+			}
+	}
+
+	nodeSpc(bid->relnode) = DEFAULTTABLESPACE_OID;
+	nodeDb(bid->relnode) = MyDatabaseId;
+	nodeRel(bid->relnode) = PTRACK_BENCH_FIRST_REL + n / PTRACK_BENCH_REL_BLOCKS;
+	bid->forknum = MAIN_FORKNUM;
+	bid->blocknum = n % PTRACK_BENCH_REL_BLOCKS;
+}
+
+static int
+ptrack_bench_double_cmp(const void *a, const void *b)
+{
+	double		da = *(const double *) a;
+	double		db = *(const double *) b;
+
+	if (da < db)
+		return -1;
+	if (da > db)
+		return 1;
+	return 0;
+}
+
+/* Percentile of sorted samples */
+static double
+ptrack_bench_percentile(const double *samples, int nsamples, double q)
+{
+	return samples[(int) floor(q * (nsamples - 1))];
+}
+
+/*
+ * Fill in the common result columns of mark and probe benchmarks: number of
+ * operations, total time, throughput and latency percentiles in ns.
+ */
+static void
+ptrack_bench_result(Datum *values, int64 ops, double *batch_ns, int nbatches)
+{
+	double		total_ns = 0;
+	int			i;
+
+	for (i = 0; i < nbatches; i++)
+		total_ns += batch_ns[i] * PTRACK_BENCH_BATCH;
+
+	qsort(batch_ns, nbatches, sizeof(double), ptrack_bench_double_cmp);
+
+	values[0] = Int64GetDatum(ops);
+	values[1] = Float8GetDatum(total_ns / 1e9);
+	values[2] = Float8GetDatum(total_ns > 0 ? ops / (total_ns / 1e9) : 0);
+	values[3] = Float8GetDatum(ptrack_bench_percentile(batch_ns, nbatches, 0.5));
+	values[4] = Float8GetDatum(ptrack_bench_percentile(batch_ns, nbatches, 0.9));
+	values[5] = Float8GetDatum(ptrack_bench_percentile(batch_ns, nbatches, 0.99));
+	values[6] = Float8GetDatum(batch_ns[nbatches - 1]);
+}
+
+/* Number of batches of the benchmark of nblocks operations */
+static int
+ptrack_bench_nbatches(int64 nblocks)
+{
+	if (ptrack_map_size == 0 || ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (nblocks < PTRACK_BENCH_BATCH || nblocks / PTRACK_BENCH_BATCH > INT_MAX / sizeof(double))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of blocks must be between %d and " INT64_FORMAT,
+						PTRACK_BENCH_BATCH,
+						(int64) (INT_MAX / sizeof(double)) * PTRACK_BENCH_BATCH)));
+
+	return nblocks / PTRACK_BENCH_BATCH;
+}
+#else
+static void
+ptrack_bench_unsupported(void)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("ptrack is built without benchmark functions"),
+			 errhint("Build ptrack with PTRACK_BENCH=1 or against PostgreSQL configured with --enable-cassert.")));
+}
+#endif
+
+/*
+ * Mark nblocks synthetic blocks in the map with ptrack_mark_block().
+ * Number of blocks is rounded down to whole batches.
+ */
+PG_FUNCTION_INFO_V1(ptrack_bench_mark);
+Datum
+ptrack_bench_mark(PG_FUNCTION_ARGS)
+{
+#ifdef PTRACK_BENCH_ENABLED
+	int64		nblocks = PG_GETARG_INT64(0);
+	char	   *pattern = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	TupleDesc	tupdesc;
+	Datum		values[7];
+	bool		nulls[7] = {false};
+	PtrackBenchGen gen;
+	PtBlockId	bids[PTRACK_BENCH_BATCH];
+	double	   *batch_ns;
+	int			nbatches;
+	int			b;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	nbatches = ptrack_bench_nbatches(nblocks);
+	ptrack_bench_init(&gen, pattern, PG_GETARG_INT32(2), PG_GETARG_INT32(3));
+	batch_ns = palloc(nbatches * sizeof(double));
+
+	for (b = 0; b < nbatches; b++)
+	{
+		instr_time	start_time;
+		instr_time	duration;
+		int			i;
+
+		CHECK_FOR_INTERRUPTS();
+
+		for (i = 0; i < PTRACK_BENCH_BATCH; i++)
+			ptrack_bench_next(&gen, &bids[i]);
+
+		INSTR_TIME_SET_CURRENT(start_time);
+		for (i = 0; i < PTRACK_BENCH_BATCH; i++)
+		{
+			RelFileNodeBackend rnode;
+
+			nodeOf(rnode) = bids[i].relnode;
+			rnode.backend = InvalidBackendId;
+			ptrack_mark_block(rnode, bids[i].forknum, bids[i].blocknum);
+		}
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start_time);
+
+		batch_ns[b] = INSTR_TIME_GET_DOUBLE(duration) * 1e9 / PTRACK_BENCH_BATCH;
+	}
+
+	ptrack_bench_result(values, (int64) nbatches * PTRACK_BENCH_BATCH,
+						batch_ns, nbatches);
+	pfree(batch_ns);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+#else
+	ptrack_bench_unsupported();
+	PG_RETURN_NULL();
+#endif
+}
+
+/*
+ * Probe the map for nblocks synthetic blocks in the same way as
+ * ptrack_get_pagemapset() does for every block of data files.
+ */
+PG_FUNCTION_INFO_V1(ptrack_bench_probe);
+Datum
+ptrack_bench_probe(PG_FUNCTION_ARGS)
+{
+#ifdef PTRACK_BENCH_ENABLED
+	XLogRecPtr	lsn = PG_GETARG_LSN(0);
+	int64		nblocks = PG_GETARG_INT64(1);
+	char	   *pattern = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	TupleDesc	tupdesc;
+	Datum		values[8];
+	bool		nulls[8] = {false};
+	PtrackBenchGen gen;
+	PtScanCtx	ctx;
+	PtBlockId	bids[PTRACK_BENCH_BATCH];
+	double	   *batch_ns;
+	int64		changed = 0;
+	int			nbatches;
+	int			b;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (XLogRecPtrIsInvalid(lsn))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid LSN")));
+
+	nbatches = ptrack_bench_nbatches(nblocks);
+	ptrack_bench_init(&gen, pattern, PG_GETARG_INT32(3), PG_GETARG_INT32(4));
+	batch_ns = palloc(nbatches * sizeof(double));
+
+	/* All synthetic relations are in the default tablespace */
+	MemSet(&ctx, 0, sizeof(ctx));
+	ctx.lsn = lsn;
+	ctx.part = ptrack_partition(DEFAULTTABLESPACE_OID);
+	ctx.file_lsn = InvalidXLogRecPtr;
+
+	for (b = 0; b < nbatches; b++)
+	{
+		instr_time	start_time;
+		instr_time	duration;
+		int			i;
+
+		CHECK_FOR_INTERRUPTS();
+
+		for (i = 0; i < PTRACK_BENCH_BATCH; i++)
+			ptrack_bench_next(&gen, &bids[i]);
+
+		INSTR_TIME_SET_CURRENT(start_time);
+		for (i = 0; i < PTRACK_BENCH_BATCH; i++)
+		{
+			ctx.bid = bids[i];
+			if (ptrack_block_changed(&ctx, lsn))
+				changed++;
+		}
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start_time);
+
+		batch_ns[b] = INSTR_TIME_GET_DOUBLE(duration) * 1e9 / PTRACK_BENCH_BATCH;
+	}
+
+	ptrack_bench_result(values, (int64) nbatches * PTRACK_BENCH_BATCH,
+						batch_ns, nbatches);
+	values[7] = Int64GetDatum(changed);
+	pfree(batch_ns);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+#else
+	ptrack_bench_unsupported();
+	PG_RETURN_NULL();
+#endif
+}
+
+/*
+ * Write the main map to a scratch file with ptrack.flush_method the given
+ * number of times, exactly as ptrack checkpoint does, and remove the file.
+ */
+PG_FUNCTION_INFO_V1(ptrack_bench_flush);
+Datum
+ptrack_bench_flush(PG_FUNCTION_ARGS)
+{
+#ifdef PTRACK_BENCH_ENABLED
+	int32		iterations = PG_GETARG_INT32(0);
+	TupleDesc	tupdesc;
+	Datum		values[6];
+	bool		nulls[6] = {false};
+	char		dir[MAXPGPATH];
+	char		path[MAXPGPATH];
+	double	   *iteration_ms;
+	double		total_ms = 0;
+	uint64		written = 0;
+	uint64		used_slots = 0;
+	int			i;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (ptrack_map_size == 0 || ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (iterations <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("number of iterations must be positive")));
+
+	/* Directory of temporary files is created on demand */
+	snprintf(dir, MAXPGPATH, "%s/base/%s", DataDir, PG_TEMP_FILES_DIR);
+	if (MakePGDirectory(dir) < 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m", dir)));
+	snprintf(path, MAXPGPATH, "%s/%s", dir, PTRACK_BENCH_MAP_NAME);
+
+	iteration_ms = palloc(iterations * sizeof(double));
+
+	for (i = 0; i < iterations; i++)
+	{
+		instr_time	start_time;
+		instr_time	duration;
+
+		CHECK_FOR_INTERRUPTS();
+
+		/* Regions are written in turn, just like by checkpoints */
+		INSTR_TIME_SET_CURRENT(start_time);
+		written = ptrackWriteMapCopy(path, i + 1, &used_slots);
+		INSTR_TIME_SET_CURRENT(duration);
+		INSTR_TIME_SUBTRACT(duration, start_time);
+
+		iteration_ms[i] = INSTR_TIME_GET_MILLISEC(duration);
+		total_ms += iteration_ms[i];
+	}
+
+	if (unlink(path) != 0)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not remove file \"%s\": %m", path)));
+
+	qsort(iteration_ms, iterations, sizeof(double), ptrack_bench_double_cmp);
+
+	values[0] = Int64GetDatum((int64) written);
+	values[1] = Int64GetDatum((int64) used_slots);
+	values[2] = Float8GetDatum(total_ms > 0 ? written * iterations / (total_ms * 1000.0) : 0);
+	values[3] = Float8GetDatum(ptrack_bench_percentile(iteration_ms, iterations, 0.5));
+	values[4] = Float8GetDatum(ptrack_bench_percentile(iteration_ms, iterations, 0.9));
+	values[5] = Float8GetDatum(iteration_ms[iterations - 1]);
+	pfree(iteration_ms);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+#else
+	ptrack_bench_unsupported();
+	PG_RETURN_NULL();
+#endif
+}
@@ -8,17 +8,29 @@
  *	  ptrack/engine.c
  *
  * INTERFACE ROUTINES (PostgreSQL side)
+ *	  ptrackMapMmap()          --- map memory for ptrack_map outside of the
+ *	                               main shared memory segment if needed
  *	  ptrackMapInit()          --- allocate new shared ptrack_map
  *	  ptrackCleanFiles()       --- remove ptrack files
  *	  assign_ptrack_map_size() --- ptrack_map_size GUC assign callback
+ *	  assign_ptrack_partitions() --- ptrack.partitions GUC assign callback
+ *	  ptrack_file_lsn()        --- LSN of the whole file change of segment
+ *	  ptrack_is_tracked()      --- whether fork is tracked by the policy
+ *	  ptrackBackfill()         --- mark blocks changed before init_lsn from WAL
+ *	  ptrackWalTrack()         --- mark blocks referenced by flushed WAL
+ *	  ptrackRecoveryFlush()    --- mark blocks written by the startup process
+ *	  ptrackSyncMarks()        --- mark all pending changes before map scan
  *	  ptrack_walkdir()         --- walk directory and mark all blocks of all
  *	                               data files in ptrack_map
  *	  ptrack_mark_block()      --- mark single page in ptrack_map
+ *	  ptrackStatsInit()        --- initialize shared ptrack counters
+ *	  ptrackStatsReset()       --- reset shared ptrack counters
  *
  */
 
 #include "postgres.h"
 
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
@@ -30,26 +42,161 @@
 #include "access/parallel.h"
 #include "access/xlog.h"
 #if PG_VERSION_NUM >= 150000
+#include "access/heapam_xlog.h"
+#include "access/rmgr.h"
+#include "access/visibilitymap.h"
+#include "access/xlogreader.h"
 #include "access/xlogrecovery.h"
+#include "access/xlogutils.h"
+#include "commands/dbcommands_xlog.h"
 #include "storage/fd.h"
 #endif
+#include "catalog/pg_control.h"
 #include "catalog/pg_tablespace.h"
+#include "common/controldata_utils.h"
+#include "common/relpath.h"
 #include "miscadmin.h"
+#include "portability/instr_time.h"
 #include "port/pg_crc32c.h"
+#include "storage/bufpage.h"
 #include "storage/copydir.h"
 #if PG_VERSION_NUM >= 120000
 #include "storage/md.h"
 #include "storage/sync.h"
 #endif
+#include "storage/lwlock.h"
 #include "storage/reinit.h"
+#include "storage/shmem.h"
 #include "storage/smgr.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
 #include "utils/pg_lsn.h"
+#include "utils/timestamp.h"
+
+#ifdef USE_LIBURING
+#include <liburing.h>
+#endif
+
+/*
+ * Separate mapping of the map is inherited by backends through fork(), so it
+ * is not available with EXEC_BACKEND.  NUMA policy is set with mbind()
+ * syscall directly, so that there is no dependency on libnuma.
+ */
+#if defined(__linux__) && !defined(EXEC_BACKEND)
+#define PTRACK_MAP_MMAP
+#include <sys/syscall.h>
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+#endif
+
+/* Max number of NUMA nodes accepted in ptrack.numa_nodes */
+#define PTRACK_NUMA_MAX_NODES 1024
+#define PTRACK_NUMA_MASK_WORDS (PTRACK_NUMA_MAX_NODES / (8 * sizeof(unsigned long)))
 
 #include "ptrack.h"
 #include "engine.h"
 
+PtrackStats *ptrack_stats = NULL;
+
+static bool ptrack_clean_partition_files(bool all);
+
+/* Registry of files changed as a whole, see ptrack_register_file() */
+static HTAB *ptrack_files = NULL;
+static LWLock *ptrack_files_lock = NULL;
+
+/*
+ * Shared state of WAL tracking mode, see ptrackWalTrack().  All WAL before
+ * tracked_lsn is marked in the maps.  Only the holder of ptrack_wal_lock
+ * marks WAL and moves tracked_lsn.
+ */
+typedef struct PtrackWalState
+{
+	pg_atomic_uint64 tracked_lsn;
+}			PtrackWalState;
+
+static PtrackWalState *ptrack_wal = NULL;
+static LWLock *ptrack_wal_lock = NULL;
+
+/*
+ * Blocks written by the startup process are not marked one by one, but are
+ * added to a ring in shared memory, which is marked in bulk with a single
+ * replay LSN, see ptrackRecoveryFlush().  Startup process is the only one
+ * adding blocks, so it takes no locks until the ring is full.  Head and tail
+ * are counted from the start of the ring and never wrap.
+ */
+#define PTRACK_RECOVERY_RING_SIZE 4096
+
+typedef struct PtrackRecoveryRing
+{
+	pg_atomic_uint64 head;		/* next entry to be added */
+	pg_atomic_uint64 tail;		/* next entry to be marked */
+	PtBlockId	entries[PTRACK_RECOVERY_RING_SIZE];
+}			PtrackRecoveryRing;
+
+static PtrackRecoveryRing *ptrack_recovery_ring = NULL;
+static LWLock *ptrack_recovery_lock = NULL;
+
+/* WAL is marked in batches of up to PTRACK_WAL_BATCH_SLOTS map slots */
+#define PTRACK_WAL_BATCH_SLOTS (64 * 1024)
+
+/* See ptrack_batch_add() */
+#define PTRACK_BATCH_SLOT_BITS 48
+#define PTRACK_BATCH_SLOT_MASK ((UINT64CONST(1) << PTRACK_BATCH_SLOT_BITS) - 1)
+
+/*
+ * Per process cache of persistence of relations for ptrack.track_unlogged,
+ * see ptrack_relation_is_unlogged()
+ */
+typedef struct PtrackUnloggedEntry
+{
+	RelFileNode rnode;
+	bool		unlogged;
+}			PtrackUnloggedEntry;
+
+static HTAB *ptrack_unlogged_cache = NULL;
+static uint64 ptrack_unlogged_cache_generation = 0;
+
+#ifdef PTRACK_MAP_MMAP
+/* Separate mapping of the map, created by postmaster and kept till exit */
+static PtrackMap ptrack_map_mapping = NULL;
+#endif
+
+/*
+ * Map is written through PTRACK_FLUSH_NBUFS aligned buffers, so that up to
+ * PTRACK_FLUSH_NBUFS - 1 writes may be in flight with io_uring, while the
+ * next buffer is filled.  Other methods write every buffer synchronously.
+ */
+#define PTRACK_FLUSH_BUF_SIZE (256 * 1024)
+#define PTRACK_FLUSH_NBUFS 4
+
+typedef struct PtrackWriter
+{
+	int			fd;
+	int			method;			/* PtrackFlushMethod actually used */
+	char	   *mem;			/* palloc'ed memory of all buffers */
+	char	   *bufs[PTRACK_FLUSH_NBUFS];
+	size_t		lens[PTRACK_FLUSH_NBUFS];	/* size of submitted write */
+	bool		busy[PTRACK_FLUSH_NBUFS];	/* write is in flight */
+	int			cur;			/* buffer being filled */
+	size_t		used;			/* bytes in the current buffer */
+	uint64		offset;			/* file offset of the current buffer */
+	int			inflight;
+} PtrackWriter;
+
+#ifdef USE_LIBURING
+/* Ring is set up on first use and kept for the life of the process */
+static struct io_uring ptrack_ring;
+static bool ptrack_ring_ready = false;
+#endif
+
 /*
  * Check that path is accessible by us and return true if it is
  * not a directory.
@@ -72,13 +219,11 @@ ptrack_file_exists(const char *path)
 }
 
 /*
- * Write a piece of ptrack map to file and update CRC32 value.
+ * Write a piece of ptrack map to file.
  */
 static void
-ptrack_write_chunk(int fd, pg_crc32c *crc, char *chunk, size_t size)
+ptrack_write_chunk(int fd, const char *chunk, size_t size)
 {
-	COMP_CRC32C(*crc, (char *) chunk, size);
-
 	if (write(fd, chunk, size) != size)
 	{
 		/* If write didn't set errno, assume problem is no disk space */
@@ -87,380 +232,1882 @@ ptrack_write_chunk(int fd, pg_crc32c *crc, char *chunk, size_t size)
 
 		ereport(ERROR,
 				(errcode_for_file_access(),
-				 errmsg("could not write file \"%s\": %m", PTRACK_PATH_TMP)));
+				 errmsg("could not write file \"%s\": %m", PTRACK_PATH)));
 	}
 }
 
 /*
- * Delete ptrack files when ptrack is disabled.
- *
- * This is performed by postmaster at start,
- * so that there are no concurrent delete issues.
+ * Set position in the map file.
  */
-void
-ptrackCleanFiles(void)
+static void
+ptrack_seek(int fd, uint64 offset)
 {
-	char		ptrack_path[MAXPGPATH];
-	char		ptrack_path_tmp[MAXPGPATH];
-
-	sprintf(ptrack_path, "%s/%s", DataDir, PTRACK_PATH);
-	sprintf(ptrack_path_tmp, "%s/%s", DataDir, PTRACK_PATH_TMP);
-
-	elog(DEBUG1, "ptrack: clean map files");
-
-	if (ptrack_file_exists(ptrack_path_tmp))
-		durable_unlink(ptrack_path_tmp, LOG);
-
-	if (ptrack_file_exists(ptrack_path))
-		durable_unlink(ptrack_path, LOG);
+	if (lseek(fd, (off_t) offset, SEEK_SET) != (off_t) offset)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in file \"%s\": %m", PTRACK_PATH)));
 }
 
 /*
- * Read ptrack map file into shared memory pointed by ptrack_map.
- * This function is called only at startup,
- * so data is read directly (without synchronization).
+ * Write exactly size bytes at offset.
  */
-static bool
-ptrackMapReadFromFile(const char *ptrack_path)
+static void
+ptrack_pwrite(int fd, const char *buf, size_t size, uint64 offset)
 {
-	elog(DEBUG1, "ptrack read map");
+	size_t		written = 0;
 
-	/* Do actual file read */
+	while (written < size)
 	{
-		int			ptrack_fd;
-		size_t		readed;
+		ssize_t		rc;
 
-		ptrack_fd = BasicOpenFile(ptrack_path, O_RDWR | PG_BINARY);
+#if PG_VERSION_NUM >= 120000
+		rc = pg_pwrite(fd, buf + written, size - written, offset + written);
+#else
+		if (lseek(fd, (off_t) (offset + written), SEEK_SET) < 0)
+			rc = -1;
+		else
+			rc = write(fd, buf + written, size - written);
+#endif
+		if (rc <= 0)
+		{
+			if (rc < 0 && errno == EINTR)
+				continue;
+			/* If write didn't set errno, assume problem is no disk space */
+			if (rc == 0 || errno == 0)
+				errno = ENOSPC;
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not write file \"%s\": %m", PTRACK_PATH)));
+		}
+		written += rc;
+	}
+}
 
-		if (ptrack_fd < 0)
-			elog(ERROR, "ptrack read map: failed to open map file \"%s\": %m", ptrack_path);
+#ifdef USE_LIBURING
+/*
+ * Wait for completion of one write submitted to io_uring.  All writes are
+ * waited for before reporting an error, so that the kernel does not access
+ * buffers after they are freed.
+ */
+static void
+ptrack_writer_reap(PtrackWriter *w)
+{
+	struct io_uring_cqe *cqe;
+	int			rc;
+	int			bufno;
+	int			res;
 
-		readed = 0;
-		do
-		{
-			ssize_t last_readed;
+	do
+	{
+		rc = io_uring_wait_cqe(&ptrack_ring, &cqe);
+	} while (rc == -EINTR);
 
-			/*
-			 * Try to read as much as possible
-			 * (linux guaranteed only 0x7ffff000 bytes in one read
-			 * operation, see read(2))
-			 */
-			last_readed = read(ptrack_fd, (char *) ptrack_map + readed, PtrackActualSize - readed);
+	if (rc < 0)
+		elog(PANIC, "ptrack checkpoint: could not wait for io_uring completion: %s",
+			 strerror(-rc));
 
-			if (last_readed > 0)
-			{
-				readed += last_readed;
-			}
-			else if (last_readed == 0)
-			{
-				/*
-				 * We don't try to read more that PtrackActualSize and
-				 * file size was already checked in ptrackMapInit()
-				 */
-				elog(ERROR, "ptrack read map: unexpected end of file while reading map file \"%s\", expected to read %zu, but read only %zu bytes",
-							ptrack_path, (size_t)PtrackActualSize, readed);
-			}
-			else if (last_readed < 0 && errno != EINTR)
-			{
-				ereport(WARNING,
-						(errcode_for_file_access(),
-						 errmsg("ptrack read map: could not read map file \"%s\": %m", ptrack_path)));
-				close(ptrack_fd);
-				return false;
-			}
-		} while (readed < PtrackActualSize);
+	bufno = (int) (uintptr_t) io_uring_cqe_get_data(cqe);
+	res = cqe->res;
+	io_uring_cqe_seen(&ptrack_ring, cqe);
 
-		close(ptrack_fd);
-	}
+	w->busy[bufno] = false;
+	w->inflight--;
 
-	/* Check PTRACK_MAGIC */
-	if (strcmp(ptrack_map->magic, PTRACK_MAGIC) != 0)
+	if (res < 0 || (size_t) res != w->lens[bufno])
 	{
-		elog(WARNING, "ptrack read map: wrong map format of file \"%s\"", ptrack_path);
-		return false;
-	}
+		while (w->inflight > 0)
+			ptrack_writer_reap(w);
 
-	/* Check ptrack version inside old ptrack map */
-	if (ptrack_map->version_num != PTRACK_MAP_FILE_VERSION_NUM)
-	{
-		ereport(WARNING,
-				(errcode(ERRCODE_DATA_CORRUPTED),
-				 errmsg("ptrack read map: map format version %d in the file \"%s\" is incompatible with file format of extension %d",
-						ptrack_map->version_num, ptrack_path, PTRACK_MAP_FILE_VERSION_NUM),
-				 errdetail("Deleting file \"%s\" and reinitializing ptrack map.", ptrack_path)));
-		return false;
+		/* Short write is reported as ENOSPC, just like write() does */
+		errno = res < 0 ? -res : ENOSPC;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", PTRACK_PATH)));
 	}
+}
+#endif
 
-	/* Check CRC */
-	{
-		pg_crc32c	crc;
-		pg_crc32c  *file_crc;
+/*
+ * Submit the current buffer padded to PTRACK_MAP_IO_ALIGN and switch to the
+ * next one.  Padding always falls into the space reserved in the region.
+ */
+static void
+ptrack_writer_submit(PtrackWriter *w)
+{
+	size_t		len = TYPEALIGN(PTRACK_MAP_IO_ALIGN, w->used);
+	int			bufno = w->cur;
 
-		INIT_CRC32C(crc);
-		COMP_CRC32C(crc, (char *) ptrack_map, PtrackCrcOffset);
-		FIN_CRC32C(crc);
+	if (w->used == 0)
+		return;
 
-		file_crc = (pg_crc32c *) ((char *) ptrack_map + PtrackCrcOffset);
+	MemSet(w->bufs[bufno] + w->used, 0, len - w->used);
+	w->lens[bufno] = len;
 
-		/*
-		 * Read ptrack map values without atomics during initialization, since
-		 * postmaster is the only user right now.
-		 */
-		elog(DEBUG1, "ptrack read map: crc %u, file_crc %u, init_lsn %X/%X",
-			 crc, *file_crc, (uint32) (ptrack_map->init_lsn.value >> 32), (uint32) ptrack_map->init_lsn.value);
+#ifdef USE_LIBURING
+	if (w->method == PTRACK_FLUSH_IO_URING)
+	{
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&ptrack_ring);
+		int			rc;
+
+		/* Ring is deeper than the number of buffers */
+		Assert(sqe != NULL);
+		io_uring_prep_write(sqe, w->fd, w->bufs[bufno], len, w->offset);
+		io_uring_sqe_set_data(sqe, (void *) (uintptr_t) bufno);
 
-		if (!EQ_CRC32C(*file_crc, crc))
+		rc = io_uring_submit(&ptrack_ring);
+		if (rc < 0)
 		{
-			ereport(WARNING,
-					(errcode(ERRCODE_DATA_CORRUPTED),
-					 errmsg("ptrack read map: incorrect checksum of file \"%s\"", ptrack_path),
-					 errdetail("Deleting file \"%s\" and reinitializing ptrack map.", ptrack_path)));
-			return false;
+			while (w->inflight > 0)
+				ptrack_writer_reap(w);
+			errno = -rc;
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not write file \"%s\": %m", PTRACK_PATH)));
 		}
+
+		w->busy[bufno] = true;
+		w->inflight++;
 	}
+	else
+#endif
+		ptrack_pwrite(w->fd, w->bufs[bufno], len, w->offset);
 
-	return true;
+	w->offset += len;
+	w->used = 0;
+	w->cur = (w->cur + 1) % PTRACK_FLUSH_NBUFS;
+
+#ifdef USE_LIBURING
+	/* Wait until the next buffer is free */
+	while (w->busy[w->cur])
+		ptrack_writer_reap(w);
+#endif
 }
 
 /*
- * Read PTRACK_PATH file into already allocated shared memory, check header and checksum
- * or create new file, if there was no PTRACK_PATH file on disk.
+ * Open map file for writing with ptrack.flush_method.  If direct I/O or
+ * io_uring is not available at runtime (e.g. not supported by filesystem or
+ * kernel), fall back to buffered or synchronous writes with a WARNING.
  */
-void
-ptrackMapInit(void)
+static void
+ptrack_writer_open(PtrackWriter *w, const char *ptrack_path)
 {
-	char		ptrack_path[MAXPGPATH];
-	struct stat stat_buf;
-	bool		is_new_map = true;
-
-	elog(DEBUG1, "ptrack init");
-
-	if (ptrack_map_size == 0)
-		return;
+	int			i;
 
-	sprintf(ptrack_path, "%s/%s", DataDir, PTRACK_PATH);
+	MemSet(w, 0, sizeof(PtrackWriter));
+	w->method = ptrack_flush_method;
 
-	if (stat(ptrack_path, &stat_buf) == 0)
+	if (w->method != PTRACK_FLUSH_BUFFERED)
 	{
-		elog(DEBUG3, "ptrack init: map \"%s\" detected, trying to load", ptrack_path);
-		if (stat_buf.st_size != PtrackActualSize)
+		w->fd = BasicOpenFile(ptrack_path, O_RDWR | PG_BINARY | PG_O_DIRECT);
+		if (w->fd < 0 && errno == EINVAL)
 		{
-			elog(WARNING, "ptrack init: unexpected \"%s\" file size %zu != " UINT64_FORMAT ", deleting",
-				 ptrack_path, (Size) stat_buf.st_size, PtrackActualSize);
-			durable_unlink(ptrack_path, LOG);
+			static bool warned = false;
+
+			/* Filesystem won't change, so do not repeat it every checkpoint */
+			if (!warned)
+				ereport(WARNING,
+						(errcode_for_file_access(),
+						 errmsg("ptrack checkpoint: could not open file \"%s\" for direct I/O: %m", ptrack_path),
+						 errdetail("Writing map through OS cache.")));
+			warned = true;
+			w->method = PTRACK_FLUSH_BUFFERED;
 		}
-		else if (ptrackMapReadFromFile(ptrack_path))
+	}
+
+	if (w->method == PTRACK_FLUSH_BUFFERED)
+		w->fd = BasicOpenFile(ptrack_path, O_RDWR | PG_BINARY);
+
+	if (w->fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack checkpoint: could not open file \"%s\": %m", ptrack_path)));
+
+#ifdef USE_LIBURING
+	if (w->method == PTRACK_FLUSH_IO_URING && !ptrack_ring_ready)
+	{
+		int			rc = io_uring_queue_init(PTRACK_FLUSH_NBUFS * 2, &ptrack_ring, 0);
+
+		if (rc < 0)
 		{
-			is_new_map = false;
+			ereport(WARNING,
+					(errmsg("ptrack checkpoint: could not set up io_uring: %s", strerror(-rc)),
+					 errdetail("Writing map with synchronous direct I/O.")));
+			w->method = PTRACK_FLUSH_DIRECT;
 		}
 		else
-		{
-			/*
-			 * ptrackMapReadFromFile failed
-			 * this can be crc mismatch, version mismatch and other errors
-			 * We treat it as non fatal and create new map in memory,
-			 * that will be written on disk on checkpoint
-			 */
-			elog(WARNING, "ptrack init: broken map file \"%s\", deleting",
-				 ptrack_path);
-			durable_unlink(ptrack_path, LOG);
-		}
+			ptrack_ring_ready = true;
 	}
+#endif
 
-	/*
-	 * Initialyze memory for new map
-	 */
-	if (is_new_map)
-	{
-		memcpy(ptrack_map->magic, PTRACK_MAGIC, PTRACK_MAGIC_SIZE);
-		ptrack_map->version_num = PTRACK_MAP_FILE_VERSION_NUM;
-		ptrack_map->init_lsn.value = InvalidXLogRecPtr;
-		/*
-		 * Fill entries with InvalidXLogRecPtr
-		 * (InvalidXLogRecPtr is actually 0)
-		 */
-		memset(ptrack_map->entries, 0, PtrackContentNblocks * sizeof(pg_atomic_uint64));
-		/*
-		 * Last part of memory representation of ptrack_map (crc) is actually unused
-		 * so leave it as it is
-		 */
-	}
+	w->mem = palloc(PTRACK_FLUSH_NBUFS * PTRACK_FLUSH_BUF_SIZE + PTRACK_MAP_IO_ALIGN);
+	for (i = 0; i < PTRACK_FLUSH_NBUFS; i++)
+		w->bufs[i] = (char *) TYPEALIGN(PTRACK_MAP_IO_ALIGN, w->mem) +
+			i * PTRACK_FLUSH_BUF_SIZE;
 }
 
 /*
- * Write content of ptrack_map to file.
+ * Write all buffered data and wait for completion of all writes.
  */
-void
-ptrackCheckpoint(void)
+static void
+ptrack_writer_flush(PtrackWriter *w)
 {
-	int			ptrack_tmp_fd;
-	pg_crc32c	crc;
-	char		ptrack_path[MAXPGPATH];
-	char		ptrack_path_tmp[MAXPGPATH];
-	XLogRecPtr	init_lsn;
-	pg_atomic_uint64 buf[PTRACK_BUF_SIZE];
-	struct stat stat_buf;
-	uint64		i = 0;
-	uint64		j = 0;
+	ptrack_writer_submit(w);
 
-	elog(DEBUG1, "ptrack checkpoint");
+#ifdef USE_LIBURING
+	while (w->inflight > 0)
+		ptrack_writer_reap(w);
+#endif
+}
 
-	/*
-	 * Set the buffer to all zeros for sanity.  Otherwise, if atomics
-	 * simulation via spinlocks is used (e.g. with --disable-atomics) we could
-	 * write garbage into the sema field of pg_atomic_uint64, which will cause
-	 * spinlocks to stuck after restart.
-	 */
-	MemSet(buf, 0, sizeof(buf));
+/*
+ * Continue writing at offset, which must be aligned to PTRACK_MAP_IO_ALIGN.
+ */
+static void
+ptrack_writer_seek(PtrackWriter *w, uint64 offset)
+{
+	Assert(offset % PTRACK_MAP_IO_ALIGN == 0);
 
-	/* Delete ptrack_map and all related files, if ptrack was switched off */
-	if (ptrack_map_size == 0)
+	ptrack_writer_submit(w);
+	w->offset = offset;
+}
+
+static void
+ptrack_writer_write(PtrackWriter *w, const char *data, size_t size)
+{
+	while (size > 0)
 	{
-		return;
-	}
-	else if (ptrack_map == NULL)
-		elog(ERROR, "ptrack checkpoint: map is not loaded at checkpoint time");
+		size_t		n = Min(size, PTRACK_FLUSH_BUF_SIZE - w->used);
 
-	sprintf(ptrack_path_tmp, "%s/%s", DataDir, PTRACK_PATH_TMP);
-	sprintf(ptrack_path, "%s/%s", DataDir, PTRACK_PATH);
+		memcpy(w->bufs[w->cur] + w->used, data, n);
+		w->used += n;
+		data += n;
+		size -= n;
 
-	elog(DEBUG1, "ptrack checkpoint: started");
+		if (w->used == PTRACK_FLUSH_BUF_SIZE)
+			ptrack_writer_submit(w);
+	}
+}
 
-	/* Map content is protected with CRC */
-	INIT_CRC32C(crc);
+static void
+ptrack_writer_close(PtrackWriter *w)
+{
+	Assert(w->inflight == 0);
 
-	ptrack_tmp_fd = BasicOpenFile(ptrack_path_tmp,
-								  O_CREAT | O_TRUNC | O_WRONLY | PG_BINARY);
+	pfree(w->mem);
 
-	if (ptrack_tmp_fd < 0)
+	if (close(w->fd) != 0)
 		ereport(ERROR,
 				(errcode_for_file_access(),
-				 errmsg("ptrack checkpoint: could not create file \"%s\": %m", ptrack_path_tmp)));
-
-	/*
-	 * We are writing ptrack map values to file, but we want to simply map it
-	 * into the memory with mmap after a crash/restart. That way, we have to
-	 * write values taking into account all paddings/alignments.
-	 *
-	 * Write both magic and version_num at once.
-	 */
-
-	/*
-	 * Previously we read from the field magic, now we read from the beginning
-	 * of the structure PtrackMapHdr. Make sure nothing has changed since then.
-	 */
-	StaticAssertStmt(
-		offsetof(PtrackMapHdr, magic) == 0,
-		"old write format for PtrackMapHdr.magic and PtrackMapHdr.version_num "
-		"is not upward-compatible");
-
-	ptrack_write_chunk(ptrack_tmp_fd, &crc, (char *) ptrack_map,
-					   offsetof(PtrackMapHdr, init_lsn));
-
-	init_lsn = pg_atomic_read_u64(&ptrack_map->init_lsn);
-
-	/* Set init_lsn during checkpoint if it is not set yet */
-	if (init_lsn == InvalidXLogRecPtr)
-	{
-		XLogRecPtr	new_init_lsn;
-
-		if (RecoveryInProgress())
-			new_init_lsn = GetXLogReplayRecPtr(NULL);
-		else
-			new_init_lsn = GetXLogInsertRecPtr();
-
-		pg_atomic_write_u64(&ptrack_map->init_lsn, new_init_lsn);
-		init_lsn = new_init_lsn;
-	}
+				 errmsg("ptrack checkpoint: could not close file \"%s\": %m", PTRACK_PATH)));
+}
 
-	/* Put init_lsn in the same buffer */
-	buf[j].value = init_lsn;
-	j++;
+/*
+ * Read exactly size bytes from the map file.  Returns false with WARNING on
+ * error or unexpected end of file.
+ */
+static bool
+ptrack_read_full(int fd, const char *ptrack_path, char *buf, size_t size)
+{
+	size_t		readed = 0;
 
-	/*
-	 * Iterate over ptrack map actual content and sync it to file.  It's
-	 * essential to read each element atomically to avoid partial reads, since
-	 * map can be updated concurrently without any lock.
-	 */
-	while (i < PtrackContentNblocks)
+	do
 	{
-		XLogRecPtr	lsn;
+		ssize_t		last_readed;
 
 		/*
-		 * We store LSN values as pg_atomic_uint64 in the ptrack map, but
-		 * pg_atomic_read_u64() returns uint64.  That way, we have to put this
-		 * lsn into the buffer array of pg_atomic_uint64's.  We are the only
-		 * one who write into this buffer, so we do it without locks.
-		 *
-		 * TODO: is it safe and can we do any better?
+		 * Try to read as much as possible (linux guaranteed only 0x7ffff000
+		 * bytes in one read operation, see read(2))
 		 */
-		lsn = pg_atomic_read_u64(&ptrack_map->entries[i]);
-		buf[j].value = lsn;
+		last_readed = read(fd, buf + readed, size - readed);
 
-		i++;
-		j++;
-
-		if (j == PTRACK_BUF_SIZE)
+		if (last_readed > 0)
+			readed += last_readed;
+		else if (last_readed == 0)
 		{
-			size_t		writesz = sizeof(buf); /* Up to ~2 GB for buffer size seems
-												* to be more than enough, so never
-												* going to overflow. */
-
-			/*
-			 * We should not have any alignment issues here, since sizeof()
-			 * takes into account all paddings for us.
-			 */
-			ptrack_write_chunk(ptrack_tmp_fd, &crc, (char *) buf, writesz);
-			elog(DEBUG5, "ptrack checkpoint: i " UINT64_FORMAT ", j " UINT64_FORMAT ", writesz %zu PtrackContentNblocks " UINT64_FORMAT,
-				 i, j, writesz, (uint64) PtrackContentNblocks);
-
-			j = 0;
+			elog(WARNING, "ptrack read map: unexpected end of file while reading map file \"%s\", expected to read %zu, but read only %zu bytes",
+				 ptrack_path, size, readed);
+			return false;
 		}
-	}
-
-	/* Write if anything left */
-	if ((i + 1) % PTRACK_BUF_SIZE != 0)
-	{
-		size_t		writesz = sizeof(pg_atomic_uint64) * j;
+		else if (errno != EINTR)
+		{
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("ptrack read map: could not read map file \"%s\": %m", ptrack_path)));
+			return false;
+		}
+	} while (readed < size);
+
+	return true;
+}
+
+/*
+ * Delete ptrack files when ptrack is disabled.
+ *
+ * This is performed by postmaster at start,
+ * so that there are no concurrent delete issues.
+ */
+void
+ptrackCleanFiles(void)
+{
+	char		ptrack_path[MAXPGPATH];
+	char		ptrack_path_tmp[MAXPGPATH];
+
+	sprintf(ptrack_path, "%s/%s", DataDir, PTRACK_PATH);
+	sprintf(ptrack_path_tmp, "%s/%s", DataDir, PTRACK_PATH_TMP);
+
+	elog(DEBUG1, "ptrack: clean map files");
+
+	if (ptrack_file_exists(ptrack_path_tmp))
+		durable_unlink(ptrack_path_tmp, LOG);
+
+	if (ptrack_file_exists(ptrack_path))
+		durable_unlink(ptrack_path, LOG);
+
+	sprintf(ptrack_path, "%s/%s", DataDir, PTRACK_FILES_PATH);
+	if (ptrack_file_exists(ptrack_path))
+		durable_unlink(ptrack_path, LOG);
+
+	sprintf(ptrack_path, "%s/%s", DataDir, PTRACK_POLICY_PATH);
+	if (ptrack_file_exists(ptrack_path))
+		durable_unlink(ptrack_path, LOG);
+
+	ptrack_clean_partition_files(true);
+}
+
+/*
+ * Read and check header and chunk infos of the map file region.  Returns
+ * false if the region is not valid, e.g. it was never written or its header
+ * is broken.  Chunk infos are returned in palloc'ed memory.
+ */
+static bool
+ptrack_read_region_hdr(int fd, const char *ptrack_path, uint64 nslots,
+					   uint32 region, PtrackMapFileHdr *hdr,
+					   PtrackMapChunkInfo **chunks)
+{
+	uint64		nchunks = PTRACK_MAP_NCHUNKS(nslots);
+	uint64		chunkno;
+	pg_crc32c	crc;
+
+	*chunks = NULL;
+
+	ptrack_seek(fd, region * PTRACK_MAP_REGION_SIZE(nslots));
+	if (!ptrack_read_full(fd, ptrack_path, (char *) hdr, sizeof(*hdr)))
+		return false;
+
+	/* Region was never written */
+	if (hdr->generation == 0 && hdr->crc == 0)
+		return false;
+
+	/* Check PTRACK_MAGIC */
+	if (memcmp(hdr->magic, PTRACK_MAGIC, PTRACK_MAGIC_SIZE) != 0)
+	{
+		elog(WARNING, "ptrack read map: wrong map format of region %u of file \"%s\"",
+			 region, ptrack_path);
+		return false;
+	}
+
+	/* Check ptrack version inside old ptrack map */
+	if (hdr->version_num != PTRACK_MAP_FILE_VERSION_NUM)
+	{
+		ereport(WARNING,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("ptrack read map: map format version %d in the file \"%s\" is incompatible with file format of extension %d",
+						hdr->version_num, ptrack_path, PTRACK_MAP_FILE_VERSION_NUM)));
+		return false;
+	}
+
+	/* Map can be reused only if ptrack.map_size is not changed */
+	if (hdr->nslots != nslots || hdr->chunk_slots != PTRACK_MAP_CHUNK_SLOTS)
+	{
+		elog(WARNING, "ptrack read map: map file \"%s\" of " UINT64_FORMAT " slots does not match map size of " UINT64_FORMAT " slots",
+			 ptrack_path, hdr->nslots, nslots);
+		return false;
+	}
+
+	*chunks = palloc(nchunks * sizeof(PtrackMapChunkInfo));
+	if (!ptrack_read_full(fd, ptrack_path, (char *) *chunks,
+						  nchunks * sizeof(PtrackMapChunkInfo)))
+		return false;
+
+	/* Header and chunk infos are protected with their own CRC */
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, (char *) hdr, offsetof(PtrackMapFileHdr, crc));
+	COMP_CRC32C(crc, (char *) *chunks, nchunks * sizeof(PtrackMapChunkInfo));
+	FIN_CRC32C(crc);
+
+	elog(DEBUG1, "ptrack read map: region %u, generation " UINT64_FORMAT ", crc %u, file_crc %u, init_lsn %X/%X, flush_lsn %X/%X",
+		 region, hdr->generation, crc, hdr->crc,
+		 (uint32) (hdr->init_lsn >> 32), (uint32) hdr->init_lsn,
+		 (uint32) (hdr->flush_lsn >> 32), (uint32) hdr->flush_lsn);
+
+	if (!EQ_CRC32C(hdr->crc, crc) ||
+		hdr->generation % PTRACK_MAP_NREGIONS != region)
+	{
+		ereport(WARNING,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("ptrack read map: incorrect checksum of header of region %u of file \"%s\"",
+						region, ptrack_path)));
+		return false;
+	}
+
+	/* Now sizes of chunks can be trusted */
+	for (chunkno = 0; chunkno < nchunks; chunkno++)
+	{
+		if ((*chunks)[chunkno].size > PTRACK_MAP_CHUNK_SLOTS * sizeof(uint64))
+		{
+			elog(WARNING, "ptrack read map: invalid size %u of chunk " UINT64_FORMAT " of file \"%s\"",
+				 (*chunks)[chunkno].size, chunkno, ptrack_path);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Read ptrack map file into shared memory of the map partition.
+ * This function is called only at startup,
+ * so data is read directly (without synchronization).
+ *
+ * Map file holds two regions, which are overwritten by checkpoints in turn,
+ * and the region with the greatest generation is loaded.  If its header is
+ * broken, older region is used, but only if it still covers all changes,
+ * which will not be replayed from WAL, i.e. its flush_lsn is not older than
+ * the redo pointer of the last checkpoint.
+ *
+ * Only the header is required to be intact.  Chunks with wrong CRC are
+ * filled with flush_lsn of the region, which is not older than any slot
+ * written, so their blocks are reported as changed and no change is lost.
+ */
+static bool
+ptrackMapReadFromFile(PtrackPartition *part, const char *ptrack_path)
+{
+	PtrackMapFileHdr hdrs[PTRACK_MAP_NREGIONS];
+	PtrackMapChunkInfo *region_chunks[PTRACK_MAP_NREGIONS];
+	bool		valid[PTRACK_MAP_NREGIONS];
+	PtrackMapFileHdr *hdr = NULL;
+	PtrackMapChunkInfo *chunks = NULL;
+	uint64		slots[PTRACK_MAP_CHUNK_SLOTS];
+	char		buf[PTRACK_MAP_CHUNK_SLOTS * sizeof(uint64) + sizeof(pg_crc32c)];
+	PtrackMap	map = part->map;
+	uint64		nslots_total = part->nslots;
+	uint64		nchunks = PTRACK_MAP_NCHUNKS(nslots_total);
+	uint64		damaged = 0;
+	uint64		chunkno;
+	ControlFileData *control_file;
+	bool		crc_ok;
+	struct stat stat_buf;
+	bool		result = false;
+	uint32		region;
+	int			ptrack_fd;
+
+	elog(DEBUG1, "ptrack read map");
+
+	ptrack_fd = BasicOpenFile(ptrack_path, O_RDONLY | PG_BINARY);
+
+	if (ptrack_fd < 0)
+		elog(ERROR, "ptrack read map: failed to open map file \"%s\": %m", ptrack_path);
+
+	if (fstat(ptrack_fd, &stat_buf) != 0 ||
+		stat_buf.st_size != PTRACK_MAP_FILE_SIZE(nslots_total))
+	{
+		elog(WARNING, "ptrack read map: unexpected \"%s\" file size %zu != " UINT64_FORMAT,
+			 ptrack_path, (Size) stat_buf.st_size, (uint64) PTRACK_MAP_FILE_SIZE(nslots_total));
+		close(ptrack_fd);
+		return false;
+	}
+
+	for (region = 0; region < PTRACK_MAP_NREGIONS; region++)
+	{
+		valid[region] = ptrack_read_region_hdr(ptrack_fd, ptrack_path,
+											   nslots_total, region,
+											   &hdrs[region],
+											   &region_chunks[region]);
+		if (valid[region] &&
+			(hdr == NULL || hdrs[region].generation > hdr->generation))
+		{
+			hdr = &hdrs[region];
+			chunks = region_chunks[region];
+		}
+	}
+
+	if (hdr == NULL)
+	{
+		elog(WARNING, "ptrack read map: no valid region in map file \"%s\"", ptrack_path);
+		goto cleanup;
+	}
+
+	/*
+	 * Changes made after flush_lsn are replayed from WAL on startup and
+	 * marked in the map again only if the last checkpoint started before it.
+	 */
+#if PG_VERSION_NUM >= 120000
+	control_file = get_controlfile(DataDir, &crc_ok);
+#else
+	control_file = get_controlfile(DataDir, NULL, &crc_ok);
+#endif
+	if (!crc_ok || hdr->flush_lsn < control_file->checkPointCopy.redo)
+	{
+		elog(WARNING, "ptrack read map: map file \"%s\" was flushed at %X/%X, before the last checkpoint redo pointer %X/%X",
+			 ptrack_path, (uint32) (hdr->flush_lsn >> 32), (uint32) hdr->flush_lsn,
+			 (uint32) (control_file->checkPointCopy.redo >> 32),
+			 (uint32) control_file->checkPointCopy.redo);
+		pfree(control_file);
+		goto cleanup;
+	}
+	pfree(control_file);
+
+	region = hdr->generation % PTRACK_MAP_NREGIONS;
+	if (!valid[(region + 1) % PTRACK_MAP_NREGIONS] && hdr->generation > 1)
+		elog(LOG, "ptrack read map: using region %u of generation " UINT64_FORMAT " of file \"%s\"",
+			 region, hdr->generation, ptrack_path);
+
+	ptrack_seek(ptrack_fd, region * PTRACK_MAP_REGION_SIZE(nslots_total) +
+				PTRACK_MAP_CHUNKS_OFFSET(nchunks));
+
+	for (chunkno = 0; chunkno < nchunks; chunkno++)
+	{
+		uint64		first = chunkno * PTRACK_MAP_CHUNK_SLOTS;
+		size_t		nslots = Min(nslots_total - first, PTRACK_MAP_CHUNK_SLOTS);
+		size_t		size = chunks[chunkno].size;
+		pg_crc32c	file_crc;
+		size_t		i;
+
+		/* Encoded slots are followed by the CRC of the chunk */
+		if (!ptrack_read_full(ptrack_fd, ptrack_path, buf, size + sizeof(pg_crc32c)))
+			goto cleanup;
+		memcpy(&file_crc, buf + size, sizeof(pg_crc32c));
+
+		if (!EQ_CRC32C(file_crc, ptrack_chunk_crc(hdr->generation, chunkno, buf, size)) ||
+			!ptrack_chunk_decode(chunks[chunkno].encoding, buf, size,
+								 slots, nslots))
+		{
+			elog(DEBUG1, "ptrack read map: chunk " UINT64_FORMAT " is corrupted", chunkno);
+			for (i = 0; i < nslots; i++)
+				slots[i] = hdr->flush_lsn;
+			damaged++;
+		}
+
+		/*
+		 * Read ptrack map values without atomics during initialization, since
+		 * postmaster is the only user right now.
+		 */
+		for (i = 0; i < nslots; i++)
+			pg_atomic_init_u64(&map->entries[first + i], slots[i]);
+	}
+
+	memcpy(map->magic, hdr->magic, PTRACK_MAGIC_SIZE);
+	map->version_num = hdr->version_num;
+	map->generation = hdr->generation;
+	pg_atomic_init_u64(&map->init_lsn, hdr->init_lsn);
+
+	if (damaged > 0)
+		ereport(WARNING,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("ptrack read map: " UINT64_FORMAT " of " UINT64_FORMAT " chunks of file \"%s\" have incorrect checksum",
+						damaged, nchunks, ptrack_path),
+				 errdetail("Blocks tracked in these chunks will be reported as changed since %X/%X.",
+						   (uint32) (hdr->flush_lsn >> 32), (uint32) hdr->flush_lsn)));
+
+	result = true;
+
+cleanup:
+	close(ptrack_fd);
+	for (region = 0; region < PTRACK_MAP_NREGIONS; region++)
+		if (region_chunks[region] != NULL)
+			pfree(region_chunks[region]);
+
+	return result;
+}
+
+/*
+ * Create map file of the full size, so that checkpoints only overwrite
+ * already allocated space.  Both regions are filled with zeros, i.e. contain
+ * no valid header.
+ */
+static void
+ptrack_create_map_file(const char *ptrack_path, int fd, uint64 size)
+{
+	char		zeros[PTRACK_MAP_CHUNK_SLOTS * sizeof(uint64)];
+	char		ptrack_dir[MAXPGPATH];
+	uint64		written = 0;
+
+	elog(DEBUG1, "ptrack checkpoint: creating map file \"%s\" of " UINT64_FORMAT " bytes",
+		 ptrack_path, size);
+
+	if (ftruncate(fd, 0) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack checkpoint: could not truncate file \"%s\": %m", ptrack_path)));
+
+	MemSet(zeros, 0, sizeof(zeros));
+	while (written < size)
+	{
+		size_t		writesz = Min(size - written, sizeof(zeros));
+
+		ptrack_write_chunk(fd, zeros, writesz);
+		written += writesz;
+	}
+
+	if (pg_fsync(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack checkpoint: could not fsync file \"%s\": %m", ptrack_path)));
+
+	/* Make new file entry durable */
+	strlcpy(ptrack_dir, ptrack_path, MAXPGPATH);
+	get_parent_directory(ptrack_dir);
+	fsync_fname(ptrack_dir, true);
+}
+
+/*
+ * Parse list of NUMA nodes like "0-1,3" (the format of sysfs node lists) into
+ * bit mask.  Returns false if the list is malformed or empty.
+ */
+static bool
+ptrack_parse_numa_nodes(const char *nodes, unsigned long *mask)
+{
+	const char *ptr = nodes;
+	bool		found = false;
+
+	memset(mask, 0, PTRACK_NUMA_MASK_WORDS * sizeof(unsigned long));
+
+	while (*ptr != '\0' && *ptr != '\n')
+	{
+		char	   *end;
+		long		first;
+		long		last;
+		long		node;
+
+		first = strtol(ptr, &end, 10);
+		if (end == ptr || first < 0 || first >= PTRACK_NUMA_MAX_NODES)
+			return false;
+		last = first;
+		ptr = end;
+
+		if (*ptr == '-')
+		{
+			ptr++;
+			last = strtol(ptr, &end, 10);
+			if (end == ptr || last < first || last >= PTRACK_NUMA_MAX_NODES)
+				return false;
+			ptr = end;
+		}
+
+		for (node = first; node <= last; node++)
+			mask[node / (8 * sizeof(unsigned long))] |=
+				1UL << (node % (8 * sizeof(unsigned long)));
+		found = true;
+
+		if (*ptr == ',')
+			ptr++;
+		else if (*ptr != '\0' && *ptr != '\n')
+			return false;
+	}
+
+	return found;
+}
+
+#ifdef PTRACK_MAP_MMAP
+/*
+ * Default huge page size from /proc/meminfo, just like PostgreSQL does it
+ * for the main shared memory segment.
+ */
+static Size
+ptrack_huge_page_size(void)
+{
+	Size		size = 2 * 1024 * 1024;
+	FILE	   *fp = AllocateFile("/proc/meminfo", "r");
+	char		buf[128];
+	unsigned int sz;
+	char		ch;
+
+	if (fp)
+	{
+		while (fgets(buf, sizeof(buf), fp))
+		{
+			if (sscanf(buf, "Hugepagesize: %u %c", &sz, &ch) == 2)
+			{
+				if (ch == 'k')
+					size = sz * (Size) 1024;
+				break;
+			}
+		}
+		FreeFile(fp);
+	}
+
+	return size;
+}
+
+/*
+ * Set ptrack.numa_policy for the mapping, which is not touched yet, so that
+ * it applies to all its pages.  Placement is only an optimization, so
+ * failures are reported, but otherwise ignored.
+ */
+static void
+ptrack_numa_bind(void *ptr, Size size)
+{
+	unsigned long mask[PTRACK_NUMA_MASK_WORDS];
+	const char *nodes = ptrack_numa_nodes;
+	char		online[256];
+	int			mode;
+
+	if (ptrack_numa_policy == PTRACK_NUMA_DEFAULT)
+		return;
+
+	/* All online nodes by default */
+	if (nodes == NULL || nodes[0] == '\0')
+	{
+		FILE	   *fp = AllocateFile("/sys/devices/system/node/online", "r");
+
+		if (fp == NULL || fgets(online, sizeof(online), fp) == NULL)
+		{
+			if (fp)
+				FreeFile(fp);
+			elog(LOG, "ptrack: NUMA is not available, ptrack.numa_policy is ignored");
+			return;
+		}
+		FreeFile(fp);
+		nodes = online;
+	}
+
+	if (!ptrack_parse_numa_nodes(nodes, mask))
+	{
+		elog(WARNING, "ptrack: invalid list of NUMA nodes \"%s\"", nodes);
+		return;
+	}
+
+	mode = ptrack_numa_policy == PTRACK_NUMA_BIND ? MPOL_BIND : MPOL_INTERLEAVE;
+	if (syscall(SYS_mbind, ptr, size, mode, mask, PTRACK_NUMA_MAX_NODES + 1, 0) != 0)
+		ereport(WARNING,
+				(errmsg("ptrack: could not set NUMA policy of ptrack map: %m")));
+}
+#endif
+
+/*
+ * Memory for ptrack map outside of the main shared memory segment, if huge
+ * pages or NUMA policy are requested for it.  Mapping is created by
+ * postmaster on the first call, inherited by all child processes and reused
+ * after crash restart.  Returns NULL if the map should be allocated in the
+ * main shared memory segment.
+ */
+PtrackMap
+ptrackMapMmap(void)
+{
+#ifdef PTRACK_MAP_MMAP
+	Size		size = PtrackActualSize;
+	void	   *ptr = MAP_FAILED;
+
+	if (ptrack_map_mapping != NULL)
+		return ptrack_map_mapping;
+
+	if (ptrack_huge_pages == PTRACK_HUGE_PAGES_OFF &&
+		ptrack_numa_policy == PTRACK_NUMA_DEFAULT)
+		return NULL;
+
+	/* Only postmaster maps the map, backends get it through fork() */
+	Assert(!IsUnderPostmaster);
+
+	if (ptrack_huge_pages != PTRACK_HUGE_PAGES_OFF)
+	{
+		Size		huge_size = TYPEALIGN(ptrack_huge_page_size(), size);
+
+		ptr = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED)
+			size = huge_size;
+		else if (ptrack_huge_pages == PTRACK_HUGE_PAGES_ON)
+			ereport(ERROR,
+					(errmsg("could not map ptrack map of %zu bytes with huge pages: %m",
+							huge_size),
+					 errhint("Increase vm.nr_hugepages or set ptrack.huge_pages to \"try\".")));
+		else
+			elog(LOG, "ptrack: could not map ptrack map with huge pages, falling back to regular pages: %m");
+	}
+
+	if (ptr == MAP_FAILED)
+	{
+		/* Without NUMA policy there is no reason for a separate mapping */
+		if (ptrack_numa_policy == PTRACK_NUMA_DEFAULT)
+			return NULL;
+
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+			ereport(ERROR,
+					(errmsg("could not map ptrack map of %zu bytes: %m", size)));
+	}
+
+	ptrack_numa_bind(ptr, size);
+
+	elog(DEBUG1, "ptrack: map is placed in a separate mapping of %zu bytes", size);
+
+	ptrack_map_mapping = (PtrackMap) ptr;
+	return ptrack_map_mapping;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Path of the map file of the partition.
+ */
+static void
+ptrack_partition_path(PtrackPartition *part, char *ptrack_path)
+{
+	if (part->spcOid == InvalidOid)
+		snprintf(ptrack_path, MAXPGPATH, "%s/%s", DataDir, PTRACK_PATH);
+	else
+	{
+		snprintf(ptrack_path, MAXPGPATH, "%s/" PTRACK_PARTITION_PATH_FORMAT,
+				 DataDir, part->spcOid);
+	}
+}
+
+/*
+ * Remove map files of partitions, which are not listed in ptrack.partitions
+ * anymore, or of all partitions if 'all' is true.  Returns true if any file
+ * was removed.
+ */
+static bool
+ptrack_clean_partition_files(bool all)
+{
+	char		global_dir[MAXPGPATH];
+	DIR		   *dir;
+	struct dirent *de;
+	bool		removed = false;
+
+	snprintf(global_dir, MAXPGPATH, "%s/global", DataDir);
+
+	dir = AllocateDir(global_dir);
+	while ((de = ReadDir(dir, global_dir)) != NULL)
+	{
+		char		name[MAXPGPATH];
+		char		path[MAXPGPATH];
+		Oid			spcOid;
+
+		if (sscanf(de->d_name, "ptrack_%u.map", &spcOid) != 1)
+			continue;
+
+		/* Skip files with other names starting with the same pattern */
+		snprintf(name, sizeof(name), "ptrack_%u.map", spcOid);
+		if (strcmp(de->d_name, name) != 0)
+			continue;
+
+		if (!all && ptrack_partition(spcOid)->spcOid == spcOid)
+			continue;
+
+		snprintf(path, MAXPGPATH, "%s/%s", global_dir, de->d_name);
+		elog(DEBUG1, "ptrack: removing map file \"%s\" of partition %u", path, spcOid);
+		durable_unlink(path, LOG);
+		removed = true;
+	}
+	FreeDir(dir);
+
+	return removed;
+}
+
+/*
+ * Size of shared memory needed for the registry of files changed as a whole.
+ */
+Size
+ptrackFilesShmemSize(void)
+{
+	if (ptrack_file_registry_size == 0)
+		return 0;
+
+	return hash_estimate_size(ptrack_file_registry_size, sizeof(PtrackFileEntry));
+}
+
+/*
+ * Create or attach to the registry of files changed as a whole.  Called with
+ * AddinShmemInitLock held.
+ */
+void
+ptrackFilesShmemInit(void)
+{
+	HASHCTL		info;
+
+	if (ptrack_file_registry_size == 0)
+	{
+		ptrack_files = NULL;
+		return;
+	}
+
+	MemSet(&info, 0, sizeof(info));
+	info.keysize = sizeof(PtrackFileKey);
+	info.entrysize = sizeof(PtrackFileEntry);
+
+	ptrack_files = ShmemInitHash("ptrack files",
+								 ptrack_file_registry_size,
+								 ptrack_file_registry_size,
+								 &info,
+								 HASH_ELEM | HASH_BLOBS);
+	ptrack_files_lock = &(GetNamedLWLockTranche(PTRACK_LWLOCK_TRANCHE))[0].lock;
+}
+
+/*
+ * Size of shared memory needed for WAL tracking mode.
+ */
+Size
+ptrackWalShmemSize(void)
+{
+	if (ptrack_tracking_mode != PTRACK_TRACKING_WAL)
+		return 0;
+
+	return sizeof(PtrackWalState);
+}
+
+/*
+ * Create or attach to the shared state of WAL tracking mode.  Called with
+ * AddinShmemInitLock held before ptrackMapInit(), which sets tracked_lsn.
+ */
+void
+ptrackWalShmemInit(void)
+{
+	bool		found;
+
+	if (ptrack_tracking_mode != PTRACK_TRACKING_WAL)
+	{
+		ptrack_wal = NULL;
+		return;
+	}
+
+	ptrack_wal = ShmemInitStruct("ptrack wal", sizeof(PtrackWalState), &found);
+	if (!found)
+		pg_atomic_init_u64(&ptrack_wal->tracked_lsn, InvalidXLogRecPtr);
+	ptrack_wal_lock = &(GetNamedLWLockTranche(PTRACK_LWLOCK_TRANCHE))[1].lock;
+}
+
+/*
+ * Size of shared memory needed for the ring of blocks written by the startup
+ * process.
+ */
+Size
+ptrackRecoveryShmemSize(void)
+{
+	return sizeof(PtrackRecoveryRing);
+}
+
+/*
+ * Create or attach to the ring of blocks written by the startup process.
+ * Called with AddinShmemInitLock held.
+ */
+void
+ptrackRecoveryShmemInit(void)
+{
+	bool		found;
+
+	ptrack_recovery_ring = ShmemInitStruct("ptrack recovery ring",
+										   sizeof(PtrackRecoveryRing), &found);
+	if (!found)
+	{
+		pg_atomic_init_u64(&ptrack_recovery_ring->head, 0);
+		pg_atomic_init_u64(&ptrack_recovery_ring->tail, 0);
+	}
+	ptrack_recovery_lock = &(GetNamedLWLockTranche(PTRACK_LWLOCK_TRANCHE))[2].lock;
+}
+
+static void
+ptrack_file_key(PtrackFileKey *key, RelFileNode rnode, ForkNumber forknum,
+				uint32 segno)
+{
+	MemSet(key, 0, sizeof(PtrackFileKey));
+	key->spcOid = nodeSpc(rnode);
+	key->dbOid = nodeDb(rnode);
+	key->relNumber = nodeRel(rnode);
+	key->forknum = forknum;
+	key->segno = segno;
+}
+
+/*
+ * Register relation segment file as changed as a whole at 'lsn'.  Returns
+ * false if registry is disabled or full, then caller should mark all blocks
+ * of the file in the map instead.
+ */
+static bool
+ptrack_register_file(RelFileNode rnode, ForkNumber forknum, uint32 segno,
+					 XLogRecPtr lsn)
+{
+	PtrackFileKey key;
+	PtrackFileEntry *entry;
+	bool		found;
+
+	if (ptrack_files == NULL)
+		return false;
+
+	ptrack_file_key(&key, rnode, forknum, segno);
+
+	LWLockAcquire(ptrack_files_lock, LW_EXCLUSIVE);
+
+	entry = (PtrackFileEntry *) hash_search(ptrack_files, &key, HASH_FIND, NULL);
+	if (entry == NULL &&
+		hash_get_num_entries(ptrack_files) < ptrack_file_registry_size)
+	{
+		entry = (PtrackFileEntry *) hash_search(ptrack_files, &key, HASH_ENTER, &found);
+		entry->lsn = InvalidXLogRecPtr;
+	}
+
+	if (entry != NULL)
+		entry->lsn = Max(entry->lsn, lsn);
+
+	LWLockRelease(ptrack_files_lock);
+
+	return entry != NULL;
+}
+
+/*
+ * LSN of the last whole file change of relation segment file or
+ * InvalidXLogRecPtr if it is not registered.
+ */
+XLogRecPtr
+ptrack_file_lsn(RelFileNode rnode, ForkNumber forknum, uint32 segno)
+{
+	PtrackFileKey key;
+	PtrackFileEntry *entry;
+	XLogRecPtr	lsn = InvalidXLogRecPtr;
+
+	if (ptrack_files == NULL)
+		return InvalidXLogRecPtr;
+
+	ptrack_file_key(&key, rnode, forknum, segno);
+
+	LWLockAcquire(ptrack_files_lock, LW_SHARED);
+	entry = (PtrackFileEntry *) hash_search(ptrack_files, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+		lsn = entry->lsn;
+	LWLockRelease(ptrack_files_lock);
+
+	return lsn;
+}
+
+/*
+ * Path of the relation segment file of registry entry.
+ */
+static void
+ptrack_file_entry_path(const PtrackFileKey *key, char *path)
+{
+	char		fork[FORKNAMECHARS + 2] = "";
+	char		seg[16] = "";
+
+	if (key->forknum != MAIN_FORKNUM)
+		snprintf(fork, sizeof(fork), "_%s", forkNames[key->forknum]);
+	if (key->segno != 0)
+		snprintf(seg, sizeof(seg), ".%u", key->segno);
+
+	if (key->spcOid == GLOBALTABLESPACE_OID)
+		snprintf(path, MAXPGPATH, "%s/global/%u%s%s",
+				 DataDir, key->relNumber, fork, seg);
+	else if (key->spcOid == DEFAULTTABLESPACE_OID)
+		snprintf(path, MAXPGPATH, "%s/base/%u/%u%s%s",
+				 DataDir, key->dbOid, key->relNumber, fork, seg);
+	else
+		snprintf(path, MAXPGPATH, "%s/pg_tblspc/%u/%s/%u/%u%s%s",
+				 DataDir, key->spcOid, TABLESPACE_VERSION_DIRECTORY,
+				 key->dbOid, key->relNumber, fork, seg);
+}
+
+static void
+ptrack_write_data(int fd, const char *path, const char *data, size_t size)
+{
+	if (write(fd, data, size) != size)
+	{
+		/* If write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", path)));
+	}
+}
+
+/*
+ * Write registry of files changed as a whole to PTRACK_FILES_PATH.  It is
+ * small, so it is just replaced with a new file.  Entries of removed files
+ * are dropped: if the same file is created again, its blocks are marked in
+ * the map as usual.
+ */
+static void
+ptrack_files_write(void)
+{
+	char		path[MAXPGPATH];
+	char		path_tmp[MAXPGPATH];
+	PtrackFileEntry *entries;
+	PtrackFileEntry *entry;
+	HASH_SEQ_STATUS status;
+	PtrackFilesHdr hdr;
+	uint64		nentries = 0;
+	uint64		nkept = 0;
+	uint64		i;
+	int			fd;
+
+	if (ptrack_files == NULL)
+		return;
+
+	LWLockAcquire(ptrack_files_lock, LW_SHARED);
+	entries = palloc(Max(hash_get_num_entries(ptrack_files), 1) * sizeof(PtrackFileEntry));
+	hash_seq_init(&status, ptrack_files);
+	while ((entry = (PtrackFileEntry *) hash_seq_search(&status)) != NULL)
+		entries[nentries++] = *entry;
+	LWLockRelease(ptrack_files_lock);
+
+	for (i = 0; i < nentries; i++)
+	{
+		struct stat st;
+
+		ptrack_file_entry_path(&entries[i].key, path);
+		if (stat(path, &st) != 0 && errno == ENOENT)
+		{
+			/* Keep the entry, if the file was registered again meanwhile */
+			LWLockAcquire(ptrack_files_lock, LW_EXCLUSIVE);
+			entry = (PtrackFileEntry *) hash_search(ptrack_files, &entries[i].key, HASH_FIND, NULL);
+			if (entry != NULL && entry->lsn == entries[i].lsn)
+			{
+				hash_search(ptrack_files, &entries[i].key, HASH_REMOVE, NULL);
+				entry = NULL;
+			}
+			LWLockRelease(ptrack_files_lock);
+
+			if (entry == NULL)
+				continue;
+		}
+
+		entries[nkept++] = entries[i];
+	}
+
+	MemSet(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PTRACK_MAGIC, PTRACK_MAGIC_SIZE);
+	hdr.version_num = PTRACK_MAP_FILE_VERSION_NUM;
+	hdr.nentries = nkept;
+	INIT_CRC32C(hdr.crc);
+	COMP_CRC32C(hdr.crc, (char *) &hdr, offsetof(PtrackFilesHdr, crc));
+	COMP_CRC32C(hdr.crc, (char *) entries, nkept * sizeof(PtrackFileEntry));
+	FIN_CRC32C(hdr.crc);
+
+	sprintf(path, "%s/%s", DataDir, PTRACK_FILES_PATH);
+	sprintf(path_tmp, "%s/%s", DataDir, PTRACK_FILES_PATH_TMP);
+
+	fd = BasicOpenFile(path_tmp, O_CREAT | O_WRONLY | O_TRUNC | PG_BINARY);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack checkpoint: could not open file \"%s\": %m", path_tmp)));
+
+	ptrack_write_data(fd, path_tmp, (char *) &hdr, sizeof(hdr));
+	ptrack_write_data(fd, path_tmp, (char *) entries, nkept * sizeof(PtrackFileEntry));
+	pfree(entries);
+
+	if (pg_fsync(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack checkpoint: could not fsync file \"%s\": %m", path_tmp)));
+
+	if (close(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack checkpoint: could not close file \"%s\": %m", path_tmp)));
+
+	durable_rename(path_tmp, path, ERROR);
+
+	elog(DEBUG1, "ptrack checkpoint: " UINT64_FORMAT " of " UINT64_FORMAT " entries written to file \"%s\"",
+		 nkept, nentries, path);
+}
+
+/*
+ * Read registry of files changed as a whole.  This function is called only
+ * at startup by postmaster, so there is no need in locking.
+ */
+static bool
+ptrack_files_read(const char *path)
+{
+	PtrackFilesHdr hdr;
+	PtrackFileEntry *entries = NULL;
+	pg_crc32c	crc;
+	bool		result = false;
+	uint64		i;
+	int			fd;
+
+	fd = BasicOpenFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		elog(WARNING, "ptrack read map: could not open file \"%s\": %m", path);
+		return false;
+	}
+
+	if (!ptrack_read_full(fd, path, (char *) &hdr, sizeof(hdr)))
+		goto cleanup;
+
+	if (memcmp(hdr.magic, PTRACK_MAGIC, PTRACK_MAGIC_SIZE) != 0 ||
+		hdr.version_num != PTRACK_MAP_FILE_VERSION_NUM)
+	{
+		elog(WARNING, "ptrack read map: wrong format of file \"%s\"", path);
+		goto cleanup;
+	}
+
+	if (hdr.nentries > ptrack_file_registry_size)
+	{
+		elog(WARNING, "ptrack read map: file \"%s\" has " UINT64_FORMAT " entries, more than ptrack.file_registry_size",
+			 path, hdr.nentries);
+		goto cleanup;
+	}
+
+	entries = palloc(Max(hdr.nentries, 1) * sizeof(PtrackFileEntry));
+	if (!ptrack_read_full(fd, path, (char *) entries, hdr.nentries * sizeof(PtrackFileEntry)))
+		goto cleanup;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, (char *) &hdr, offsetof(PtrackFilesHdr, crc));
+	COMP_CRC32C(crc, (char *) entries, hdr.nentries * sizeof(PtrackFileEntry));
+	FIN_CRC32C(crc);
+
+	if (!EQ_CRC32C(crc, hdr.crc))
+	{
+		ereport(WARNING,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("ptrack read map: incorrect checksum of file \"%s\"", path)));
+		goto cleanup;
+	}
+
+	for (i = 0; i < hdr.nentries; i++)
+	{
+		PtrackFileEntry *entry;
+
+		entry = (PtrackFileEntry *) hash_search(ptrack_files, &entries[i].key, HASH_ENTER, NULL);
+		entry->lsn = entries[i].lsn;
+	}
+
+	result = true;
+
+cleanup:
+	close(fd);
+	if (entries != NULL)
+		pfree(entries);
+
+	return result;
+}
+
+/*
+ * Read the tracking policy the maps were built with into 'buf' of
+ * PTRACK_POLICY_MAXLEN bytes.  Missing file means the default policy.
+ */
+static bool
+ptrack_policy_read(char *buf)
+{
+	char		path[MAXPGPATH];
+	PtrackPolicy policy;
+	ssize_t		nread;
+	int			fd;
+
+	sprintf(path, "%s/%s", DataDir, PTRACK_POLICY_PATH);
+
+	fd = BasicOpenFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (errno != ENOENT)
+		{
+			elog(WARNING, "ptrack init: could not open file \"%s\": %m", path);
+			return false;
+		}
+
+		MemSet(&policy, 0, sizeof(policy));
+		policy.forks = PTRACK_ALL_FORKS;
+		policy.track_unlogged = true;
+		ptrack_policy_format(&policy, buf, PTRACK_POLICY_MAXLEN);
+		return true;
+	}
+
+	nread = read(fd, buf, PTRACK_POLICY_MAXLEN - 1);
+	close(fd);
+
+	if (nread < 0)
+	{
+		elog(WARNING, "ptrack init: could not read file \"%s\": %m", path);
+		return false;
+	}
+	buf[nread] = '\0';
+
+	if (!ptrack_policy_parse(buf, &policy))
+	{
+		elog(WARNING, "ptrack init: wrong format of file \"%s\"", path);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Save the current tracking policy to PTRACK_POLICY_PATH, or remove the file
+ * if the policy is the default one.
+ */
+static void
+ptrack_policy_write(void)
+{
+	char		path[MAXPGPATH];
+	char		path_tmp[MAXPGPATH];
+	char		buf[PTRACK_POLICY_MAXLEN];
+	int			fd;
+
+	sprintf(path, "%s/%s", DataDir, PTRACK_POLICY_PATH);
+
+	if (ptrack_policy.forks == PTRACK_ALL_FORKS &&
+		ptrack_policy.track_unlogged &&
+		ptrack_policy.nignored == 0)
+	{
+		if (ptrack_file_exists(path))
+			durable_unlink(path, ERROR);
+		return;
+	}
+
+	sprintf(path_tmp, "%s/%s", DataDir, PTRACK_POLICY_PATH_TMP);
+	ptrack_policy_format(&ptrack_policy, buf, sizeof(buf));
+
+	fd = BasicOpenFile(path_tmp, O_CREAT | O_WRONLY | O_TRUNC | PG_BINARY);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack init: could not open file \"%s\": %m", path_tmp)));
+
+	ptrack_write_data(fd, path_tmp, buf, strlen(buf));
+
+	if (pg_fsync(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack init: could not fsync file \"%s\": %m", path_tmp)));
+
+	if (close(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack init: could not close file \"%s\": %m", path_tmp)));
+
+	durable_rename(path_tmp, path, ERROR);
+}
+
+/*
+ * Read map files of all partitions into already allocated shared memory,
+ * check headers and checksums or create new maps, if some file is missing.
+ *
+ * All partitions share init_lsn of the main map, so if any of them cannot
+ * be loaded, all of them are reinitialized.  The same is done if a partition
+ * was removed from ptrack.partitions, since changes of its tablespace are
+ * not tracked in the main map.
+ */
+void
+ptrackMapInit(void)
+{
+	char		ptrack_path[MAXPGPATH];
+	char		ptrack_path_tmp[MAXPGPATH];
+	struct stat stat_buf;
+	bool		is_new_map = false;
+	int			i;
+
+	elog(DEBUG1, "ptrack init");
+
+	/* Frontend tools hash blocks in the same way, see ptrack_map.h */
+	StaticAssertStmt(sizeof(PtBlockId) == sizeof(PtrackBlockKey),
+					 "PtBlockId and PtrackBlockKey must have the same layout");
+
+	if (ptrack_map_size == 0)
+		return;
+
+	sprintf(ptrack_path_tmp, "%s/%s", DataDir, PTRACK_PATH_TMP);
+
+	/* Temporary file is not used since 2.5, remove it if left by older version */
+	if (ptrack_file_exists(ptrack_path_tmp))
+		durable_unlink(ptrack_path_tmp, LOG);
+
+	if (ptrack_clean_partition_files(false))
+	{
+		elog(LOG, "ptrack init: ptrack.partitions changed, map is reinitialized");
+		is_new_map = true;
+	}
+
+	for (i = 0; i < ptrack_npartitions && !is_new_map; i++)
+	{
+		PtrackPartition *part = &ptrack_partitions[i];
+
+		ptrack_partition_path(part, ptrack_path);
+
+		if (stat(ptrack_path, &stat_buf) != 0)
+		{
+			is_new_map = true;
+			break;
+		}
+
+		elog(DEBUG3, "ptrack init: map \"%s\" detected, trying to load", ptrack_path);
+		if (!ptrackMapReadFromFile(part, ptrack_path))
+		{
+			/*
+			 * ptrackMapReadFromFile failed
+			 * this can be header crc mismatch, version or size mismatch and
+			 * other errors
+			 * We treat it as non fatal and create new map in memory,
+			 * that will be written on disk on checkpoint
+			 */
+			elog(WARNING, "ptrack init: broken map file \"%s\", deleting",
+				 ptrack_path);
+			is_new_map = true;
+		}
+		else if (pg_atomic_read_u64(&part->map->init_lsn) !=
+				 pg_atomic_read_u64(&ptrack_map->init_lsn))
+		{
+			elog(WARNING, "ptrack init: map file \"%s\" was initialized apart from the main map, deleting",
+				 ptrack_path);
+			is_new_map = true;
+		}
+	}
+
+	/*
+	 * Files registered as changed as a whole are not marked in the maps, so
+	 * maps are valid only together with the registry.
+	 */
+	sprintf(ptrack_path, "%s/%s", DataDir, PTRACK_FILES_PATH);
+	if (ptrack_files == NULL)
+	{
+		if (ptrack_file_exists(ptrack_path))
+		{
+			elog(LOG, "ptrack init: ptrack.file_registry_size is 0, map is reinitialized");
+			is_new_map = true;
+		}
+	}
+	else if (!is_new_map && !ptrack_files_read(ptrack_path))
+	{
+		elog(WARNING, "ptrack init: broken registry file \"%s\", map is reinitialized",
+			 ptrack_path);
+		is_new_map = true;
+	}
+
+	/*
+	 * Changes of files excluded by the tracking policy are not in the maps,
+	 * so maps are valid only with the policy they were built with.
+	 */
+	if (!is_new_map)
+	{
+		char		saved_policy[PTRACK_POLICY_MAXLEN];
+		char		policy[PTRACK_POLICY_MAXLEN];
+
+		ptrack_policy_format(&ptrack_policy, policy, sizeof(policy));
+		if (!ptrack_policy_read(saved_policy) || strcmp(saved_policy, policy) != 0)
+		{
+			elog(LOG, "ptrack init: tracking policy changed, map is reinitialized");
+			is_new_map = true;
+		}
+	}
+
+	/*
+	 * Initialyze memory for new maps.  Files are removed, so that their
+	 * regions of older generations are never loaded later.
+	 */
+	if (is_new_map)
+	{
+		if (ptrack_file_exists(ptrack_path))
+			durable_unlink(ptrack_path, LOG);
+
+		if (ptrack_files != NULL)
+		{
+			HASH_SEQ_STATUS status;
+			PtrackFileEntry *entry;
+
+			hash_seq_init(&status, ptrack_files);
+			while ((entry = (PtrackFileEntry *) hash_seq_search(&status)) != NULL)
+				hash_search(ptrack_files, &entry->key, HASH_REMOVE, NULL);
+		}
+
+		for (i = 0; i < ptrack_npartitions; i++)
+		{
+			PtrackMap	map = ptrack_partitions[i].map;
+
+			ptrack_partition_path(&ptrack_partitions[i], ptrack_path);
+			if (ptrack_file_exists(ptrack_path))
+				durable_unlink(ptrack_path, LOG);
+
+			memcpy(map->magic, PTRACK_MAGIC, PTRACK_MAGIC_SIZE);
+			map->version_num = PTRACK_MAP_FILE_VERSION_NUM;
+			map->generation = 0;
+			map->init_lsn.value = InvalidXLogRecPtr;
+			/*
+			 * Fill entries with InvalidXLogRecPtr
+			 * (InvalidXLogRecPtr is actually 0)
+			 */
+			memset(map->entries, 0, ptrack_partitions[i].nslots * sizeof(pg_atomic_uint64));
+			/*
+			 * Last part of memory representation of ptrack_map (crc) is actually unused
+			 * so leave it as it is
+			 */
+		}
+
+		ptrack_policy_write();
+	}
+
+#if PG_VERSION_NUM >= 150000
+	/*
+	 * In WAL mode maps contain changes up to the redo pointer of the
+	 * checkpoint they were written by, see ptrackCheckpoint(), which is not
+	 * older than the last checkpoint.  So changes since the redo pointer of
+	 * the latter are marked from WAL again.
+	 */
+	if (ptrack_wal != NULL)
+	{
+		ControlFileData *control_file;
+		bool		crc_ok;
+
+		control_file = get_controlfile(DataDir, &crc_ok);
+		if (!crc_ok)
+			elog(ERROR, "ptrack init: incorrect checksum in control file");
+
+		pg_atomic_write_u64(&ptrack_wal->tracked_lsn,
+							control_file->checkPointCopy.redo);
+		elog(DEBUG1, "ptrack init: WAL is tracked from %X/%X",
+			 LSN_FORMAT_ARGS(control_file->checkPointCopy.redo));
+		pfree(control_file);
+	}
+#endif
+}
+
+/*
+ * Write content of the map partition to the region of 'generation' of the
+ * file.  Returns the number of bytes written and adds the number of used
+ * slots to 'used_slots'.
+ *
+ * Map is written into the region of the file, which was not used by the
+ * previous checkpoint, so the latter remains intact until the new one is
+ * complete.  Chunks are written and synced first and then the header with
+ * the next generation number makes the region valid.  Map file is never
+ * truncated or renamed, so only already allocated blocks are overwritten.
+ */
+static uint64
+ptrack_write_partition(PtrackPartition *part, const char *ptrack_path,
+					   uint64 generation, XLogRecPtr init_lsn,
+					   uint64 *used_slots)
+{
+	PtrackMap	map = part->map;
+	uint64		nslots = part->nslots;
+	int			ptrack_fd;
+	PtrackWriter writer;
+	PtrackMapFileHdr hdr;
+	PtrackMapChunkInfo *chunks;
+	uint64		slots[PTRACK_MAP_CHUNK_SLOTS];
+	char		buf[PTRACK_MAP_CHUNK_SLOTS * sizeof(uint64) + sizeof(pg_crc32c)];
+	struct stat stat_buf;
+	uint64		region_offset;
+	uint64		nchunks;
+	uint64		written;
+	uint64		i = 0;
+	uint64		j = 0;
+	uint64		chunkno = 0;
+
+	ptrack_fd = BasicOpenFile(ptrack_path, O_CREAT | O_RDWR | PG_BINARY);
+
+	if (ptrack_fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack checkpoint: could not open file \"%s\": %m", ptrack_path)));
+
+	if (fstat(ptrack_fd, &stat_buf) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack checkpoint: could not stat file \"%s\": %m", ptrack_path)));
+
+	/* New map file or map was resized */
+	if (stat_buf.st_size != PTRACK_MAP_FILE_SIZE(nslots))
+		ptrack_create_map_file(ptrack_path, ptrack_fd, PTRACK_MAP_FILE_SIZE(nslots));
+
+	if (close(ptrack_fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack checkpoint: could not close file \"%s\": %m", ptrack_path)));
+
+	/* Regions are overwritten with ptrack.flush_method */
+	ptrack_writer_open(&writer, ptrack_path);
+
+	region_offset = (generation % PTRACK_MAP_NREGIONS) *
+		PTRACK_MAP_REGION_SIZE(nslots);
+
+	/*
+	 * Header contains flush_lsn and chunk infos contain sizes of encoded
+	 * chunks, which are known only after all chunks are written, so skip
+	 * them and write them at the end.
+	 */
+	nchunks = PTRACK_MAP_NCHUNKS(nslots);
+	chunks = palloc0(nchunks * sizeof(PtrackMapChunkInfo));
+	ptrack_writer_seek(&writer, region_offset + PTRACK_MAP_CHUNKS_OFFSET(nchunks));
+	written = PTRACK_MAP_CHUNKS_OFFSET(nchunks);
+
+	/*
+	 * Iterate over ptrack map actual content and sync it to file chunk by
+	 * chunk.  It's essential to read each element atomically to avoid
+	 * partial reads, since map can be updated concurrently without any lock.
+	 */
+	while (i < nslots)
+	{
+		XLogRecPtr	lsn;
+
+		lsn = pg_atomic_read_u64(&map->entries[i]);
+		slots[j] = lsn;
+
+		if (lsn != InvalidXLogRecPtr)
+			(*used_slots)++;
+
+		i++;
+		j++;
 
-		ptrack_write_chunk(ptrack_tmp_fd, &crc, (char *) buf, writesz);
-		elog(DEBUG5, "ptrack checkpoint: final i " UINT64_FORMAT ", j " UINT64_FORMAT ", writesz %zu PtrackContentNblocks " UINT64_FORMAT,
-			 i, j, writesz, (uint64) PtrackContentNblocks);
-	}
+		if (j == PTRACK_MAP_CHUNK_SLOTS || i == nslots)
+		{
+			uint32		size;
+			pg_crc32c	crc;
 
-	FIN_CRC32C(crc);
+			size = ptrack_chunk_encode(slots, j, buf, &chunks[chunkno].encoding);
+			chunks[chunkno].size = size;
+			crc = ptrack_chunk_crc(generation, chunkno, buf, size);
 
-	if (write(ptrack_tmp_fd, &crc, sizeof(crc)) != sizeof(crc))
-	{
-		/* If write didn't set errno, assume problem is no disk space */
-		if (errno == 0)
-			errno = ENOSPC;
-		ereport(ERROR,
-				(errcode_for_file_access(),
-				 errmsg("ptrack checkpoint: could not write file \"%s\": %m", ptrack_path_tmp)));
+			/* CRC immediately follows the encoded slots of the chunk */
+			memcpy(buf + size, &crc, sizeof(crc));
+			ptrack_writer_write(&writer, buf, size + sizeof(crc));
+			written += size + sizeof(crc);
+			elog(DEBUG5, "ptrack checkpoint: chunk " UINT64_FORMAT ", i " UINT64_FORMAT ", j " UINT64_FORMAT ", size %u, encoding %u nslots " UINT64_FORMAT,
+				 chunkno, i, j, size, chunks[chunkno].encoding, nslots);
+
+			chunkno++;
+			j = 0;
+		}
 	}
 
-	if (pg_fsync(ptrack_tmp_fd) != 0)
+	/* Chunks should be durable before the header refers to them */
+	ptrack_writer_flush(&writer);
+	if (pg_fsync(writer.fd) != 0)
 		ereport(ERROR,
 				(errcode_for_file_access(),
-				 errmsg("ptrack checkpoint: could not fsync file \"%s\": %m", ptrack_path_tmp)));
+				 errmsg("ptrack checkpoint: could not fsync file \"%s\": %m", ptrack_path)));
 
-	if (close(ptrack_tmp_fd) != 0)
+	/*
+	 * Every slot is set to the current insert (or replay) position at the
+	 * moment of marking, so no slot written above is newer than that.
+	 */
+	MemSet(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PTRACK_MAGIC, PTRACK_MAGIC_SIZE);
+	hdr.version_num = PTRACK_MAP_FILE_VERSION_NUM;
+	hdr.init_lsn = init_lsn;
+	hdr.flush_lsn = RecoveryInProgress() ? GetXLogReplayRecPtr(NULL) : GetXLogInsertRecPtr();
+	hdr.generation = generation;
+	hdr.nslots = nslots;
+	hdr.chunk_slots = PTRACK_MAP_CHUNK_SLOTS;
+	INIT_CRC32C(hdr.crc);
+	COMP_CRC32C(hdr.crc, (char *) &hdr, offsetof(PtrackMapFileHdr, crc));
+	COMP_CRC32C(hdr.crc, (char *) chunks, nchunks * sizeof(PtrackMapChunkInfo));
+	FIN_CRC32C(hdr.crc);
+
+	/* Padding of the chunk info table up to the first chunk is zeroed */
+	ptrack_writer_seek(&writer, region_offset);
+	ptrack_writer_write(&writer, (char *) &hdr, sizeof(hdr));
+	ptrack_writer_write(&writer, (char *) chunks,
+						nchunks * sizeof(PtrackMapChunkInfo));
+	ptrack_writer_flush(&writer);
+	pfree(chunks);
+
+	if (pg_fsync(writer.fd) != 0)
 		ereport(ERROR,
 				(errcode_for_file_access(),
-				 errmsg("ptrack checkpoint: could not close file \"%s\": %m", ptrack_path_tmp)));
+				 errmsg("ptrack checkpoint: could not fsync file \"%s\": %m", ptrack_path)));
+
+	ptrack_writer_close(&writer);
+
+	elog(DEBUG1, "ptrack checkpoint: " UINT64_FORMAT " bytes written to region of generation " UINT64_FORMAT " of file \"%s\"",
+		 written, generation, ptrack_path);
+
+	return written;
+}
+
+/*
+ * Write the next generation of the map partition to its file.
+ */
+static uint64
+ptrack_checkpoint_partition(PtrackPartition *part, XLogRecPtr init_lsn,
+							uint64 *used_slots)
+{
+	char		ptrack_path[MAXPGPATH];
+	uint64		generation;
+	uint64		written;
+
+	ptrack_partition_path(part, ptrack_path);
+
+	/*
+	 * Only the process doing checkpoints changes generation, so there is no
+	 * need in locking.
+	 */
+	generation = part->map->generation + 1;
+	written = ptrack_write_partition(part, ptrack_path, generation, init_lsn,
+									 used_slots);
+
+	/* New region is durable, the next checkpoint will overwrite the other */
+	part->map->generation = generation;
+
+	return written;
+}
+
+/*
+ * Write the main map to a separate file at 'path' in the same way as
+ * checkpoint does, but without changing the map, e.g. to measure the cost of
+ * ptrack checkpoint.  Returns the number of bytes written.
+ */
+uint64
+ptrackWriteMapCopy(const char *path, uint64 generation, uint64 *used_slots)
+{
+	if (ptrack_map_size == 0 || ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	*used_slots = 0;
+	return ptrack_write_partition(&ptrack_partitions[0], path, generation,
+								  pg_atomic_read_u64(&ptrack_map->init_lsn),
+								  used_slots);
+}
+
+/*
+ * Write content of all map partitions to their files.
+ */
+void
+ptrackCheckpoint(void)
+{
+	XLogRecPtr	init_lsn;
+	uint64		written = 0;
+	uint64		used_slots = 0;
+	int			i;
+	instr_time	start_time;
+	instr_time	duration;
+
+	elog(DEBUG1, "ptrack checkpoint");
+
+	INSTR_TIME_SET_CURRENT(start_time);
+
+	/* Delete ptrack_map and all related files, if ptrack was switched off */
+	if (ptrack_map_size == 0)
+	{
+		return;
+	}
+	else if (ptrack_map == NULL)
+		elog(ERROR, "ptrack checkpoint: map is not loaded at checkpoint time");
+
+	elog(DEBUG1, "ptrack checkpoint: started");
+
+	init_lsn = pg_atomic_read_u64(&ptrack_map->init_lsn);
+
+	/* Set init_lsn during checkpoint if it is not set yet */
+	if (init_lsn == InvalidXLogRecPtr)
+	{
+		XLogRecPtr	new_init_lsn;
+
+		if (RecoveryInProgress())
+			new_init_lsn = GetXLogReplayRecPtr(NULL);
+		else
+			new_init_lsn = GetXLogInsertRecPtr();
+
+		pg_atomic_write_u64(&ptrack_map->init_lsn, new_init_lsn);
+		init_lsn = new_init_lsn;
+	}
+
+	/* Blocks written by the startup process are marked in bulk */
+	ptrackRecoveryFlush();
+
+#if PG_VERSION_NUM >= 150000
+	/*
+	 * In WAL mode changes after the redo pointer are marked from WAL after
+	 * restart, see ptrackMapInit(), so maps should contain all before it.
+	 */
+	if (ptrack_wal != NULL)
+		ptrackWalTrack(GetRedoRecPtr());
+#endif
+
+	/* Registry should be durable before maps, which rely on it */
+	ptrack_files_write();
+
+	for (i = 0; i < ptrack_npartitions; i++)
+		written += ptrack_checkpoint_partition(&ptrack_partitions[i], init_lsn,
+											   &used_slots);
+
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start_time);
+
+	if (ptrack_stats != NULL)
+	{
+		uint64		usec = INSTR_TIME_GET_MICROSEC(duration);
+
+		pg_atomic_fetch_add_u64(&ptrack_stats->checkpoints, 1);
+		pg_atomic_fetch_add_u64(&ptrack_stats->checkpoint_time, usec);
+		pg_atomic_write_u64(&ptrack_stats->last_checkpoint_time, usec);
+		pg_atomic_fetch_add_u64(&ptrack_stats->checkpoint_bytes, written);
+		pg_atomic_write_u64(&ptrack_stats->used_slots, used_slots);
+	}
+
+	elog(DEBUG1, "ptrack checkpoint: completed in %.3f ms, " UINT64_FORMAT " of " UINT64_FORMAT " slots used, " UINT64_FORMAT " bytes written to %d map files",
+		 INSTR_TIME_GET_MILLISEC(duration), used_slots, ptrackTotalSlots(),
+		 written, ptrack_npartitions);
+}
+
+/*
+ * Direct I/O is not available on some platforms at all (PG_O_DIRECT is 0
+ * there), so reject such methods on setting.  io_uring entry is compiled in
+ * only if PostgreSQL is built with liburing.
+ */
+bool
+check_ptrack_flush_method(int *newval, void **extra, GucSource source)
+{
+	if (*newval != PTRACK_FLUSH_BUFFERED && PG_O_DIRECT == 0)
+	{
+		GUC_check_errdetail("Direct I/O is not supported on this platform.");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Separate mapping of the map is available only on Linux without
+ * EXEC_BACKEND.  Everywhere else "try" silently keeps the map in the main
+ * shared memory segment, which may use huge pages on its own.
+ */
+bool
+check_ptrack_huge_pages(int *newval, void **extra, GucSource source)
+{
+#ifndef PTRACK_MAP_MMAP
+	if (*newval == PTRACK_HUGE_PAGES_ON)
+	{
+		GUC_check_errdetail("Huge pages for ptrack map are supported only on Linux without EXEC_BACKEND.");
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+bool
+check_ptrack_numa_policy(int *newval, void **extra, GucSource source)
+{
+#ifndef PTRACK_MAP_MMAP
+	if (*newval != PTRACK_NUMA_DEFAULT)
+	{
+		GUC_check_errdetail("NUMA policy for ptrack map is supported only on Linux without EXEC_BACKEND.");
+		return false;
+	}
+#endif
+
+	return true;
+}
 
-	/* And finally replace old file with the new one */
-	durable_rename(ptrack_path_tmp, ptrack_path, ERROR);
+bool
+check_ptrack_numa_nodes(char **newval, void **extra, GucSource source)
+{
+	unsigned long mask[PTRACK_NUMA_MASK_WORDS];
+
+	if (*newval == NULL || (*newval)[0] == '\0')
+		return true;
 
-	/* Sanity check */
-	if (stat(ptrack_path, &stat_buf) == 0 &&
-		stat_buf.st_size != PtrackActualSize)
+	if (!ptrack_parse_numa_nodes(*newval, mask))
 	{
-		elog(ERROR, "ptrack checkpoint: stat_buf.st_size != ptrack_map_size %zu != " UINT64_FORMAT,
-			 (Size) stat_buf.st_size, PtrackActualSize);
+		GUC_check_errdetail("List of NUMA nodes should look like \"0-1,3\", node numbers should be less than %d.",
+							PTRACK_NUMA_MAX_NODES);
+		return false;
 	}
-	elog(DEBUG1, "ptrack checkpoint: completed");
+
+	return true;
 }
 
 void
@@ -473,6 +2120,8 @@ assign_ptrack_map_size(int newval, void *extra)
 	if (newval == 0)
 	{
 		ptrack_map_size = 0;
+		ptrack_partitions[0].size = 0;
+		ptrack_partitions[0].nslots = 0;
 		return;
 	}
 
@@ -487,10 +2136,349 @@ assign_ptrack_map_size(int newval, void *extra)
 	{
 		/* Cast to uint64 in order to avoid int32 overflow */
 		ptrack_map_size = (uint64) 1024 * 1024 * newval;
+		ptrack_partitions[0].size = ptrack_map_size;
+		ptrack_partitions[0].nslots = PtrackContentNblocks;
+
+		elog(DEBUG1, "assign_ptrack_map_size: ptrack_map_size set to " UINT64_FORMAT,
+			 ptrack_map_size);
+	}
+}
+
+/*
+ * Parse ptrack.partitions like "16385:1024, 16386:64", i.e. a list of
+ * tablespace OIDs with map sizes in MB, into 'parts'.  Returns the number
+ * of partitions or -1 if the list is malformed.
+ */
+static int
+ptrack_parse_partitions(const char *conf, PtrackPartition *parts)
+{
+	const char *ptr = conf;
+	int			nparts = 0;
+
+	while (*ptr != '\0')
+	{
+		char	   *end;
+		unsigned long spcOid;
+		long		size_mb;
+		int			i;
+
+		while (isspace((unsigned char) *ptr))
+			ptr++;
+		if (*ptr == '\0')
+			break;
+
+		spcOid = strtoul(ptr, &end, 10);
+		if (end == ptr || spcOid == InvalidOid || spcOid > PG_UINT32_MAX || *end != ':')
+			return -1;
+		ptr = end + 1;
+
+		size_mb = strtol(ptr, &end, 10);
+#if SIZEOF_SIZE_T == 8
+		if (end == ptr || size_mb < 1 || size_mb > 32 * 1024)
+#else
+		if (end == ptr || size_mb < 1 || size_mb > 256)
+#endif
+			return -1;
+		ptr = end;
+
+		while (isspace((unsigned char) *ptr))
+			ptr++;
+		if (*ptr == ',')
+			ptr++;
+		else if (*ptr != '\0')
+			return -1;
+
+		if (nparts == PTRACK_MAX_PARTITIONS)
+			return -1;
+		for (i = 0; i < nparts; i++)
+			if (parts[i].spcOid == (Oid) spcOid)
+				return -1;
+
+		parts[nparts].spcOid = (Oid) spcOid;
+		parts[nparts].size = (uint64) 1024 * 1024 * size_mb;
+		parts[nparts].nslots = PTRACK_MAP_NSLOTS(parts[nparts].size);
+		parts[nparts].map = NULL;
+		nparts++;
+	}
+
+	return nparts;
+}
+
+bool
+check_ptrack_partitions(char **newval, void **extra, GucSource source)
+{
+	PtrackPartition parts[PTRACK_MAX_PARTITIONS];
+
+	if (*newval != NULL && ptrack_parse_partitions(*newval, parts) < 0)
+	{
+		GUC_check_errdetail("List should look like \"16385:1024, 16386:64\", i.e. tablespace OID and map size in MB, at most %d distinct tablespaces.",
+							PTRACK_MAX_PARTITIONS);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * ptrack.partitions is set only at server start, so there is no concurrent
+ * access to the partitions.
+ */
+void
+assign_ptrack_partitions(const char *newval, void *extra)
+{
+	int			nparts = 0;
+
+	if (newval != NULL)
+		nparts = ptrack_parse_partitions(newval, &ptrack_partitions[1]);
+
+	ptrack_npartitions = 1 + Max(nparts, 0);
+}
+
+/*
+ * Size of shared memory needed for maps of partitions other than the main
+ * one.
+ */
+Size
+ptrackPartitionsShmemSize(void)
+{
+	Size		size = 0;
+	int			i;
+
+	for (i = 1; i < ptrack_npartitions; i++)
+		size = add_size(size, PTRACK_MAP_ACTUAL_SIZE(ptrack_partitions[i].size));
+
+	return size;
+}
+
+/*
+ * Number of slots in all map partitions.
+ */
+uint64
+ptrackTotalSlots(void)
+{
+	uint64		nslots = 0;
+	int			i;
+
+	for (i = 0; i < ptrack_npartitions; i++)
+		nslots += ptrack_partitions[i].nslots;
+
+	return nslots;
+}
+
+/*
+ * Parse ptrack.track_forks, a list of fork names separated by commas.
+ */
+static bool
+ptrack_parse_track_forks(const char *conf, uint32 *forks)
+{
+	const char *ptr = conf;
+
+	*forks = 0;
+
+	while (*ptr != '\0')
+	{
+		size_t		len;
+		int			forknum;
+
+		while (isspace((unsigned char) *ptr) || *ptr == ',')
+			ptr++;
+		if (*ptr == '\0')
+			break;
+
+		len = strcspn(ptr, ", \t\n");
+		for (forknum = 0; forknum <= MAX_FORKNUM; forknum++)
+			if (strlen(forkNames[forknum]) == len &&
+				strncmp(ptr, forkNames[forknum], len) == 0)
+				break;
+
+		if (forknum > MAX_FORKNUM)
+			return false;
+
+		*forks |= 1U << forknum;
+		ptr += len;
+	}
+
+	return true;
+}
+
+bool
+check_ptrack_track_forks(char **newval, void **extra, GucSource source)
+{
+	uint32		forks;
+
+	if (*newval != NULL && !ptrack_parse_track_forks(*newval, &forks))
+	{
+		GUC_check_errdetail("List should consist of fork names \"main\", \"fsm\", \"vm\" and \"init\".");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Tracking policy options are set only at server start, so there is no
+ * concurrent access to the policy.
+ */
+void
+assign_ptrack_track_forks(const char *newval, void *extra)
+{
+	uint32		forks = PTRACK_ALL_FORKS;
+
+	if (newval != NULL)
+		ptrack_parse_track_forks(newval, &forks);
+
+	ptrack_policy.forks = forks;
+}
+
+/*
+ * Parse ptrack.ignore_tablespaces, a list of tablespace OIDs separated by
+ * commas, into sorted array of distinct OIDs.  Returns the number of OIDs or
+ * -1 on error.
+ */
+static int
+ptrack_parse_ignore_tablespaces(const char *conf, Oid *oids)
+{
+	const char *ptr = conf;
+	int			noids = 0;
+
+	while (*ptr != '\0')
+	{
+		char	   *end;
+		unsigned long spcOid;
+		int			i;
+
+		while (isspace((unsigned char) *ptr) || *ptr == ',')
+			ptr++;
+		if (*ptr == '\0')
+			break;
+
+		spcOid = strtoul(ptr, &end, 10);
+		if (end == ptr || spcOid == InvalidOid || spcOid > PG_UINT32_MAX ||
+			(*end != '\0' && *end != ',' && !isspace((unsigned char) *end)))
+			return -1;
+		ptr = end;
+
+		/* Insert keeping the array sorted */
+		for (i = noids; i > 0 && oids[i - 1] > (Oid) spcOid; i--)
+			;
+		if (i > 0 && oids[i - 1] == (Oid) spcOid)
+			continue;
+		if (noids == PTRACK_MAX_IGNORED_TABLESPACES)
+			return -1;
+
+		memmove(&oids[i + 1], &oids[i], (noids - i) * sizeof(Oid));
+		oids[i] = (Oid) spcOid;
+		noids++;
+	}
+
+	return noids;
+}
+
+bool
+check_ptrack_ignore_tablespaces(char **newval, void **extra, GucSource source)
+{
+	Oid			oids[PTRACK_MAX_IGNORED_TABLESPACES];
+
+	if (*newval != NULL && ptrack_parse_ignore_tablespaces(*newval, oids) < 0)
+	{
+		GUC_check_errdetail("List should look like \"16385, 16386\", at most %d tablespace OIDs.",
+							PTRACK_MAX_IGNORED_TABLESPACES);
+		return false;
+	}
+
+	return true;
+}
+
+void
+assign_ptrack_ignore_tablespaces(const char *newval, void *extra)
+{
+	int			noids = 0;
+
+	if (newval != NULL)
+		noids = ptrack_parse_ignore_tablespaces(newval, ptrack_policy.ignored);
+
+	ptrack_policy.nignored = Max(noids, 0);
+}
+
+/*
+ * Whether relation is unlogged, i.e. has the init fork.  Persistence of a
+ * relation file never changes, but its relfilenode may be reused after the
+ * relation is dropped.  This requires the old file to be unlinked, which
+ * happens only after a checkpoint, so the cache is dropped as soon as the
+ * map generation is increased by a checkpoint.  Cache is not used in
+ * critical sections, where memory allocation is not allowed.
+ */
+static bool
+ptrack_relation_is_unlogged(RelFileNode rnode)
+{
+	PtrackUnloggedEntry *entry;
+	PtrackFileKey key;
+	char		path[MAXPGPATH];
+	struct stat st;
+	bool		found;
+
+	if (CritSectionCount == 0 &&
+		(ptrack_unlogged_cache == NULL ||
+		 ptrack_unlogged_cache_generation != ptrack_map->generation))
+	{
+		HASHCTL		info;
+
+		if (ptrack_unlogged_cache != NULL)
+			hash_destroy(ptrack_unlogged_cache);
+
+		MemSet(&info, 0, sizeof(info));
+		info.keysize = sizeof(RelFileNode);
+		info.entrysize = sizeof(PtrackUnloggedEntry);
+		info.hcxt = TopMemoryContext;
+
+		ptrack_unlogged_cache = hash_create("ptrack unlogged relations", 256, &info,
+											HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+		ptrack_unlogged_cache_generation = ptrack_map->generation;
+	}
+
+	if (CritSectionCount == 0)
+	{
+		entry = (PtrackUnloggedEntry *) hash_search(ptrack_unlogged_cache, &rnode,
+													HASH_FIND, NULL);
+		if (entry != NULL)
+			return entry->unlogged;
+	}
+
+	ptrack_file_key(&key, rnode, INIT_FORKNUM, 0);
+	ptrack_file_entry_path(&key, path);
+	found = stat(path, &st) == 0;
+
+	if (CritSectionCount == 0)
+	{
+		entry = (PtrackUnloggedEntry *) hash_search(ptrack_unlogged_cache, &rnode,
+													HASH_ENTER, NULL);
+		entry->unlogged = found;
+	}
+
+	return found;
+}
+
+/*
+ * Whether changes of the relation fork are tracked in the map according to
+ * the tracking policy.  Other files are reported as changed as a whole.
+ */
+bool
+ptrack_is_tracked(RelFileNode rnode, ForkNumber forknum)
+{
+	bool		unlogged = false;
 
-		elog(DEBUG1, "assign_ptrack_map_size: ptrack_map_size set to " UINT64_FORMAT,
-			 ptrack_map_size);
-	}
+	/* Fast path for the default policy */
+	if (ptrack_policy.forks == PTRACK_ALL_FORKS &&
+		ptrack_policy.track_unlogged &&
+		ptrack_policy.nignored == 0)
+		return true;
+
+	if (!ptrack_policy.track_unlogged && forknum != INIT_FORKNUM &&
+		ptrack_map != NULL)
+		unlogged = ptrack_relation_is_unlogged(rnode);
+
+	return !ptrack_policy_excludes(&ptrack_policy, nodeSpc(rnode), forknum,
+								   unlogged);
 }
 
 /*
@@ -512,6 +2500,8 @@ ptrack_mark_file(Oid dbOid, Oid tablespaceOid,
 #else
 	int			oidchars;
 	char		oidbuf[OIDCHARS + 1];
+	unsigned	segno = 0;
+	const char *segstr;
 #endif
 
 	/* Do not track temporary relations */
@@ -536,8 +2526,23 @@ ptrack_mark_file(Oid dbOid, Oid tablespaceOid,
 	memcpy(oidbuf, filename, oidchars);
 	oidbuf[oidchars] = '\0';
 	nodeRel(nodeOf(rnode)) = atooid(oidbuf);
+
+	/* Segment number follows the only dot of the name, if any */
+	segstr = strchr(filename + oidchars, '.');
+	if (segstr != NULL)
+		segno = (unsigned) strtoul(segstr + 1, NULL, 10);
 #endif
 
+	if (!ptrack_is_tracked(nodeOf(rnode), forknum))
+		return;
+
+	/* Whole file change costs a single registry entry instead of all blocks */
+	if (ptrack_register_file(nodeOf(rnode), forknum, segno, ptrack_set_init_lsn()))
+	{
+		elog(DEBUG1, "ptrack_mark_file %s, registered as changed as a whole", filepath);
+		return;
+	}
+
 	/* Compute number of blocks based on file size */
 	if (stat(filepath, &stat_buf) == 0)
 		nblocks = stat_buf.st_size / BLCKSZ;
@@ -546,7 +2551,7 @@ ptrack_mark_file(Oid dbOid, Oid tablespaceOid,
 		 filepath, nblocks, nodeDb(nodeOf(rnode)), nodeSpc(nodeOf(rnode)), nodeRel(nodeOf(rnode)), forknum);
 
 	for (blkno = 0; blkno < nblocks; blkno++)
-		ptrack_mark_block(rnode, forknum, blkno);
+		ptrack_mark_block(rnode, forknum, segno * ((BlockNumber) RELSEG_SIZE) + blkno);
 }
 
 /*
@@ -599,7 +2604,11 @@ ptrack_walkdir(const char *path, Oid tablespaceOid, Oid dbOid)
 	FreeDir(dir);				/* we ignore any error here */
 }
 
-static void
+/*
+ * Raise LSN stored in var up to new_lsn.  Returns number of failed
+ * compare-and-swap attempts.
+ */
+static uint32
 ptrack_atomic_increase(XLogRecPtr new_lsn, pg_atomic_uint64 *var)
 {
 	/*
@@ -607,13 +2616,109 @@ ptrack_atomic_increase(XLogRecPtr new_lsn, pg_atomic_uint64 *var)
 	 * pg_atomic_uint64 is forcedly aligned on 8 bytes during the MSVC build.
 	 */
 	pg_atomic_uint64	old_lsn;
+	uint32		retries = 0;
 
 	old_lsn.value = pg_atomic_read_u64(var);
 #if USE_ASSERT_CHECKING
 	elog(DEBUG3, "ptrack_mark_block: " UINT64_FORMAT " <- " UINT64_FORMAT, old_lsn.value, new_lsn);
 #endif
 	while (old_lsn.value < new_lsn &&
-		   !pg_atomic_compare_exchange_u64(var, (uint64 *) &old_lsn.value, new_lsn));
+		   !pg_atomic_compare_exchange_u64(var, (uint64 *) &old_lsn.value, new_lsn))
+		retries++;
+
+	return retries;
+}
+
+/*
+ * Add marked blocks and failed compare-and-swap attempts to the counters.
+ */
+static void
+ptrack_count_marks(uint64 marks, uint32 retries)
+{
+	PtrackStatsStripe *stripe;
+
+	if (ptrack_stats == NULL)
+		return;
+
+	stripe = &ptrack_stats->stripes[MyProcPid % PTRACK_STATS_STRIPES].stripe;
+	pg_atomic_fetch_add_u64(&stripe->marks, marks);
+	if (retries > 0)
+		pg_atomic_fetch_add_u64(&stripe->cas_retries, retries);
+}
+
+/*
+ * Mark blocks added to the ring by the startup process in the maps.  All of
+ * them were written before the head of the ring is read here, so their pages
+ * are not newer than the replay LSN read after it, which is used for the
+ * whole batch.  Called by the startup process, when the ring is full, and by
+ * processes reading the maps.
+ */
+void
+ptrackRecoveryFlush(void)
+{
+	PtrackRecoveryRing *ring = ptrack_recovery_ring;
+	uint64		head;
+	uint64		tail;
+	uint64		pos;
+	XLogRecPtr	lsn;
+	uint32		retries = 0;
+
+	if (ring == NULL || ptrack_map == NULL)
+		return;
+
+	/* Ring is empty most of the time, unless we are a standby */
+	if (pg_atomic_read_u64(&ring->tail) == pg_atomic_read_u64(&ring->head))
+		return;
+
+	LWLockAcquire(ptrack_recovery_lock, LW_EXCLUSIVE);
+
+	head = pg_atomic_read_u64(&ring->head);
+	pg_read_barrier();
+	lsn = ptrack_set_init_lsn();
+
+	/*
+	 * Slots are not sorted as in WAL tracking mode, since sorting of a full
+	 * ring costs more than the cache misses it saves (see benchmarks).
+	 */
+	tail = pg_atomic_read_u64(&ring->tail);
+	for (pos = tail; pos < head; pos++)
+	{
+		PtBlockId  *bid = &ring->entries[pos % PTRACK_RECOVERY_RING_SIZE];
+		PtrackPartition *part = ptrack_partition(nodeSpc(bid->relnode));
+		uint64		hash = BID_HASH_FUNC(*bid);
+
+		retries += ptrack_atomic_increase(lsn, &part->map->entries[BID_HASH_SLOT1(part, hash)]);
+		retries += ptrack_atomic_increase(lsn, &part->map->entries[BID_HASH_SLOT2(part, hash)]);
+	}
+	ptrack_count_marks(head - tail, retries);
+
+	/*
+	 * Entries may be reused after the tail is moved, and others see the ring
+	 * empty only after they are marked.
+	 */
+	pg_memory_barrier();
+	pg_atomic_write_u64(&ring->tail, head);
+
+	LWLockRelease(ptrack_recovery_lock);
+}
+
+/*
+ * Add block written by the startup process to the ring.
+ */
+static void
+ptrack_recovery_add(const PtBlockId *bid)
+{
+	PtrackRecoveryRing *ring = ptrack_recovery_ring;
+	uint64		head = pg_atomic_read_u64(&ring->head);
+
+	if (head - pg_atomic_read_u64(&ring->tail) >= PTRACK_RECOVERY_RING_SIZE)
+		ptrackRecoveryFlush();
+
+	ring->entries[head % PTRACK_RECOVERY_RING_SIZE] = *bid;
+
+	/* Entry should be visible before the new head */
+	pg_write_barrier();
+	pg_atomic_write_u64(&ring->head, head + 1);
 }
 
 /*
@@ -624,9 +2729,11 @@ ptrack_mark_block(RelFileNodeBackend smgr_rnode,
 				  ForkNumber forknum, BlockNumber blocknum)
 {
 	PtBlockId	bid;
+	PtrackPartition *part;
 	uint64		hash;
 	size_t		slots[2];
 	XLogRecPtr	new_lsn;
+	uint32		retries = 0;
 	int			i;
 
 	if (ptrack_map_size == 0
@@ -635,13 +2742,28 @@ ptrack_mark_block(RelFileNodeBackend smgr_rnode,
 													* relations */
 		return;
 
+	/* Files excluded by the policy are reported as changed as a whole */
+	if (!ptrack_is_tracked(nodeOf(smgr_rnode), forknum))
+		return;
+
 	bid.relnode = nodeOf(smgr_rnode);
 	bid.forknum = forknum;
 	bid.blocknum = blocknum;
 
+	/*
+	 * Startup process replays WAL in a single thread, so it does not look up
+	 * the replay LSN for every block, see ptrackRecoveryFlush().
+	 */
+	if (ptrack_recovery_ring != NULL && AmStartupProcess())
+	{
+		ptrack_recovery_add(&bid);
+		return;
+	}
+
+	part = ptrack_partition(nodeSpc(bid.relnode));
 	hash = BID_HASH_FUNC(bid);
-	slots[0] = (size_t)(hash % PtrackContentNblocks);
-	slots[1] = (size_t)(((hash << 32) | (hash >> 32)) % PtrackContentNblocks);
+	slots[0] = BID_HASH_SLOT1(part, hash);
+	slots[1] = BID_HASH_SLOT2(part, hash);
 
 	new_lsn = ptrack_set_init_lsn();
 
@@ -651,8 +2773,458 @@ ptrack_mark_block(RelFileNodeBackend smgr_rnode,
 #if USE_ASSERT_CHECKING
 		elog(DEBUG3, "ptrack_mark_block: map[%zu]", slots[i]);
 #endif
-		ptrack_atomic_increase(new_lsn, &ptrack_map->entries[slots[i]]);
+		retries += ptrack_atomic_increase(new_lsn, &part->map->entries[slots[i]]);
+	}
+
+	ptrack_count_marks(1, retries);
+}
+
+#if PG_VERSION_NUM >= 150000
+static int
+ptrack_slot_cmp(const void *a, const void *b)
+{
+	uint64		sa = *(const uint64 *) a;
+	uint64		sb = *(const uint64 *) b;
+
+	if (sa < sb)
+		return -1;
+	if (sa > sb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Add both slots of the block to the batch of slots.  Slot in a batch is
+ * encoded as the partition number in the upper bits and the slot number in
+ * the lower PTRACK_BATCH_SLOT_BITS bits, which is enough for the largest map.
+ */
+static void
+ptrack_batch_add(uint64 *batch, int *nslots, const PtBlockId *bid)
+{
+	PtrackPartition *part = ptrack_partition(nodeSpc(bid->relnode));
+	uint64		partno = part - ptrack_partitions;
+	uint64		hash = BID_HASH_FUNC(*bid);
+
+	batch[(*nslots)++] = (partno << PTRACK_BATCH_SLOT_BITS) | BID_HASH_SLOT1(part, hash);
+	batch[(*nslots)++] = (partno << PTRACK_BATCH_SLOT_BITS) | BID_HASH_SLOT2(part, hash);
+}
+
+/*
+ * Mark slots of the batch collected by ptrack_batch_add() with lsn.  Slots
+ * are sorted first, so that ones referenced several times are marked only
+ * once and the maps are updated in the order of memory.
+ */
+static void
+ptrack_mark_batch(uint64 *batch, int nslots, uint64 nblocks,
+					  XLogRecPtr lsn)
+{
+	uint32		retries = 0;
+	int			i;
+
+	if (nslots == 0)
+		return;
+
+	qsort(batch, nslots, sizeof(uint64), ptrack_slot_cmp);
+
+	for (i = 0; i < nslots; i++)
+	{
+		PtrackPartition *part;
+		uint64		slot;
+
+		if (i > 0 && batch[i] == batch[i - 1])
+			continue;
+
+		part = &ptrack_partitions[batch[i] >> PTRACK_BATCH_SLOT_BITS];
+		slot = batch[i] & PTRACK_BATCH_SLOT_MASK;
+		retries += ptrack_atomic_increase(lsn, &part->map->entries[slot]);
+	}
+
+	ptrack_count_marks(nblocks, retries);
+}
+
+/* Visibility map block of a heap block, as in visibilitymap.c */
+#define PTRACK_HEAPBLOCKS_PER_VM_PAGE \
+	((BLCKSZ - MAXALIGN(SizeOfPageHeaderData)) * (BITS_PER_BYTE / BITS_PER_HEAPBLOCK))
+#define PTRACK_HEAPBLK_TO_MAPBLOCK(x) ((x) / PTRACK_HEAPBLOCKS_PER_VM_PAGE)
+
+/*
+ * Mark the visibility map block covering the heap block referenced by
+ * block_id of the current record.
+ */
+static void
+ptrack_mark_vm_block(XLogReaderState *reader, uint8 block_id, uint64 *blocks)
+{
+	RelFileNodeBackend rnode;
+	ForkNumber	forknum;
+	BlockNumber blkno;
+
+	if (!XLogRecGetBlockTagExtended(reader, block_id, &nodeOf(rnode),
+									&forknum, &blkno, NULL))
+		return;
+
+	rnode.backend = InvalidBackendId;
+	ptrack_mark_block(rnode, VISIBILITYMAP_FORKNUM, PTRACK_HEAPBLK_TO_MAPBLOCK(blkno));
+	(*blocks)++;
+}
+
+/*
+ * Heap records clearing visibility map bits register only the heap buffer,
+ * since visibilitymap_clear() is not WAL-logged, so mark the visibility map
+ * blocks of their heap blocks.
+ */
+static void
+ptrack_mark_vm_cleared(XLogReaderState *reader, uint64 *blocks)
+{
+	uint8		info = XLogRecGetInfo(reader) & XLOG_HEAP_OPMASK;
+	char	   *data = XLogRecGetData(reader);
+
+	if (XLogRecGetRmid(reader) == RM_HEAP_ID)
+	{
+		switch (info)
+		{
+			case XLOG_HEAP_INSERT:
+				if (((xl_heap_insert *) data)->flags & XLH_INSERT_ALL_VISIBLE_CLEARED)
+					ptrack_mark_vm_block(reader, 0, blocks);
+				break;
+			case XLOG_HEAP_DELETE:
+				if (((xl_heap_delete *) data)->flags & XLH_DELETE_ALL_VISIBLE_CLEARED)
+					ptrack_mark_vm_block(reader, 0, blocks);
+				break;
+			case XLOG_HEAP_UPDATE:
+			case XLOG_HEAP_HOT_UPDATE:
+				{
+					xl_heap_update *xlrec = (xl_heap_update *) data;
+
+					/* Old tuple is in block 1, unless it is on the same page */
+					if (xlrec->flags & XLH_UPDATE_OLD_ALL_VISIBLE_CLEARED)
+						ptrack_mark_vm_block(reader, XLogRecHasBlockRef(reader, 1) ? 1 : 0,
+											 blocks);
+					if (xlrec->flags & XLH_UPDATE_NEW_ALL_VISIBLE_CLEARED)
+						ptrack_mark_vm_block(reader, 0, blocks);
+					break;
+				}
+			case XLOG_HEAP_LOCK:
+				if (((xl_heap_lock *) data)->flags & XLH_LOCK_ALL_FROZEN_CLEARED)
+					ptrack_mark_vm_block(reader, 0, blocks);
+				break;
+		}
+	}
+	else if (XLogRecGetRmid(reader) == RM_HEAP2_ID)
+	{
+		switch (info)
+		{
+			case XLOG_HEAP2_MULTI_INSERT:
+				if (((xl_heap_multi_insert *) data)->flags & XLH_INSERT_ALL_VISIBLE_CLEARED)
+					ptrack_mark_vm_block(reader, 0, blocks);
+				break;
+			case XLOG_HEAP2_LOCK_UPDATED:
+				if (((xl_heap_lock_updated *) data)->flags & XLH_LOCK_ALL_FROZEN_CLEARED)
+					ptrack_mark_vm_block(reader, 0, blocks);
+				break;
+		}
+	}
+}
+
+/*
+ * Mark blocks referenced by WAL records starting from start_lsn up to
+ * init_lsn in the map and move init_lsn back to the first of these records,
+ * so that the map covers changes since start_lsn again, e.g. after it was
+ * reinitialized.  Changes since init_lsn are marked by hooks anyway, since
+ * every page changed after it is written later.  Blocks are marked with the
+ * current LSN, which only makes them look changed later than they were.
+ * Files copied by CREATE DATABASE are not referenced by records, so their
+ * current content is marked as a whole.  Visibility map bits cleared by heap
+ * records are not referenced either, so visibility map blocks of their heap
+ * blocks are marked, see ptrack_mark_vm_cleared().  Changes not logged at
+ * all, i.e. ones of unlogged relations, FSM pages and hint bits, cannot be
+ * restored.
+ *
+ * WAL is read from pg_wal, so it should not be removed since start_lsn.
+ * Returns the new init_lsn and the numbers of records and marked blocks.
+ */
+XLogRecPtr
+ptrackBackfill(XLogRecPtr start_lsn, uint64 *records, uint64 *blocks)
+{
+	XLogReaderState *reader;
+	ReadLocalXLogPageNoWaitPrivate *private_data;
+	XLogRecPtr	end_lsn;
+	XLogRecPtr	first_lsn;
+	XLogRecPtr	init_lsn;
+	char	   *errormsg;
+
+	*records = 0;
+	*blocks = 0;
+
+	if (ptrack_map_size == 0 || ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	/* Make sure that init_lsn is set, then hooks track everything after it */
+	ptrack_set_init_lsn();
+	end_lsn = pg_atomic_read_u64(&ptrack_map->init_lsn);
+
+	if (start_lsn >= end_lsn)
+		return end_lsn;
+
+	/* Records before init_lsn may be not flushed yet */
+	if (!RecoveryInProgress())
+		XLogFlush(end_lsn);
+
+	/* Page reader reports the end of WAL through private data */
+	private_data = palloc0(sizeof(ReadLocalXLogPageNoWaitPrivate));
+	reader = XLogReaderAllocate(wal_segment_size, NULL,
+								XL_ROUTINE(.page_read = &read_local_xlog_page_no_wait,
+										   .segment_open = &wal_segment_open,
+										   .segment_close = &wal_segment_close),
+								private_data);
+	if (reader == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory"),
+				 errdetail("Failed while allocating a WAL reading processor.")));
+
+	first_lsn = XLogFindNextRecord(reader, start_lsn);
+	if (XLogRecPtrIsInvalid(first_lsn))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("could not find a valid WAL record after %X/%X",
+						LSN_FORMAT_ARGS(start_lsn))));
+
+	while (reader->EndRecPtr < end_lsn)
+	{
+		int			block_id;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (XLogReadRecord(reader, &errormsg) == NULL)
+		{
+			if (errormsg != NULL)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("could not read WAL at %X/%X: %s",
+								LSN_FORMAT_ARGS(reader->EndRecPtr), errormsg)));
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("could not read WAL at %X/%X",
+							LSN_FORMAT_ARGS(reader->EndRecPtr))));
+		}
+
+		if (reader->ReadRecPtr >= end_lsn)
+			break;
+
+		(*records)++;
+
+		for (block_id = 0; block_id <= XLogRecMaxBlockId(reader); block_id++)
+		{
+			RelFileNodeBackend rnode;
+			ForkNumber	forknum;
+			BlockNumber blkno;
+
+			if (!XLogRecGetBlockTagExtended(reader, block_id, &nodeOf(rnode),
+											&forknum, &blkno, NULL))
+				continue;
+
+			rnode.backend = InvalidBackendId;
+			ptrack_mark_block(rnode, forknum, blkno);
+			(*blocks)++;
+		}
+
+		ptrack_mark_vm_cleared(reader, blocks);
+
+		if (XLogRecGetRmid(reader) == RM_DBASE_ID &&
+			(XLogRecGetInfo(reader) & ~XLR_INFO_MASK) == XLOG_DBASE_CREATE_FILE_COPY)
+		{
+			xl_dbase_create_file_copy_rec *xlrec;
+			char	   *dbpath;
+			struct stat st;
+
+			xlrec = (xl_dbase_create_file_copy_rec *) XLogRecGetData(reader);
+			dbpath = GetDatabasePath(xlrec->db_id, xlrec->tablespace_id);
+
+			/* Database may be dropped since then */
+			if (stat(dbpath, &st) == 0)
+				ptrack_walkdir(dbpath, xlrec->tablespace_id, xlrec->db_id);
+
+			pfree(dbpath);
+		}
+	}
+
+	XLogReaderFree(reader);
+	pfree(private_data);
+
+	/* Map covers changes since the first record now */
+	init_lsn = pg_atomic_read_u64(&ptrack_map->init_lsn);
+	while (first_lsn < init_lsn &&
+		   !pg_atomic_compare_exchange_u64(&ptrack_map->init_lsn, &init_lsn, first_lsn))
+		;
+
+	elog(LOG, "ptrack backfill: " UINT64_FORMAT " blocks of " UINT64_FORMAT " WAL records marked, init_lsn moved from %X/%X to %X/%X",
+		 *blocks, *records, LSN_FORMAT_ARGS(end_lsn),
+		 LSN_FORMAT_ARGS(Min(first_lsn, init_lsn)));
+
+	return Min(first_lsn, init_lsn);
+}
+
+/*
+ * Mark blocks referenced by WAL records from tracked_lsn up to target in the
+ * maps in WAL tracking mode.  Target should be the end of a record or
+ * InvalidXLogRecPtr, which means all WAL flushed (replayed on standby) so
+ * far.  Blocks are marked in batches with the end LSN of the last record of
+ * the batch, which only makes them look changed a bit later than they were.
+ *
+ * Only forks of WAL-logged relations and init forks are referenced by WAL,
+ * so the policy is checked without looking for unlogged relations.  Not
+ * every change is referenced though: clearing of visibility map bits by heap
+ * records registers only the heap buffer and FSM is not WAL-logged, so writes
+ * of these forks are marked by the mdwrite hook.  Directories copied by
+ * CREATE DATABASE are marked by the hook anyway.
+ */
+void
+ptrackWalTrack(XLogRecPtr target)
+{
+	XLogReaderState *reader;
+	ReadLocalXLogPageNoWaitPrivate *private_data;
+	XLogRecPtr	tracked_lsn;
+	XLogRecPtr	end_lsn;
+	uint64	   *batch;
+	int			nslots = 0;
+	uint64		nblocks = 0;
+	char	   *errormsg;
+
+	if (ptrack_wal == NULL || ptrack_map == NULL)
+		return;
+
+	if (!XLogRecPtrIsInvalid(target))
+	{
+		if (pg_atomic_read_u64(&ptrack_wal->tracked_lsn) >= target)
+			return;
+
+		/* Records before target may be not flushed yet */
+		if (!RecoveryInProgress())
+			XLogFlush(target);
+	}
+
+	LWLockAcquire(ptrack_wal_lock, LW_EXCLUSIVE);
+
+	/* WAL may be marked by someone else while we were waiting */
+	tracked_lsn = pg_atomic_read_u64(&ptrack_wal->tracked_lsn);
+	if (!XLogRecPtrIsInvalid(target) && tracked_lsn >= target)
+	{
+		LWLockRelease(ptrack_wal_lock);
+		return;
+	}
+
+	/* Page reader reports the end of WAL through private data */
+	private_data = palloc0(sizeof(ReadLocalXLogPageNoWaitPrivate));
+	reader = XLogReaderAllocate(wal_segment_size, NULL,
+								XL_ROUTINE(.page_read = &read_local_xlog_page_no_wait,
+										   .segment_open = &wal_segment_open,
+										   .segment_close = &wal_segment_close),
+								private_data);
+	if (reader == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory"),
+				 errdetail("Failed while allocating a WAL reading processor.")));
+
+	batch = palloc(PTRACK_WAL_BATCH_SLOTS * sizeof(uint64));
+	end_lsn = tracked_lsn;
+
+	if (XLogRecPtrIsInvalid(XLogFindNextRecord(reader, tracked_lsn)))
+	{
+		/* There is no complete record after tracked_lsn yet */
+		if (!private_data->end_of_wal)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("could not find a valid WAL record after %X/%X",
+							LSN_FORMAT_ARGS(tracked_lsn))));
+	}
+	else
+	{
+		for (;;)
+		{
+			int			block_id;
+
+			if (XLogReadRecord(reader, &errormsg) == NULL)
+			{
+				if (private_data->end_of_wal)
+					break;
+				if (errormsg != NULL)
+					ereport(ERROR,
+							(errcode(ERRCODE_DATA_CORRUPTED),
+							 errmsg("could not read WAL at %X/%X: %s",
+									LSN_FORMAT_ARGS(reader->EndRecPtr), errormsg)));
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("could not read WAL at %X/%X",
+								LSN_FORMAT_ARGS(reader->EndRecPtr))));
+			}
+
+			if (!XLogRecPtrIsInvalid(target) && reader->ReadRecPtr >= target)
+				break;
+
+			/* Every block takes two slots, make room for all of the record */
+			if (nslots + 2 * (XLogRecMaxBlockId(reader) + 1) > PTRACK_WAL_BATCH_SLOTS)
+			{
+				ptrack_mark_batch(batch, nslots, nblocks, end_lsn);
+				pg_atomic_write_u64(&ptrack_wal->tracked_lsn, end_lsn);
+				nslots = 0;
+				nblocks = 0;
+			}
+
+			for (block_id = 0; block_id <= XLogRecMaxBlockId(reader); block_id++)
+			{
+				PtBlockId	bid;
+
+				if (!XLogRecGetBlockTagExtended(reader, block_id, &bid.relnode,
+												&bid.forknum, &bid.blocknum, NULL))
+					continue;
+
+				if (ptrack_policy_excludes(&ptrack_policy, nodeSpc(bid.relnode),
+										   bid.forknum, false))
+					continue;
+
+				ptrack_batch_add(batch, &nslots, &bid);
+				nblocks++;
+			}
+
+			end_lsn = reader->EndRecPtr;
+		}
 	}
+
+	ptrack_mark_batch(batch, nslots, nblocks, end_lsn);
+
+	/* All records starting before target are marked, and it is flushed */
+	if (!XLogRecPtrIsInvalid(target))
+		end_lsn = Max(end_lsn, target);
+	pg_atomic_write_u64(&ptrack_wal->tracked_lsn, end_lsn);
+
+	LWLockRelease(ptrack_wal_lock);
+
+	XLogReaderFree(reader);
+	pfree(private_data);
+	pfree(batch);
+}
+#endif
+
+/*
+ * Make sure that all changes made so far are marked in the maps, i.e. blocks
+ * written by the startup process and, in WAL tracking mode, WAL.  Called
+ * before scanning the maps.
+ */
+void
+ptrackSyncMarks(void)
+{
+	ptrackRecoveryFlush();
+
+#if PG_VERSION_NUM >= 150000
+	if (ptrack_wal == NULL)
+		return;
+
+	if (RecoveryInProgress())
+		ptrackWalTrack(GetXLogReplayRecPtr(NULL));
+	else
+		ptrackWalTrack(GetXLogInsertRecPtr());
+#endif
 }
 
 XLogRecPtr
@@ -678,3 +3250,61 @@ ptrack_set_init_lsn(void)
 	}
 	return new_lsn;
 }
+
+/*
+ * Size of shared memory needed for ptrack counters.
+ */
+Size
+ptrackStatsShmemSize(void)
+{
+	return sizeof(PtrackStats);
+}
+
+/*
+ * Initialize freshly allocated shared ptrack counters.
+ */
+void
+ptrackStatsInit(void)
+{
+	int			i;
+
+	Assert(ptrack_stats != NULL);
+
+	for (i = 0; i < PTRACK_STATS_STRIPES; i++)
+	{
+		pg_atomic_init_u64(&ptrack_stats->stripes[i].stripe.marks, 0);
+		pg_atomic_init_u64(&ptrack_stats->stripes[i].stripe.cas_retries, 0);
+	}
+
+	pg_atomic_init_u64(&ptrack_stats->checkpoints, 0);
+	pg_atomic_init_u64(&ptrack_stats->checkpoint_time, 0);
+	pg_atomic_init_u64(&ptrack_stats->last_checkpoint_time, 0);
+	pg_atomic_init_u64(&ptrack_stats->checkpoint_bytes, 0);
+	pg_atomic_init_u64(&ptrack_stats->used_slots, 0);
+	pg_atomic_init_u64(&ptrack_stats->stats_reset, (uint64) GetCurrentTimestamp());
+}
+
+/*
+ * Reset shared ptrack counters.  Counters are not reset atomically as a
+ * whole, so concurrent updates may survive the reset.  Number of used slots
+ * describes the map itself, so it is kept.
+ */
+void
+ptrackStatsReset(void)
+{
+	int			i;
+
+	Assert(ptrack_stats != NULL);
+
+	for (i = 0; i < PTRACK_STATS_STRIPES; i++)
+	{
+		pg_atomic_write_u64(&ptrack_stats->stripes[i].stripe.marks, 0);
+		pg_atomic_write_u64(&ptrack_stats->stripes[i].stripe.cas_retries, 0);
+	}
+
+	pg_atomic_write_u64(&ptrack_stats->checkpoints, 0);
+	pg_atomic_write_u64(&ptrack_stats->checkpoint_time, 0);
+	pg_atomic_write_u64(&ptrack_stats->last_checkpoint_time, 0);
+	pg_atomic_write_u64(&ptrack_stats->checkpoint_bytes, 0);
+	pg_atomic_write_u64(&ptrack_stats->stats_reset, (uint64) GetCurrentTimestamp());
+}
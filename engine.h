@@ -24,28 +24,11 @@
 /*  #include "utils/relcache.h" */
 #include "access/hash.h"
 
-/* Persistent copy of ptrack.map to restore after crash */
-#define PTRACK_PATH "global/ptrack.map"
-/* Used for atomical crash-safe update of ptrack.map */
-#define PTRACK_PATH_TMP "global/ptrack.map.tmp"
+#include "ptrack_map.h"
 
 /*
- * 8k of 64 bit LSNs is 64 KB, which looks like a reasonable
- * buffer size for disk writes.  On fast NVMe SSD it gives
- * around 20% increase in ptrack checkpoint speed compared
- * to PTRACK_BUF_SIZE == 1000, i.e. 8 KB writes.
- * (PTRACK_BUS_SIZE is a count of pg_atomic_uint64)
- *
- * NOTE: but POSIX defines _POSIX_SSIZE_MAX as 32767 (bytes)
- */
-#define PTRACK_BUF_SIZE ((uint64) 8000)
-
-/* Ptrack magic bytes */
-#define PTRACK_MAGIC "ptk"
-#define PTRACK_MAGIC_SIZE 4
-
-/*
- * Header of ptrack map.
+ * Header of ptrack map in shared memory.  Map file has a different layout,
+ * see ptrack_map.h.
  */
 typedef struct PtrackMapHdr
 {
@@ -60,6 +43,12 @@ typedef struct PtrackMapHdr
 	 */
 	uint32		version_num;
 
+	/*
+	 * Generation of the map last written to file, see ptrack_map.h.  Only
+	 * the process doing ptrack checkpoint changes it.
+	 */
+	uint64		generation;
+
 	/* LSN of the moment, when map was last enabled. */
 	pg_atomic_uint64 init_lsn;
 
@@ -67,28 +56,84 @@ typedef struct PtrackMapHdr
 	pg_atomic_uint64 entries[FLEXIBLE_ARRAY_MEMBER];
 
 	/*
-	 * At the end of the map CRC of type pg_crc32c is stored.
+	 * At the end of the map there is unused space for pg_crc32c, which was
+	 * stored there by older versions.
 	 */
 }			PtrackMapHdr;
 
 typedef PtrackMapHdr * PtrackMap;
 
-/* Number of elements in ptrack map (LSN array)  */
-#define PtrackContentNblocks \
-		((ptrack_map_size - offsetof(PtrackMapHdr, entries) - sizeof(pg_crc32c)) / sizeof(pg_atomic_uint64))
+/* Number of elements in ptrack map (LSN array) of 'size' bytes */
+#define PTRACK_MAP_NSLOTS(size) \
+		(((size) - offsetof(PtrackMapHdr, entries) - sizeof(pg_crc32c)) / sizeof(pg_atomic_uint64))
+
+/* Actual size of the ptrack map, that we are able to fit into 'size' bytes */
+#define PTRACK_MAP_ACTUAL_SIZE(size) \
+		(offsetof(PtrackMapHdr, entries) + PTRACK_MAP_NSLOTS(size) * sizeof(pg_atomic_uint64) + sizeof(pg_crc32c))
 
-/* Actual size of the ptrack map, that we are able to fit into ptrack_map_size */
-#define PtrackActualSize \
-		(offsetof(PtrackMapHdr, entries) + PtrackContentNblocks * sizeof(pg_atomic_uint64) + sizeof(pg_crc32c))
+/* Size of the file of the map of 'nslots' slots, see ptrack_map.h */
+#define PTRACK_MAP_FILE_SIZE(nslots) \
+		(PTRACK_MAP_NREGIONS * PTRACK_MAP_REGION_SIZE((uint64) (nslots)))
 
-/* CRC32 value offset in order to directly access it in the shared memory chunk */
-#define PtrackCrcOffset (PtrackActualSize - sizeof(pg_crc32c))
+/* The same for the main map of ptrack.map_size */
+#define PtrackContentNblocks PTRACK_MAP_NSLOTS(ptrack_map_size)
+#define PtrackActualSize PTRACK_MAP_ACTUAL_SIZE(ptrack_map_size)
 
 /* Block address 'bid' to hash.  To get slot position in map should be divided
  * with '% PtrackContentNblocks' */
 #define BID_HASH_FUNC(bid) \
 		(DatumGetUInt64(hash_any_extended((unsigned char *)&bid, sizeof(bid), 0)))
 
+/*
+ * Positions of the two slots of the map partition 'part' of the block with
+ * hash value 'hash', see ptrack_map.h.
+ */
+#define BID_HASH_SLOT1(part, hash) PTRACK_HASH_SLOT1(hash, (part)->nslots)
+#define BID_HASH_SLOT2(part, hash) PTRACK_HASH_SLOT2(hash, (part)->nslots)
+
+/*
+ * Number of stripes of shared counters.  Backends update the stripe chosen
+ * by their pid, so concurrent marks rarely hit the same cache line, and
+ * readers sum all stripes up.
+ */
+#define PTRACK_STATS_STRIPES 64
+
+typedef struct PtrackStatsStripe
+{
+	/* Number of blocks marked in the map */
+	pg_atomic_uint64 marks;
+	/* Number of failed compare-and-swap attempts while marking */
+	pg_atomic_uint64 cas_retries;
+}			PtrackStatsStripe;
+
+typedef union PtrackStatsPaddedStripe
+{
+	PtrackStatsStripe stripe;
+	char		pad[PG_CACHE_LINE_SIZE];
+}			PtrackStatsPaddedStripe;
+
+/*
+ * Shared ptrack counters.  Everything except stripes is updated only by the
+ * process doing ptrack checkpoint.
+ */
+typedef struct PtrackStats
+{
+	PtrackStatsPaddedStripe stripes[PTRACK_STATS_STRIPES];
+
+	/* Number of completed ptrack checkpoints */
+	pg_atomic_uint64 checkpoints;
+	/* Total time spent in ptrack checkpoints, in microseconds */
+	pg_atomic_uint64 checkpoint_time;
+	/* Time spent in the last ptrack checkpoint, in microseconds */
+	pg_atomic_uint64 last_checkpoint_time;
+	/* Total number of bytes written to ptrack.map */
+	pg_atomic_uint64 checkpoint_bytes;
+	/* Number of used (non-zero) map slots at the last checkpoint */
+	pg_atomic_uint64 used_slots;
+	/* Time of the last reset of counters (TimestampTz) */
+	pg_atomic_uint64 stats_reset;
+}			PtrackStats;
+
 /*
  * Per process pointer to shared ptrack_map
  */
@@ -101,12 +146,163 @@ extern PtrackMap ptrack_map;
 extern uint64 ptrack_map_size;
 extern int	ptrack_map_size_tmp;
 
+/*
+ * Blocks of tablespaces listed in ptrack.partitions are tracked in separate
+ * maps of their own size, which are stored in separate files.  This keeps
+ * a write-heavy tablespace from saturating the map of other ones.  The main
+ * map of ptrack.map_size is always the first partition and tracks blocks of
+ * all other tablespaces.  All partitions share init_lsn of the main map and
+ * are reinitialized together.
+ */
+#define PTRACK_MAX_PARTITIONS 64
+
+typedef struct PtrackPartition
+{
+	Oid			spcOid;			/* InvalidOid for the main map */
+	uint64		size;			/* map size in bytes */
+	uint64		nslots;			/* PTRACK_MAP_NSLOTS(size) */
+	PtrackMap	map;			/* map in shared memory */
+}			PtrackPartition;
+
+extern PtrackPartition ptrack_partitions[PTRACK_MAX_PARTITIONS + 1];
+extern int	ptrack_npartitions;
+extern char *ptrack_partitions_conf;
+
+/*
+ * Map partition tracking blocks of tablespace 'spcOid'.  There are only a
+ * few partitions, so a linear search is fast enough.
+ */
+static inline PtrackPartition *
+ptrack_partition(Oid spcOid)
+{
+	int			i;
+
+	for (i = 1; i < ptrack_npartitions; i++)
+		if (ptrack_partitions[i].spcOid == spcOid)
+			return &ptrack_partitions[i];
+
+	return &ptrack_partitions[0];
+}
+
+/*
+ * Methods of writing ptrack map to file at checkpoint (ptrack.flush_method)
+ */
+typedef enum PtrackFlushMethod
+{
+	PTRACK_FLUSH_BUFFERED,		/* write() through OS page cache */
+	PTRACK_FLUSH_DIRECT,		/* synchronous direct I/O */
+	PTRACK_FLUSH_IO_URING		/* direct I/O with io_uring */
+}			PtrackFlushMethod;
+
+extern int	ptrack_flush_method;
+
+/*
+ * Placement of ptrack map in memory (ptrack.huge_pages, ptrack.numa_policy
+ * and ptrack.numa_nodes).  Map is placed in a separate shared mapping
+ * instead of the main shared memory segment if any of them is set.
+ */
+typedef enum PtrackHugePages
+{
+	PTRACK_HUGE_PAGES_OFF,
+	PTRACK_HUGE_PAGES_ON,
+	PTRACK_HUGE_PAGES_TRY
+}			PtrackHugePages;
+
+typedef enum PtrackNumaPolicy
+{
+	PTRACK_NUMA_DEFAULT,		/* leave it to the kernel */
+	PTRACK_NUMA_INTERLEAVE,		/* spread pages over nodes */
+	PTRACK_NUMA_BIND			/* allocate pages only on nodes */
+}			PtrackNumaPolicy;
+
+/*
+ * Max number of entries in the registry of files changed as a whole
+ * (ptrack.file_registry_size), 0 disables registry
+ */
+extern int	ptrack_file_registry_size;
+
+/*
+ * Tranche of LWLocks protecting the registry, serializing marking of WAL in
+ * WAL tracking mode and marking of blocks written by the startup process
+ */
+#define PTRACK_LWLOCK_TRANCHE "ptrack"
+#define PTRACK_NUM_LWLOCKS 3
+
+extern int	ptrack_huge_pages;
+extern int	ptrack_numa_policy;
+extern char *ptrack_numa_nodes;
+
+/*
+ * Modes of tracking changes (ptrack.tracking_mode).  In WAL mode block writes
+ * of main and init forks are not hooked, instead ptrack worker marks blocks
+ * referenced by flushed WAL records, see ptrackWalTrack().  Copied
+ * directories, extended relations and writes of visibility map and FSM
+ * pages, which may be not WAL-logged, are marked by hooks in both modes.
+ */
+typedef enum PtrackTrackingMode
+{
+	PTRACK_TRACKING_HOOKS,
+	PTRACK_TRACKING_WAL
+}			PtrackTrackingMode;
+
+extern int	ptrack_tracking_mode;
+extern int	ptrack_wal_delay;
+
+/*
+ * Tracking policy (ptrack.track_forks, ptrack.track_unlogged and
+ * ptrack.ignore_tablespaces), see ptrack_map.h
+ */
+extern PtrackPolicy ptrack_policy;
+extern char *ptrack_track_forks;
+extern char *ptrack_ignore_tablespaces;
+
+/*
+ * Per process pointer to shared ptrack counters
+ */
+extern PtrackStats *ptrack_stats;
+
+extern Size ptrackStatsShmemSize(void);
+extern void ptrackStatsInit(void);
+extern void ptrackStatsReset(void);
+
+extern Size ptrackFilesShmemSize(void);
+extern void ptrackFilesShmemInit(void);
+extern XLogRecPtr ptrack_file_lsn(RelFileNode rnode, ForkNumber forknum,
+								  uint32 segno);
+
 extern void ptrackCheckpoint(void);
+extern uint64 ptrackWriteMapCopy(const char *path, uint64 generation,
+								 uint64 *used_slots);
+extern PtrackMap ptrackMapMmap(void);
 extern void ptrackMapInit(void);
 extern void ptrackCleanFiles(void);
 extern XLogRecPtr ptrack_set_init_lsn(void);
+#if PG_VERSION_NUM >= 150000
+extern XLogRecPtr ptrackBackfill(XLogRecPtr start_lsn, uint64 *records,
+								 uint64 *blocks);
+extern void ptrackWalTrack(XLogRecPtr target);
+#endif
+extern Size ptrackWalShmemSize(void);
+extern void ptrackWalShmemInit(void);
+extern Size ptrackRecoveryShmemSize(void);
+extern void ptrackRecoveryShmemInit(void);
+extern void ptrackRecoveryFlush(void);
+extern void ptrackSyncMarks(void);
 
 extern void assign_ptrack_map_size(int newval, void *extra);
+extern bool check_ptrack_partitions(char **newval, void **extra, GucSource source);
+extern void assign_ptrack_partitions(const char *newval, void *extra);
+extern Size ptrackPartitionsShmemSize(void);
+extern uint64 ptrackTotalSlots(void);
+extern bool check_ptrack_flush_method(int *newval, void **extra, GucSource source);
+extern bool check_ptrack_huge_pages(int *newval, void **extra, GucSource source);
+extern bool check_ptrack_numa_policy(int *newval, void **extra, GucSource source);
+extern bool check_ptrack_numa_nodes(char **newval, void **extra, GucSource source);
+extern bool check_ptrack_track_forks(char **newval, void **extra, GucSource source);
+extern void assign_ptrack_track_forks(const char *newval, void *extra);
+extern bool check_ptrack_ignore_tablespaces(char **newval, void **extra, GucSource source);
+extern void assign_ptrack_ignore_tablespaces(const char *newval, void *extra);
+extern bool ptrack_is_tracked(RelFileNode rnode, ForkNumber forknum);
 
 extern void ptrack_walkdir(const char *path, Oid tablespaceOid, Oid dbOid);
 extern void ptrack_mark_block(RelFileNodeBackend smgr_rnode,
@@ -0,0 +1,212 @@
+/* ptrack/ptrack--2.4--2.5.sql */
+
+-- Complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION ptrack UPDATE;" to load this file. \quit
+
+CREATE FUNCTION ptrack_estimate_change(start_lsn pg_lsn,
+									   sample_fraction float8 DEFAULT 0.01)
+RETURNS TABLE (files			bigint,
+			   total_pages		bigint,
+			   sampled_pages	bigint,
+			   pages			bigint,
+			   pages_low		bigint,
+			   pages_high		bigint,
+			   "size, MB"		float8,
+			   "size_low, MB"	float8,
+			   "size_high, MB"	float8)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_profile_pagemapset(start_lsn pg_lsn,
+										  check_page_lsn bool DEFAULT false)
+RETURNS TABLE (tablespace			oid,
+			   files				bigint,
+			   segments				bigint,
+			   skipped_segments		bigint,
+			   blocks				bigint,
+			   whole_file_blocks	bigint,
+			   second_probes		bigint,
+			   second_probe_rate	float8,
+			   changed_blocks		bigint,
+			   rows					bigint,
+			   bytes				bigint,
+			   gather_ms			float8,
+			   stat_ms				float8,
+			   probe_ms				float8,
+			   filter_ms			float8,
+			   tuple_ms				float8,
+			   total_ms				float8)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_get_pagemapset_multi(start_lsns pg_lsn[])
+RETURNS TABLE (start_lsn	pg_lsn,
+			   path			text,
+			   pagecount	bigint,
+			   pagemap		bytea)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_get_relation_pagemap(rel regclass, start_lsn pg_lsn)
+RETURNS TABLE (path			text,
+			   pagecount	bigint,
+			   pagemap		bytea)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_get_stats(
+	OUT marks					bigint,
+	OUT cas_retries				bigint,
+	OUT checkpoints				bigint,
+	OUT checkpoint_time			float8,
+	OUT last_checkpoint_time	float8,
+	OUT checkpoint_bytes		bigint,
+	OUT used_slots				bigint,
+	OUT total_slots				bigint,
+	OUT stats_reset				timestamptz)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE VIEW ptrack_stats AS
+	SELECT * FROM ptrack_get_stats();
+
+CREATE FUNCTION ptrack_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION ptrack_stats_reset() FROM PUBLIC;
+
+CREATE FUNCTION ptrack_backfill(start_lsn pg_lsn,
+	OUT records		bigint,
+	OUT blocks		bigint,
+	OUT init_lsn	pg_lsn)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION ptrack_backfill(pg_lsn) FROM PUBLIC;
+
+CREATE FUNCTION ptrack_map_occupancy(start_lsn pg_lsn,
+									 target_fpr float8 DEFAULT 0.01)
+RETURNS TABLE (total_slots				bigint,
+			   used_slots				bigint,
+			   newer_slots				bigint,
+			   occupancy				float8,
+			   false_positive_rate		float8,
+			   changed_blocks			bigint,
+			   "recommended_size, MB"	bigint)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_map_histogram(buckets integer DEFAULT 10)
+RETURNS TABLE (lsn_from				pg_lsn,
+			   lsn_to				pg_lsn,
+			   slots				bigint,
+			   occupancy			float8,
+			   false_positive_rate	float8)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_verify_pagemap(start_lsn pg_lsn)
+RETURNS TABLE (path				text,
+			   pages			bigint,
+			   true_positives	bigint,
+			   false_positives	bigint,
+			   suspicious		bigint,
+			   missed			bigint)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- Reads all data pages of the cluster
+REVOKE ALL ON FUNCTION ptrack_verify_pagemap(pg_lsn) FROM PUBLIC;
+
+DROP FUNCTION ptrack_get_pagemapset(start_lsn pg_lsn);
+CREATE FUNCTION ptrack_get_pagemapset(start_lsn pg_lsn,
+									  check_page_lsn bool DEFAULT false)
+RETURNS TABLE (path			text,
+			   pagecount	bigint,
+			   pagemap		bytea)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- Reads candidate data pages with check_page_lsn
+REVOKE ALL ON FUNCTION ptrack_get_pagemapset(pg_lsn, bool) FROM PUBLIC;
+
+CREATE FUNCTION ptrack_get_changed_pages(start_lsn pg_lsn,
+										 check_page_lsn bool DEFAULT false,
+										 batch_pages integer DEFAULT 128)
+RETURNS TABLE (path			text,
+			   pagecount	integer,
+			   pages		bytea)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- Returns raw content of all relations, like pg_read_binary_file()
+REVOKE ALL ON FUNCTION ptrack_get_changed_pages(pg_lsn, bool, integer) FROM PUBLIC;
+
+CREATE FUNCTION ptrack_export_pagemapset(start_lsn pg_lsn,
+										 target_path text,
+										 check_page_lsn bool DEFAULT false)
+RETURNS TABLE (files	bigint,
+			   pages	bigint,
+			   bytes	bigint)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_read_pagemapset(source_path text)
+RETURNS TABLE (path			text,
+			   pagecount	bigint,
+			   pagemap		bytea)
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+-- Microbenchmarks of hot paths, available in assert-enabled or PTRACK_BENCH
+-- builds only.  Synthetic blocks are marked in the real map.
+CREATE FUNCTION ptrack_bench_mark(nblocks bigint,
+	pattern			text DEFAULT 'uniform',
+	nrelations		integer DEFAULT 1000,
+	seed			integer DEFAULT 0,
+	OUT ops			bigint,
+	OUT seconds		float8,
+	OUT ops_per_sec	float8,
+	OUT p50_ns		float8,
+	OUT p90_ns		float8,
+	OUT p99_ns		float8,
+	OUT max_ns		float8)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_bench_probe(lsn pg_lsn,
+	nblocks			bigint,
+	pattern			text DEFAULT 'uniform',
+	nrelations		integer DEFAULT 1000,
+	seed			integer DEFAULT 0,
+	OUT ops			bigint,
+	OUT seconds		float8,
+	OUT ops_per_sec	float8,
+	OUT p50_ns		float8,
+	OUT p90_ns		float8,
+	OUT p99_ns		float8,
+	OUT max_ns		float8,
+	OUT changed		bigint)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION ptrack_bench_flush(iterations integer DEFAULT 1,
+	OUT bytes		bigint,
+	OUT used_slots	bigint,
+	OUT mb_per_sec	float8,
+	OUT p50_ms		float8,
+	OUT p90_ms		float8,
+	OUT max_ms		float8)
+RETURNS record
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE ALL ON FUNCTION ptrack_bench_mark(bigint, text, integer, integer) FROM PUBLIC;
+REVOKE ALL ON FUNCTION ptrack_bench_probe(pg_lsn, bigint, text, integer, integer) FROM PUBLIC;
+REVOKE ALL ON FUNCTION ptrack_bench_flush(integer) FROM PUBLIC;
@@ -16,48 +16,168 @@
  *
  * Currently ptrack has following public API methods:
  *
- * # ptrack_version                  --- returns ptrack version string (2.4 currently).
- * # ptrack_get_pagemapset('LSN')    --- returns a set of changed data files with
+ * # ptrack_version                  --- returns ptrack version string (2.5 currently).
+ * # ptrack_get_pagemapset('LSN'[, check_page_lsn])
+ * 								     --- returns a set of changed data files with
  * 										 bitmaps of changed blocks since specified LSN.
  * # ptrack_init_lsn                 --- returns LSN of the last ptrack map initialization.
+ * # ptrack_get_pagemapset_multi('{LSN,...}')
+ * 								     --- same as ptrack_get_pagemapset, but returns bitmaps
+ * 										 for several LSNs within a single map scan.
+ * # ptrack_get_relation_pagemap('rel', 'LSN')
+ * 								     --- same as ptrack_get_pagemapset, but only for blocks
+ * 										 of a single relation.
+ * # ptrack_get_stats()              --- returns shared ptrack counters (see ptrack_stats view).
+ * # ptrack_stats_reset()            --- resets shared ptrack counters.
+ * # ptrack_map_occupancy('LSN', target_fpr)
+ * 								     --- returns fraction of map slots updated since LSN,
+ * 										 expected false positive rate and recommended
+ * 										 map size for the target rate.
+ * # ptrack_map_histogram(buckets)   --- returns histogram of LSNs stored in map slots.
+ * # ptrack_get_changed_pages('LSN'[, check_page_lsn[, batch_pages]])
+ * 								     --- returns content of changed blocks in batches.
+ * # ptrack_export_pagemapset('LSN', 'path'[, check_page_lsn])
+ * 								     --- writes a set of changed data files with bitmaps
+ * 										 into a binary file.
+ * # ptrack_read_pagemapset('path')  --- reads a file written by ptrack_export_pagemapset.
+ * # ptrack_verify_pagemap('LSN')    --- compares map with LSNs of data pages to count
+ * 										 false positives and missed changes.
+ * # ptrack_estimate_change('LSN', fraction)
+ * 								     --- estimates amount of changes since specified LSN
+ * 										 by probing a random sample of blocks.
+ * # ptrack_profile_pagemapset('LSN'[, check_page_lsn])
+ * 								     --- runs ptrack_get_pagemapset and returns time and
+ * 										 counters of its phases per tablespace.
  *
  */
 
 #include "postgres.h"
 
+#include <fcntl.h>
+#include <math.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #if PG_VERSION_NUM < 120000
 #include "access/htup_details.h"
 #endif
+#include "access/xlog.h"
+#if PG_VERSION_NUM >= 150000
+#include "access/xlogrecovery.h"
+#endif
+#include "catalog/objectaddress.h"
+#include "catalog/pg_authid.h"
 #include "catalog/pg_tablespace.h"
 #include "catalog/pg_type.h"
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
 #include "funcapi.h"
 #include "miscadmin.h"
 #include "nodes/pg_list.h"
+#include "port/pg_bswap.h"
 #include "port/pg_crc32c.h"
+#include "portability/instr_time.h"
+#if PG_VERSION_NUM >= 150000
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#endif
+#include "storage/bufpage.h"
 #include "storage/copydir.h"
+#include "storage/fd.h"
 #include "storage/ipc.h"
+#include "storage/latch.h"
 #include "storage/lmgr.h"
 #if PG_VERSION_NUM >= 120000
 #include "storage/md.h"
 #endif
 #include "storage/smgr.h"
 #include "storage/reinit.h"
+#if PG_VERSION_NUM >= 150000
+#include "tcop/tcopprot.h"
+#endif
+#include "utils/acl.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/pg_lsn.h"
+#include "utils/rel.h"
+#include "utils/sampling.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+#if PG_VERSION_NUM >= 150000
+#include "utils/wait_event.h"
+#endif
 
 #include "datapagemap.h"
 #include "ptrack.h"
+#include "ptrack_export.h"
 #include "engine.h"
 
 PG_MODULE_MAGIC;
 
+/* z-score of the 95% confidence interval used by ptrack_estimate_change() */
+#define PTRACK_ESTIMATE_Z 1.96
+
+/* Max number of blocks read from a data file at once, i.e. 1 MB */
+#define PTRACK_READ_CHUNK_BLOCKS 128
+
+/*
+ * Max number of unneeded blocks in a gap between two blocks, which we are
+ * ready to read to check LSNs of both with a single read.
+ */
+#define PTRACK_READ_GAP_BLOCKS 8
+
 PtrackMap	ptrack_map = NULL;
 uint64		ptrack_map_size = 0;
 int			ptrack_map_size_tmp;
+PtrackPartition ptrack_partitions[PTRACK_MAX_PARTITIONS + 1];
+int			ptrack_npartitions = 1;
+char	   *ptrack_partitions_conf = NULL;
+int			ptrack_flush_method = PTRACK_FLUSH_BUFFERED;
+int			ptrack_huge_pages = PTRACK_HUGE_PAGES_OFF;
+int			ptrack_numa_policy = PTRACK_NUMA_DEFAULT;
+char	   *ptrack_numa_nodes = NULL;
+int			ptrack_file_registry_size = 8192;
+PtrackPolicy ptrack_policy = {PTRACK_ALL_FORKS, true, 0};
+char	   *ptrack_track_forks = NULL;
+char	   *ptrack_ignore_tablespaces = NULL;
+int			ptrack_tracking_mode = PTRACK_TRACKING_HOOKS;
+int			ptrack_wal_delay = 200;
+
+static const struct config_enum_entry ptrack_flush_method_options[] = {
+	{"buffered", PTRACK_FLUSH_BUFFERED, false},
+	{"direct", PTRACK_FLUSH_DIRECT, false},
+#ifdef USE_LIBURING
+	{"io_uring", PTRACK_FLUSH_IO_URING, false},
+#endif
+	{NULL, 0, false}
+};
+
+/* WAL mode reads WAL with facilities available since PostgreSQL 15 */
+static const struct config_enum_entry ptrack_tracking_mode_options[] = {
+	{"hooks", PTRACK_TRACKING_HOOKS, false},
+#if PG_VERSION_NUM >= 150000
+	{"wal", PTRACK_TRACKING_WAL, false},
+#endif
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry ptrack_huge_pages_options[] = {
+	{"off", PTRACK_HUGE_PAGES_OFF, false},
+	{"on", PTRACK_HUGE_PAGES_ON, false},
+	{"try", PTRACK_HUGE_PAGES_TRY, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry ptrack_numa_policy_options[] = {
+	{"default", PTRACK_NUMA_DEFAULT, false},
+	{"interleave", PTRACK_NUMA_INTERLEAVE, false},
+	{"bind", PTRACK_NUMA_BIND, false},
+	{NULL, 0, false}
+};
 
 static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
 static copydir_hook_type prev_copydir_hook = NULL;
@@ -82,10 +202,23 @@ static void ptrack_backup_checkpoint_request_hook(void);
 #endif
 
 static void ptrack_gather_filelist(List **filelist, char *path, Oid spcOid, Oid dbOid);
+static void ptrack_gather_datadir(List **filelist);
+static void ptrack_gather_relation(List **filelist, Relation rel);
 static int	ptrack_filelist_getnext(PtScanCtx * ctx);
+static bytea *ptrack_pagemap_to_bytea(datapagemap_t *pagemap);
+static void ptrack_scan_file_multi(PtMultiScanCtx * ctx);
+static TupleDesc ptrack_pagemapset_tupdesc(void);
+static bool ptrack_pagemap_next(PtScanCtx * ctx, datapagemap_t *pagemap, int64 *pagecount);
+static HeapTuple ptrack_pagemapset_tuple(TupleDesc tupdesc, PtScanCtx * ctx,
+										 datapagemap_t *pagemap, int64 pagecount);
+static HeapTuple ptrack_pagemapset_next(FuncCallContext *funcctx, PtScanCtx * ctx);
+static int64 ptrack_filter_pagemap(PtScanCtx * ctx, datapagemap_t *pagemap, int64 pagecount);
 #if PG_VERSION_NUM >= 150000
 static shmem_request_hook_type prev_shmem_request_hook = NULL;
 static void ptrack_shmem_request(void);
+static void ptrack_register_wal_worker(void);
+
+PGDLLEXPORT void ptrack_wal_worker_main(Datum main_arg);
 #endif
 
 /*
@@ -123,6 +256,133 @@ _PG_init(void)
 							assign_ptrack_map_size,
 							NULL);
 
+	DefineCustomStringVariable("ptrack.partitions",
+							   "Sets tablespaces tracked in separate maps and sizes of these maps in MB.",
+							   "List of tablespace_oid:size_mb pairs separated by commas.",
+							   &ptrack_partitions_conf,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   check_ptrack_partitions,
+							   assign_ptrack_partitions,
+							   NULL);
+
+	DefineCustomEnumVariable("ptrack.flush_method",
+							 "Selects the method used for writing ptrack map to file at checkpoint.",
+							 NULL,
+							 &ptrack_flush_method,
+							 PTRACK_FLUSH_BUFFERED,
+							 ptrack_flush_method_options,
+							 PGC_SIGHUP,
+							 0,
+							 check_ptrack_flush_method,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("ptrack.huge_pages",
+							 "Use of huge pages for ptrack map.",
+							 NULL,
+							 &ptrack_huge_pages,
+							 PTRACK_HUGE_PAGES_OFF,
+							 ptrack_huge_pages_options,
+							 PGC_POSTMASTER,
+							 0,
+							 check_ptrack_huge_pages,
+							 NULL,
+							 NULL);
+
+	DefineCustomEnumVariable("ptrack.numa_policy",
+							 "Sets NUMA memory policy for ptrack map.",
+							 NULL,
+							 &ptrack_numa_policy,
+							 PTRACK_NUMA_DEFAULT,
+							 ptrack_numa_policy_options,
+							 PGC_POSTMASTER,
+							 0,
+							 check_ptrack_numa_policy,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("ptrack.numa_nodes",
+							   "Sets NUMA nodes used by ptrack.numa_policy (all online nodes if empty).",
+							   NULL,
+							   &ptrack_numa_nodes,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   check_ptrack_numa_nodes,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("ptrack.file_registry_size",
+							"Sets the max number of files changed as a whole tracked apart from ptrack map (0 disabled).",
+							NULL,
+							&ptrack_file_registry_size,
+							8192,
+							0, 1024 * 1024,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomStringVariable("ptrack.track_forks",
+							   "Sets relation forks, changes of which are tracked in ptrack map.",
+							   "Files of other forks are reported as changed as a whole.",
+							   &ptrack_track_forks,
+							   "main, fsm, vm, init",
+							   PGC_POSTMASTER,
+							   0,
+							   check_ptrack_track_forks,
+							   assign_ptrack_track_forks,
+							   NULL);
+
+	DefineCustomBoolVariable("ptrack.track_unlogged",
+							 "Tracks changes of unlogged relations in ptrack map.",
+							 "If off, files of unlogged relations except the init fork are reported as changed as a whole.",
+							 &ptrack_policy.track_unlogged,
+							 true,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("ptrack.ignore_tablespaces",
+							   "Sets tablespaces, changes in which are not tracked in ptrack map.",
+							   "List of tablespace OIDs separated by commas.  Their files are reported as changed as a whole.",
+							   &ptrack_ignore_tablespaces,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   check_ptrack_ignore_tablespaces,
+							   assign_ptrack_ignore_tablespaces,
+							   NULL);
+
+	DefineCustomEnumVariable("ptrack.tracking_mode",
+							 "Selects how changed blocks are marked in ptrack map.",
+							 "In wal mode blocks are marked by a background worker from WAL instead of on every write.",
+							 &ptrack_tracking_mode,
+							 PTRACK_TRACKING_HOOKS,
+							 ptrack_tracking_mode_options,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("ptrack.wal_delay",
+							"Sets the delay between WAL reads by ptrack worker in wal tracking mode.",
+							NULL,
+							&ptrack_wal_delay,
+							200,
+							1, 10000,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
 	/* Request server shared memory */
 	if (ptrack_map_size != 0)
 	{
@@ -130,12 +390,25 @@ _PG_init(void)
 		prev_shmem_request_hook = shmem_request_hook;
 		shmem_request_hook = ptrack_shmem_request;
 #else
-		RequestAddinShmemSpace(PtrackActualSize);
+		/* Map may be placed in a separate mapping, see ptrackMapMmap() */
+		if (ptrackMapMmap() == NULL)
+			RequestAddinShmemSpace(PtrackActualSize);
+		RequestAddinShmemSpace(ptrackPartitionsShmemSize());
+		RequestAddinShmemSpace(ptrackStatsShmemSize());
+		RequestAddinShmemSpace(ptrackFilesShmemSize());
+		RequestAddinShmemSpace(ptrackWalShmemSize());
+		RequestAddinShmemSpace(ptrackRecoveryShmemSize());
+		RequestNamedLWLockTranche(PTRACK_LWLOCK_TRANCHE, PTRACK_NUM_LWLOCKS);
 #endif
 	}
 	else
 		ptrackCleanFiles();
 
+#if PG_VERSION_NUM >= 150000
+	if (ptrack_map_size != 0 && ptrack_tracking_mode == PTRACK_TRACKING_WAL)
+		ptrack_register_wal_worker();
+#endif
+
 	/* Install hooks */
 	prev_shmem_startup_hook = shmem_startup_hook;
 	shmem_startup_hook = ptrack_shmem_startup_hook;
@@ -160,7 +433,83 @@ ptrack_shmem_request(void)
 	if (prev_shmem_request_hook)
 		prev_shmem_request_hook();
 
-	RequestAddinShmemSpace(PtrackActualSize);
+	/* Map may be placed in a separate mapping, see ptrackMapMmap() */
+	if (ptrackMapMmap() == NULL)
+		RequestAddinShmemSpace(PtrackActualSize);
+	RequestAddinShmemSpace(ptrackPartitionsShmemSize());
+	RequestAddinShmemSpace(ptrackStatsShmemSize());
+	RequestAddinShmemSpace(ptrackFilesShmemSize());
+	RequestAddinShmemSpace(ptrackWalShmemSize());
+	RequestAddinShmemSpace(ptrackRecoveryShmemSize());
+	RequestNamedLWLockTranche(PTRACK_LWLOCK_TRANCHE, PTRACK_NUM_LWLOCKS);
+}
+
+/*
+ * Register ptrack worker of WAL tracking mode.  Only WAL-logged changes can
+ * be marked from WAL, so relations skipping WAL with wal_level = minimal and
+ * unlogged relations, which are reported as changed as a whole only with
+ * ptrack.track_unlogged = off, cannot be tracked in this mode.
+ */
+static void
+ptrack_register_wal_worker(void)
+{
+	BackgroundWorker worker;
+
+	if (wal_level < WAL_LEVEL_REPLICA)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("ptrack.tracking_mode = wal requires wal_level \"replica\" or higher")));
+
+	if (ptrack_policy.track_unlogged)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("ptrack.tracking_mode = wal requires ptrack.track_unlogged = off"),
+				 errdetail("Changes of unlogged relations are not written to WAL.")));
+
+	MemSet(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = 1;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "ptrack");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "ptrack_wal_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "ptrack WAL tracker");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "ptrack WAL tracker");
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Main routine of ptrack worker, which marks blocks referenced by WAL in
+ * WAL tracking mode.  WAL flushed (replayed on standby) since the last run
+ * is read every ptrack.wal_delay.  Backends scanning the map and checkpoints
+ * mark the rest of WAL themselves, see ptrackSyncMarks().
+ */
+void
+ptrack_wal_worker_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	elog(DEBUG1, "ptrack WAL tracker started");
+
+	for (;;)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		ptrackWalTrack(InvalidXLogRecPtr);
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 ptrack_wal_delay,
+						 PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+	}
 }
 #endif
 
@@ -171,6 +520,8 @@ static void
 ptrack_shmem_startup_hook(void)
 {
 	bool map_found;
+	bool stats_found;
+	int			i;
 
 	if (prev_shmem_startup_hook)
 		prev_shmem_startup_hook();
@@ -182,18 +533,55 @@ ptrack_shmem_startup_hook(void)
 
 	if (ptrack_map_size != 0)
 	{
-		ptrack_map = ShmemInitStruct("ptrack map",
-									PtrackActualSize,
-									&map_found);
+		ptrack_map = ptrackMapMmap();
+		if (ptrack_map != NULL)
+		{
+			/*
+			 * Separate mapping is created by postmaster, which is the only
+			 * process running this hook with it, and survives crash restart,
+			 * so read the map again just like with a new shared memory.
+			 */
+			map_found = false;
+		}
+		else
+			ptrack_map = ShmemInitStruct("ptrack map",
+										PtrackActualSize,
+										&map_found);
+		ptrack_partitions[0].map = ptrack_map;
+
+		for (i = 1; i < ptrack_npartitions; i++)
+		{
+			PtrackPartition *part = &ptrack_partitions[i];
+			char		name[64];
+			bool		found;
+
+			snprintf(name, sizeof(name), "ptrack map %u", part->spcOid);
+			part->map = ShmemInitStruct(name,
+										PTRACK_MAP_ACTUAL_SIZE(part->size),
+										&found);
+		}
+
+		ptrackFilesShmemInit();
+		ptrackWalShmemInit();
+		ptrackRecoveryShmemInit();
+
+		/* All partitions are initialized together with the main map */
 		if (!map_found)
 		{
 			ptrackMapInit();
 			elog(DEBUG1, "Shared memory for ptrack is ready");
 		}
+
+		ptrack_stats = ShmemInitStruct("ptrack stats",
+									   ptrackStatsShmemSize(),
+									   &stats_found);
+		if (!stats_found)
+			ptrackStatsInit();
 	}
 	else
 	{
 		ptrack_map = NULL;
+		ptrack_stats = NULL;
 	}
 
 	LWLockRelease(AddinShmemInitLock);
@@ -248,11 +636,21 @@ ptrack_copydir_hook(const char *path)
 		prev_copydir_hook(path);
 }
 
+/*
+ * In WAL tracking mode written blocks are marked from WAL by ptrack worker.
+ * Writes of visibility map and FSM pages are still marked here, since they
+ * may change without a block reference in WAL: visibilitymap_clear() is not
+ * WAL-logged and FSM is not WAL-logged at all.  Extended blocks are marked
+ * by the extend hook in both modes, since relations may be extended with
+ * pages, which are not WAL-logged yet.
+ */
 static void
 ptrack_mdwrite_hook(RelFileNodeBackend smgr_rnode,
 					ForkNumber forknum, BlockNumber blocknum)
 {
-	ptrack_mark_block(smgr_rnode, forknum, blocknum);
+	if (ptrack_tracking_mode == PTRACK_TRACKING_HOOKS ||
+		forknum == VISIBILITYMAP_FORKNUM || forknum == FSM_FORKNUM)
+		ptrack_mark_block(smgr_rnode, forknum, blocknum);
 
 	if (prev_mdwrite_hook)
 		prev_mdwrite_hook(smgr_rnode, forknum, blocknum);
@@ -405,6 +803,202 @@ ptrack_gather_filelist(List **filelist, char *path, Oid spcOid, Oid dbOid)
 	FreeDir(dir);				/* we ignore any error here */
 }
 
+/*
+ * Form a list of all data files inside global, base and pg_tblspc.
+ */
+static void
+ptrack_gather_datadir(List **filelist)
+{
+	char		gather_path[MAXPGPATH];
+
+	/* Some changes may be not marked in the map yet */
+	ptrackSyncMarks();
+
+	sprintf(gather_path, "%s/%s", DataDir, "global");
+	ptrack_gather_filelist(filelist, gather_path, GLOBALTABLESPACE_OID, InvalidOid);
+
+	sprintf(gather_path, "%s/%s", DataDir, "base");
+	ptrack_gather_filelist(filelist, gather_path, InvalidOid, InvalidOid);
+
+	sprintf(gather_path, "%s/%s", DataDir, "pg_tblspc");
+	ptrack_gather_filelist(filelist, gather_path, InvalidOid, InvalidOid);
+}
+
+/*
+ * Add all segments of all forks of the relation to filelist.  Fork sizes are
+ * taken from smgr.
+ */
+static void
+ptrack_gather_relation(List **filelist, Relation rel)
+{
+	SMgrRelation reln;
+	RelFileNode relnode;
+	ForkNumber	forknum;
+
+#if PG_VERSION_NUM >= 160000
+	relnode = rel->rd_locator;
+#else
+	relnode = rel->rd_node;
+#endif
+
+	if (!OidIsValid(nodeRel(relnode)))
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("relation \"%s\" does not have storage",
+						RelationGetRelationName(rel))));
+
+	/* Do not track temporary relations */
+	if (RelationUsesLocalBuffers(rel))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("ptrack does not track temporary relation \"%s\"",
+						RelationGetRelationName(rel))));
+
+	/* Some changes may be not marked in the map yet */
+	ptrackSyncMarks();
+
+#if PG_VERSION_NUM >= 150000
+	reln = RelationGetSmgr(rel);
+#else
+	RelationOpenSmgr(rel);
+	reln = rel->rd_smgr;
+#endif
+
+	for (forknum = 0; forknum <= MAX_FORKNUM; forknum++)
+	{
+		BlockNumber nblocks;
+		int			segno;
+
+		if (!smgrexists(reln, forknum))
+			continue;
+
+		nblocks = smgrnblocks(reln, forknum);
+
+		for (segno = 0; (BlockNumber) segno * RELSEG_SIZE < nblocks; segno++)
+		{
+			PtrackFileList_i *pfl = palloc0(sizeof(PtrackFileList_i));
+
+			pfl->relnode = relnode;
+			pfl->forknum = forknum;
+			pfl->segno = segno;
+			pfl->path = GetRelationPath(nodeDb(relnode), nodeSpc(relnode),
+										nodeRel(relnode), InvalidBackendId, forknum);
+
+			*filelist = lappend(*filelist, pfl);
+
+			elog(DEBUG3, "ptrack: added segment %d of file %s to file list",
+				 segno, pfl->path);
+		}
+	}
+}
+
+/*
+ * Phases of a scan timed by ptrack_profile_pagemapset().
+ */
+typedef enum PtProfilePhase
+{
+	PT_PROFILE_STAT,			/* stat() of data files */
+	PT_PROFILE_PROBE,			/* probing of the map and building of bitmaps */
+	PT_PROFILE_FILTER,			/* reading of pages for check_page_lsn */
+	PT_PROFILE_TUPLE,			/* forming of result tuples */
+	PT_PROFILE_NPHASES
+}			PtProfilePhase;
+
+/*
+ * Counters of ptrack_profile_pagemapset() for the files of one tablespace.
+ */
+typedef struct PtScanProfileEntry
+{
+	Oid			spcOid;
+	int64		files;			/* relation files, i.e. their first segments */
+	int64		segments;
+	int64		skipped;		/* segments gone or empty */
+	int64		blocks;			/* blocks probed in the map */
+	int64		whole_file_blocks;	/* blocks of files changed as a whole */
+	int64		second_probes;
+	int64		changed_blocks;
+	int64		rows;
+	int64		bytes;			/* size of result tuples */
+	instr_time	time[PT_PROFILE_NPHASES];
+}			PtScanProfileEntry;
+
+typedef struct PtScanProfile
+{
+	MemoryContext cxt;			/* context of entries, which survives resets
+								 * of the per-file context of the scan */
+	PtScanProfileEntry *entries;
+	int			nentries;
+	int			maxentries;
+	int			current;		/* entry of the current file */
+	instr_time	file_start;		/* start of probing of the current file */
+}			PtScanProfile;
+
+static inline PtScanProfileEntry *
+ptrack_profile_current(PtScanCtx * ctx)
+{
+	return &ctx->profile->entries[ctx->profile->current];
+}
+
+/*
+ * Switch profile to the tablespace of the next file of the scan.  Second
+ * probes of the previous file are accounted to its tablespace.
+ */
+static void
+ptrack_profile_file(PtScanCtx * ctx, PtrackFileList_i *pfl)
+{
+	PtScanProfile *profile = ctx->profile;
+	Oid			spcOid = nodeSpc(pfl->relnode);
+	int			i;
+
+	if (profile->nentries > 0)
+		ptrack_profile_current(ctx)->second_probes += ctx->second_probes;
+	ctx->second_probes = 0;
+
+	for (i = 0; i < profile->nentries; i++)
+		if (profile->entries[i].spcOid == spcOid)
+			break;
+
+	if (i == profile->nentries)
+	{
+		if (profile->nentries == profile->maxentries)
+		{
+			/* Few tablespaces are expected */
+			profile->maxentries = Max(2, profile->maxentries * 2);
+			if (profile->entries == NULL)
+				profile->entries = MemoryContextAlloc(profile->cxt,
+													  profile->maxentries * sizeof(PtScanProfileEntry));
+			else
+				profile->entries = repalloc(profile->entries,
+											profile->maxentries * sizeof(PtScanProfileEntry));
+		}
+		MemSet(&profile->entries[i], 0, sizeof(PtScanProfileEntry));
+		profile->entries[i].spcOid = spcOid;
+		profile->nentries++;
+	}
+
+	profile->current = i;
+	profile->entries[i].segments++;
+	if (pfl->segno == 0)
+		profile->entries[i].files++;
+}
+
+/* Add time since 'start' to the phase of the current file */
+static void
+ptrack_profile_add(PtScanCtx * ctx, PtProfilePhase phase, instr_time start)
+{
+	instr_time	now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_ACCUM_DIFF(ptrack_profile_current(ctx)->time[phase], now, start);
+}
+
+/*
+ * Take the next file of the scan from the list.  The list item is freed and
+ * ctx->relpath is allocated in the context of the list and freed on the next
+ * call, so that memory does not grow with the number of files even if the
+ * scan runs in a long-lived context, while callers may reset theirs between
+ * files.
+ */
 static int
 ptrack_filelist_getnext(PtScanCtx * ctx)
 {
@@ -413,9 +1007,19 @@ ptrack_filelist_getnext(PtScanCtx * ctx)
 	char	   *fullpath;
 	struct stat fst;
 	uint32		rel_st_size = 0;
+	instr_time	stat_start;
+	int			sret;
+	int			segno;
+	MemoryContext oldcontext;
 
 get_next:
 
+	if (ctx->relpath != NULL)
+	{
+		pfree(ctx->relpath);
+		ctx->relpath = NULL;
+	}
+
 	/* No more file in the list */
 	if (list_length(ctx->filelist) == 0)
 		return -1;
@@ -440,7 +1044,9 @@ get_next:
 	{
 		Assert(pfl->forknum == MAIN_FORKNUM);
 		fullpath = psprintf("%s/%s.%d", DataDir, pfl->path, pfl->segno);
+		oldcontext = MemoryContextSwitchTo(GetMemoryChunkContext(pfl));
 		ctx->relpath = psprintf("%s.%d", pfl->path, pfl->segno);
+		MemoryContextSwitchTo(oldcontext);
 	}
 	else
 	{
@@ -453,10 +1059,37 @@ get_next:
 	nodeRel(ctx->bid.relnode) = nodeRel(pfl->relnode);
 	ctx->bid.forknum = pfl->forknum;
 	ctx->bid.blocknum = 0;
+	ctx->part = ptrack_partition(nodeSpc(pfl->relnode));
+	if (ptrack_is_tracked(pfl->relnode, pfl->forknum))
+		ctx->file_lsn = ptrack_file_lsn(pfl->relnode, pfl->forknum, pfl->segno);
+	else
+		/* File excluded by the tracking policy is always changed as a whole */
+		ctx->file_lsn = PG_UINT64_MAX;
+
+	if (ctx->profile != NULL)
+	{
+		ptrack_profile_file(ctx, pfl);
+		INSTR_TIME_SET_CURRENT(stat_start);
+	}
 
-	if (stat(fullpath, &fst) != 0)
+	sret = stat(fullpath, &fst);
+
+	if (ctx->profile != NULL)
+		ptrack_profile_add(ctx, PT_PROFILE_STAT, stat_start);
+
+	/* Path of the first segment is kept in ctx->relpath */
+	segno = pfl->segno;
+	if (segno > 0)
+		pfree(pfl->path);
+	pfree(pfl);
+
+	if (sret != 0)
 	{
+		if (ctx->profile != NULL)
+			ptrack_profile_current(ctx)->skipped++;
+
 		elog(WARNING, "ptrack: cannot stat file %s", fullpath);
+		pfree(fullpath);
 
 		/* But try the next one */
 		goto get_next;
@@ -466,26 +1099,115 @@ get_next:
 
 	if (rel_st_size == 0)
 	{
+		if (ctx->profile != NULL)
+			ptrack_profile_current(ctx)->skipped++;
+
 		elog(DEBUG3, "ptrack: skip empty file %s", fullpath);
+		pfree(fullpath);
 
 		/* But try the next one */
 		goto get_next;
 	}
 
-	if (pfl->segno > 0)
+	pfree(fullpath);
+
+	if (segno > 0)
 	{
-		ctx->relsize = pfl->segno * RELSEG_SIZE + rel_st_size / BLCKSZ;
-		ctx->bid.blocknum = pfl->segno * RELSEG_SIZE;
+		ctx->relsize = segno * RELSEG_SIZE + rel_st_size / BLCKSZ;
+		ctx->bid.blocknum = segno * RELSEG_SIZE;
 	}
 	else
 		/* Estimate relsize as size of first segment in blocks */
 		ctx->relsize = rel_st_size / BLCKSZ;
 
-	elog(DEBUG3, "ptrack: got file %s with size %u from the file list", pfl->path, ctx->relsize);
+	if (ctx->profile != NULL)
+	{
+		PtScanProfileEntry *entry = ptrack_profile_current(ctx);
+
+		if (ctx->file_lsn >= ctx->lsn)
+			entry->whole_file_blocks += ctx->relsize - ctx->bid.blocknum;
+		else
+			entry->blocks += ctx->relsize - ctx->bid.blocknum;
+		INSTR_TIME_SET_CURRENT(ctx->profile->file_start);
+	}
+
+	elog(DEBUG3, "ptrack: got file %s with size %u from the file list", ctx->relpath, ctx->relsize);
 
 	return 0;
 }
 
+/*
+ * Check whether the current block of the scan was changed since specified
+ * LSN according to the map or the registry of files changed as a whole.  The
+ * second slot is probed only if the first one is marked.
+ */
+bool
+ptrack_block_changed(PtScanCtx * ctx, XLogRecPtr lsn)
+{
+	PtrackPartition *part = ctx->part;
+	uint64		hash;
+
+	if (ctx->file_lsn >= lsn)
+		return true;
+
+	hash = BID_HASH_FUNC(ctx->bid);
+	if (pg_atomic_read_u64(&part->map->entries[BID_HASH_SLOT1(part, hash)]) < lsn)
+		return false;
+
+	ctx->second_probes++;
+	return pg_atomic_read_u64(&part->map->entries[BID_HASH_SLOT2(part, hash)]) >= lsn;
+}
+
+/*
+ * Create a bytea copy of the bitmap.
+ */
+static bytea *
+ptrack_pagemap_to_bytea(datapagemap_t *pagemap)
+{
+	Size		result_sz = pagemap->bitmapsize + VARHDRSZ;
+	bytea	   *result = (bytea *) palloc(result_sz);
+
+	SET_VARSIZE(result, result_sz);
+	memcpy(VARDATA(result), pagemap->bitmap, pagemap->bitmapsize);
+
+	return result;
+}
+
+/*
+ * Fill in bitmaps of the current file for all LSNs of the context within a
+ * single pass over the map.  A block has been changed since all LSNs not
+ * greater than the oldest of its two slots, so we probe the second slot only
+ * if the first one is marked since the oldest requested LSN.
+ */
+static void
+ptrack_scan_file_multi(PtMultiScanCtx * ctx)
+{
+	PtScanCtx  *scan = &ctx->scan;
+
+	for (; scan->bid.blocknum < scan->relsize; scan->bid.blocknum++)
+	{
+		uint64		hash = BID_HASH_FUNC(scan->bid);
+		XLogRecPtr	update_lsn;
+		XLogRecPtr	update_lsn2;
+		int			i;
+
+		update_lsn = pg_atomic_read_u64(&scan->part->map->entries[BID_HASH_SLOT1(scan->part, hash)]);
+		if (update_lsn < ctx->lsns[0] && scan->file_lsn < ctx->lsns[0])
+			continue;
+
+		update_lsn2 = pg_atomic_read_u64(&scan->part->map->entries[BID_HASH_SLOT2(scan->part, hash)]);
+		update_lsn = Min(update_lsn, update_lsn2);
+		update_lsn = Max(update_lsn, scan->file_lsn);
+
+		for (i = 0; i < ctx->nlsns && ctx->lsns[i] <= update_lsn; i++)
+		{
+			ctx->pagecounts[i] += 1;
+			datapagemap_add(&ctx->pagemaps[i],
+							scan->bid.blocknum % ((BlockNumber) RELSEG_SIZE));
+		}
+	}
+}
+
 /*
  * Returns ptrack version currently in use.
  */
@@ -517,77 +1239,181 @@ ptrack_init_lsn(PG_FUNCTION_ARGS)
 }
 
 /*
- * Return set of database blocks which were changed since specified LSN.
- * This function may return false positives (blocks that have not been updated).
+ * Read nbytes of file at offset.  Returns number of bytes read.
  */
-PG_FUNCTION_INFO_V1(ptrack_get_pagemapset);
-Datum
-ptrack_get_pagemapset(PG_FUNCTION_ARGS)
+static ssize_t
+ptrack_pread(int fd, char *buf, size_t nbytes, off_t offset)
 {
-	PtScanCtx *ctx;
-	FuncCallContext *funcctx;
-	MemoryContext oldcontext;
-	datapagemap_t pagemap;
-	int64		pagecount = 0;
-	char		gather_path[MAXPGPATH];
-
-	/* Exit immediately if there is no map */
-	if (ptrack_map == NULL)
-		elog(ERROR, "ptrack is disabled");
+#if PG_VERSION_NUM >= 120000
+	return pg_pread(fd, buf, nbytes, offset);
+#else
+	if (lseek(fd, offset, SEEK_SET) < 0)
+		return -1;
 
-	if (SRF_IS_FIRSTCALL())
-	{
-		TupleDesc	tupdesc;
+	return read(fd, buf, nbytes);
+#endif
+}
 
-		funcctx = SRF_FIRSTCALL_INIT();
+/*
+ * Returns index of the first block after the run of blocks starting from
+ * blocks[first], which could be read at once.
+ */
+static int
+ptrack_next_run(BlockNumber *blocks, int nblocks, int first)
+{
+	int			last = first + 1;
 
-		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+	while (last < nblocks &&
+		   blocks[last] - blocks[last - 1] <= PTRACK_READ_GAP_BLOCKS + 1 &&
+		   blocks[last] - blocks[first] < PTRACK_READ_CHUNK_BLOCKS)
+		last++;
 
-		ctx = (PtScanCtx *) palloc0(sizeof(PtScanCtx));
-		ctx->lsn = PG_GETARG_LSN(0);
-		ctx->filelist = NIL;
+	return last;
+}
 
-		/* Make tuple descriptor */
-#if PG_VERSION_NUM >= 120000
-		tupdesc = CreateTemplateTupleDesc(3);
-#else
-		tupdesc = CreateTemplateTupleDesc(3, false);
-#endif
-		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "path", TEXTOID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "pagecount", INT8OID, -1, 0);
-		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "pagemap", BYTEAOID, -1, 0);
-		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+/*
+ * Read blocks of the current segment marked in pagemap and remove ones, which
+ * have not been changed since the scan LSN according to their pd_lsn.  New
+ * pages and pages without LSN are kept, since we cannot check them.  It must
+ * be used for the main fork only, see ptrack_pagemap_next().  Close
+ * blocks are coalesced into a single read and the kernel is told about all
+ * reads in advance.  Returns the new number of blocks in pagemap.
+ */
+static int64
+ptrack_filter_pagemap(PtScanCtx * ctx, datapagemap_t *pagemap, int64 pagecount)
+{
+	datapagemap_iterator_t *iter;
+	BlockNumber *blocks;
+	BlockNumber blkno;
+	char	   *fullpath;
+	int			nblocks = 0;
+	int			first;
+	int			fd;
 
-		funcctx->user_fctx = ctx;
+	blocks = (BlockNumber *) palloc(sizeof(BlockNumber) * pagecount);
 
-		/*
-		 * Form a list of all data files inside global, base and pg_tblspc.
-		 *
-		 * TODO: refactor it to do not form a list, but use iterator instead,
-		 * e.g. just ptrack_filelist_getnext(ctx).
-		 */
-		sprintf(gather_path, "%s/%s", DataDir, "global");
-		ptrack_gather_filelist(&ctx->filelist, gather_path, GLOBALTABLESPACE_OID, InvalidOid);
+	iter = datapagemap_iterate(pagemap);
+	while (datapagemap_next(iter, &blkno))
+		blocks[nblocks++] = blkno;
+	pfree(iter);
 
-		sprintf(gather_path, "%s/%s", DataDir, "base");
-		ptrack_gather_filelist(&ctx->filelist, gather_path, InvalidOid, InvalidOid);
+	fullpath = psprintf("%s/%s", DataDir, ctx->relpath);
 
-		sprintf(gather_path, "%s/%s", DataDir, "pg_tblspc");
-		ptrack_gather_filelist(&ctx->filelist, gather_path, InvalidOid, InvalidOid);
+	fd = OpenTransientFile(fullpath, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		/* Relation may be dropped concurrently, keep the bitmap as is */
+		if (errno == ENOENT)
+		{
+			pfree(fullpath);
+			pfree(blocks);
+			return pagecount;
+		}
 
-		MemoryContextSwitchTo(oldcontext);
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not open file \"%s\": %m", fullpath)));
 	}
 
-	funcctx = SRF_PERCALL_SETUP();
-	ctx = (PtScanCtx *) funcctx->user_fctx;
+#if defined(USE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	for (first = 0; first < nblocks; first = ptrack_next_run(blocks, nblocks, first))
+	{
+		int			last = ptrack_next_run(blocks, nblocks, first) - 1;
 
-	/* Initialize bitmap */
-	pagemap.bitmap = NULL;
-	pagemap.bitmapsize = 0;
+		(void) posix_fadvise(fd, (off_t) blocks[first] * BLCKSZ,
+							 (off_t) (blocks[last] - blocks[first] + 1) * BLCKSZ,
+							 POSIX_FADV_WILLNEED);
+	}
+#endif
 
-	/* Take next file from the list */
-	if (ptrack_filelist_getnext(ctx) < 0)
-		SRF_RETURN_DONE(funcctx);
+	for (first = 0; first < nblocks;)
+	{
+		int			next = ptrack_next_run(blocks, nblocks, first);
+		BlockNumber start = blocks[first];
+		size_t		nbytes = (size_t) (blocks[next - 1] - start + 1) * BLCKSZ;
+		ssize_t		nread;
+		int			i;
+
+		CHECK_FOR_INTERRUPTS();
+
+		nread = ptrack_pread(fd, ctx->readbuf, nbytes, (off_t) start * BLCKSZ);
+		if (nread < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("ptrack: could not read file \"%s\": %m", fullpath)));
+
+		for (i = first; i < next; i++)
+		{
+			size_t		offset = (size_t) (blocks[i] - start) * BLCKSZ;
+			Page		page = (Page) (ctx->readbuf + offset);
+			XLogRecPtr	page_lsn;
+
+			/* File may be truncated concurrently, keep blocks we do not have */
+			if (offset + BLCKSZ > (size_t) nread)
+				break;
+
+			if (PageIsNew(page))
+				continue;
+
+			page_lsn = PageGetLSN(page);
+			if (page_lsn != InvalidXLogRecPtr && page_lsn < ctx->lsn)
+			{
+				pagemap->bitmap[blocks[i] / 8] &= ~(1 << (blocks[i] % 8));
+				pagecount--;
+			}
+		}
+
+		first = next;
+	}
+
+	if (CloseTransientFile(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not close file \"%s\": %m", fullpath)));
+
+	pfree(fullpath);
+	pfree(blocks);
+
+	return pagecount;
+}
+
+/*
+ * Make tuple descriptor of ptrack_get_pagemapset() and similar functions.
+ */
+static TupleDesc
+ptrack_pagemapset_tupdesc(void)
+{
+	TupleDesc	tupdesc;
+
+#if PG_VERSION_NUM >= 120000
+	tupdesc = CreateTemplateTupleDesc(3);
+#else
+	tupdesc = CreateTemplateTupleDesc(3, false);
+#endif
+	TupleDescInitEntry(tupdesc, (AttrNumber) 1, "path", TEXTOID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 2, "pagecount", INT8OID, -1, 0);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 3, "pagemap", BYTEAOID, -1, 0);
+
+	return BlessTupleDesc(tupdesc);
+}
+
+/*
+ * Take files from the list of the scan context until a file with changed
+ * blocks is found and return its bitmap and number of changed blocks in it.
+ * Path of the file is left in ctx->relpath.  Returns false if there are no
+ * more files in the list.
+ */
+static bool
+ptrack_pagemap_next(PtScanCtx * ctx, datapagemap_t *pagemap, int64 *pagecount)
+{
+	/* Initialize bitmap */
+	pagemap->bitmap = NULL;
+	pagemap->bitmapsize = 0;
+	*pagecount = 0;
+
+	/* Take next file from the list */
+	if (ptrack_filelist_getnext(ctx) < 0)
+		return false;
 
 	while (true)
 	{
@@ -600,45 +1426,58 @@ ptrack_get_pagemapset(PG_FUNCTION_ARGS)
 		/* Stop traversal if there are no more segments */
 		if (ctx->bid.blocknum >= ctx->relsize)
 		{
-			/* We completed a segment and there is a bitmap to return */
-			if (pagemap.bitmap != NULL)
+			if (ctx->profile != NULL)
+				ptrack_profile_add(ctx, PT_PROFILE_PROBE, ctx->profile->file_start);
+
+			/*
+			 * Drop blocks, which are not changed according to their LSNs.
+			 * Pages of files changed as a whole, e.g. copied from template
+			 * database, keep older LSNs, so they are not checked.  Only the
+			 * main fork is checked, since visibility map bits are cleared
+			 * and FSM pages are changed without updating the page LSN.
+			 */
+			if (pagemap->bitmap != NULL && ctx->check_page_lsn &&
+				ctx->bid.forknum == MAIN_FORKNUM && ctx->file_lsn < ctx->lsn)
 			{
-				Datum		values[3];
-				bool		nulls[3] = {false};
-				char		pathname[MAXPGPATH];
-				bytea	   *result = NULL;
-				Size		result_sz = pagemap.bitmapsize + VARHDRSZ;
-				HeapTuple	htup = NULL;
-
-				/* Create a bytea copy of our bitmap */
-				result = (bytea *) palloc(result_sz);
-				SET_VARSIZE(result, result_sz);
-				memcpy(VARDATA(result), pagemap.bitmap, pagemap.bitmapsize);
-
-				strcpy(pathname, ctx->relpath);
-
-				values[0] = CStringGetTextDatum(pathname);
-				values[1] = Int64GetDatum(pagecount);
-				values[2] = PointerGetDatum(result);
-
-				pfree(pagemap.bitmap);
-				pagemap.bitmap = NULL;
-				pagemap.bitmapsize = 0;
-				pagecount = 0;
-
-				htup = heap_form_tuple(funcctx->tuple_desc, values, nulls);
-				if (htup)
-					SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(htup));
+				instr_time	filter_start;
+
+				if (ctx->profile != NULL)
+					INSTR_TIME_SET_CURRENT(filter_start);
+
+				*pagecount = ptrack_filter_pagemap(ctx, pagemap, *pagecount);
+
+				if (ctx->profile != NULL)
+					ptrack_profile_add(ctx, PT_PROFILE_FILTER, filter_start);
+
+				if (*pagecount == 0)
+				{
+					pfree(pagemap->bitmap);
+					pagemap->bitmap = NULL;
+					pagemap->bitmapsize = 0;
+				}
 			}
 
+			/* We completed a segment and there is a bitmap to return */
+			if (pagemap->bitmap != NULL)
+				return true;
+
 			if (ptrack_filelist_getnext(ctx) < 0)
-				SRF_RETURN_DONE(funcctx);
+				return false;
+		}
+
+		/* The whole file has been changed since specified LSN */
+		if (ctx->file_lsn >= ctx->lsn)
+		{
+			*pagecount += 1;
+			datapagemap_add(pagemap, ctx->bid.blocknum % ((BlockNumber) RELSEG_SIZE));
+			ctx->bid.blocknum += 1;
+			continue;
 		}
 
 		hash = BID_HASH_FUNC(ctx->bid);
-		slot1 = (size_t)(hash % PtrackContentNblocks);
+		slot1 = BID_HASH_SLOT1(ctx->part, hash);
 
-		update_lsn1 = pg_atomic_read_u64(&ptrack_map->entries[slot1]);
+		update_lsn1 = pg_atomic_read_u64(&ctx->part->map->entries[slot1]);
 
 #if USE_ASSERT_CHECKING
 		if (update_lsn1 != InvalidXLogRecPtr)
@@ -650,8 +1489,9 @@ ptrack_get_pagemapset(PG_FUNCTION_ARGS)
 		/* Only probe the second slot if the first one is marked */
 		if (update_lsn1 >= ctx->lsn)
 		{
-			slot2 = (size_t)(((hash << 32) | (hash >> 32)) % PtrackContentNblocks);
-			update_lsn2 = pg_atomic_read_u64(&ptrack_map->entries[slot2]);
+			ctx->second_probes++;
+			slot2 = BID_HASH_SLOT2(ctx->part, hash);
+			update_lsn2 = pg_atomic_read_u64(&ctx->part->map->entries[slot2]);
 
 #if USE_ASSERT_CHECKING
 			if (update_lsn2 != InvalidXLogRecPtr)
@@ -663,11 +1503,1738 @@ ptrack_get_pagemapset(PG_FUNCTION_ARGS)
 			/* Block has been changed since specified LSN.  Mark it in the bitmap */
 			if (update_lsn2 >= ctx->lsn)
 			{
-				pagecount += 1;
-				datapagemap_add(&pagemap, ctx->bid.blocknum % ((BlockNumber) RELSEG_SIZE));
+				*pagecount += 1;
+				datapagemap_add(pagemap, ctx->bid.blocknum % ((BlockNumber) RELSEG_SIZE));
 			}
 		}
 
 		ctx->bid.blocknum += 1;
 	}
 }
+
+/*
+ * Form a tuple of ptrack_get_pagemapset() with the bitmap of the current file
+ * of the scan context.  Bitmap is freed.
+ */
+static HeapTuple
+ptrack_pagemapset_tuple(TupleDesc tupdesc, PtScanCtx * ctx,
+						datapagemap_t *pagemap, int64 pagecount)
+{
+	Datum		values[3];
+	bool		nulls[3] = {false};
+
+	values[0] = CStringGetTextDatum(ctx->relpath);
+	values[1] = Int64GetDatum(pagecount);
+	/* Create a bytea copy of our bitmap */
+	values[2] = PointerGetDatum(ptrack_pagemap_to_bytea(pagemap));
+
+	pfree(pagemap->bitmap);
+
+	return heap_form_tuple(tupdesc, values, nulls);
+}
+
+/*
+ * Take files from the list of the scan context until a file with changed
+ * blocks is found and form a tuple with its bitmap.  Returns NULL if there
+ * are no more files in the list.
+ */
+static HeapTuple
+ptrack_pagemapset_next(FuncCallContext *funcctx, PtScanCtx * ctx)
+{
+	datapagemap_t pagemap;
+	int64		pagecount;
+
+	if (!ptrack_pagemap_next(ctx, &pagemap, &pagecount))
+		return NULL;
+
+	return ptrack_pagemapset_tuple(funcctx->tuple_desc, ctx, &pagemap, pagecount);
+}
+
+/*
+ * Return set of database blocks which were changed since specified LSN.
+ * This function may return false positives (blocks that have not been updated).
+ */
+PG_FUNCTION_INFO_V1(ptrack_get_pagemapset);
+Datum
+ptrack_get_pagemapset(PG_FUNCTION_ARGS)
+{
+	PtScanCtx *ctx;
+	FuncCallContext *funcctx;
+	MemoryContext oldcontext;
+	HeapTuple	htup;
+
+	/* Exit immediately if there is no map */
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		ctx = (PtScanCtx *) palloc0(sizeof(PtScanCtx));
+		ctx->lsn = PG_GETARG_LSN(0);
+		ctx->filelist = NIL;
+
+		/* Function could be declared with a single argument before 2.5 */
+		if (PG_NARGS() > 1 && PG_GETARG_BOOL(1))
+		{
+			ctx->check_page_lsn = true;
+			ctx->readbuf = palloc((Size) PTRACK_READ_CHUNK_BLOCKS * BLCKSZ);
+		}
+
+		/* Make tuple descriptor */
+		funcctx->tuple_desc = ptrack_pagemapset_tupdesc();
+
+		funcctx->user_fctx = ctx;
+
+		/*
+		 * Form a list of all data files inside global, base and pg_tblspc.
+		 *
+		 * TODO: refactor it to do not form a list, but use iterator instead,
+		 * e.g. just ptrack_filelist_getnext(ctx).
+		 */
+		ptrack_gather_datadir(&ctx->filelist);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	ctx = (PtScanCtx *) funcctx->user_fctx;
+
+	htup = ptrack_pagemapset_next(funcctx, ctx);
+	if (htup == NULL)
+		SRF_RETURN_DONE(funcctx);
+
+	SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(htup));
+}
+
+/*
+ * Same as ptrack_get_pagemapset(), but only for the blocks of one relation.
+ * Relation forks and their sizes are taken from smgr, so we do not need to
+ * walk the whole data directory.
+ */
+PG_FUNCTION_INFO_V1(ptrack_get_relation_pagemap);
+Datum
+ptrack_get_relation_pagemap(PG_FUNCTION_ARGS)
+{
+	PtScanCtx *ctx;
+	FuncCallContext *funcctx;
+	MemoryContext oldcontext;
+	HeapTuple	htup;
+
+	/* Exit immediately if there is no map */
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		Oid			relid = PG_GETARG_OID(0);
+		Relation	rel;
+		AclResult	aclresult;
+
+		/* Do not lock relations, which the user cannot read */
+		aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+		if (aclresult != ACLCHECK_OK)
+			aclcheck_error(aclresult, get_relkind_objtype(get_rel_relkind(relid)),
+						   get_rel_name(relid));
+
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		ctx = (PtScanCtx *) palloc0(sizeof(PtScanCtx));
+		ctx->lsn = PG_GETARG_LSN(1);
+		ctx->filelist = NIL;
+
+		funcctx->tuple_desc = ptrack_pagemapset_tupdesc();
+		funcctx->user_fctx = ctx;
+
+		/* Lock is kept until the end of transaction */
+		rel = relation_open(relid, AccessShareLock);
+		ptrack_gather_relation(&ctx->filelist, rel);
+		relation_close(rel, NoLock);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	ctx = (PtScanCtx *) funcctx->user_fctx;
+
+	htup = ptrack_pagemapset_next(funcctx, ctx);
+	if (htup == NULL)
+		SRF_RETURN_DONE(funcctx);
+
+	SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(htup));
+}
+
+static int
+ptrack_lsn_cmp(const void *a, const void *b)
+{
+	XLogRecPtr	lsn1 = *(const XLogRecPtr *) a;
+	XLogRecPtr	lsn2 = *(const XLogRecPtr *) b;
+
+	if (lsn1 < lsn2)
+		return -1;
+	else if (lsn1 > lsn2)
+		return 1;
+	return 0;
+}
+
+/*
+ * Same as ptrack_get_pagemapset(), but for several LSNs at once, e.g. for
+ * several backup chains with different parent backups.  Map is scanned only
+ * once, and for every file one bitmap per distinct LSN is returned.
+ */
+PG_FUNCTION_INFO_V1(ptrack_get_pagemapset_multi);
+Datum
+ptrack_get_pagemapset_multi(PG_FUNCTION_ARGS)
+{
+	PtMultiScanCtx *ctx;
+	FuncCallContext *funcctx;
+	MemoryContext oldcontext;
+
+	/* Exit immediately if there is no map */
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		TupleDesc	tupdesc;
+		ArrayType  *lsn_array = PG_GETARG_ARRAYTYPE_P(0);
+		Datum	   *lsn_datums;
+		int			nlsns;
+		int			i;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (ARR_NDIM(lsn_array) > 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+					 errmsg("array of LSNs must be one-dimensional")));
+
+		if (array_contains_nulls(lsn_array))
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("array of LSNs must not contain nulls")));
+
+		deconstruct_array(lsn_array, LSNOID, sizeof(XLogRecPtr),
+						  FLOAT8PASSBYVAL, 'd', &lsn_datums, NULL, &nlsns);
+
+		if (nlsns == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("array of LSNs must not be empty")));
+
+		ctx = (PtMultiScanCtx *) palloc0(sizeof(PtMultiScanCtx));
+		ctx->scan.filelist = NIL;
+		ctx->lsns = (XLogRecPtr *) palloc(nlsns * sizeof(XLogRecPtr));
+
+		for (i = 0; i < nlsns; i++)
+			ctx->lsns[i] = DatumGetLSN(lsn_datums[i]);
+
+		/* Sort LSNs and remove duplicates */
+		qsort(ctx->lsns, nlsns, sizeof(XLogRecPtr), ptrack_lsn_cmp);
+		ctx->nlsns = 1;
+		for (i = 1; i < nlsns; i++)
+		{
+			if (ctx->lsns[i] != ctx->lsns[ctx->nlsns - 1])
+				ctx->lsns[ctx->nlsns++] = ctx->lsns[i];
+		}
+
+		ctx->scan.lsn = ctx->lsns[0];
+		ctx->pagemaps = (datapagemap_t *) palloc0(ctx->nlsns * sizeof(datapagemap_t));
+		ctx->pagecounts = (int64 *) palloc0(ctx->nlsns * sizeof(int64));
+		ctx->next = ctx->nlsns;
+
+		/* Make tuple descriptor */
+#if PG_VERSION_NUM >= 120000
+		tupdesc = CreateTemplateTupleDesc(4);
+#else
+		tupdesc = CreateTemplateTupleDesc(4, false);
+#endif
+		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "start_lsn", LSNOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "path", TEXTOID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "pagecount", INT8OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 4, "pagemap", BYTEAOID, -1, 0);
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		funcctx->user_fctx = ctx;
+
+		ptrack_gather_datadir(&ctx->scan.filelist);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	ctx = (PtMultiScanCtx *) funcctx->user_fctx;
+
+	while (true)
+	{
+		/* Return remaining bitmaps of the current file */
+		while (ctx->next < ctx->nlsns)
+		{
+			int			i = ctx->next++;
+			datapagemap_t *pagemap = &ctx->pagemaps[i];
+			Datum		values[4];
+			bool		nulls[4] = {false};
+			HeapTuple	htup;
+
+			if (pagemap->bitmap == NULL)
+				continue;
+
+			values[0] = LSNGetDatum(ctx->lsns[i]);
+			values[1] = CStringGetTextDatum(ctx->scan.relpath);
+			values[2] = Int64GetDatum(ctx->pagecounts[i]);
+			values[3] = PointerGetDatum(ptrack_pagemap_to_bytea(pagemap));
+
+			pfree(pagemap->bitmap);
+			pagemap->bitmap = NULL;
+			pagemap->bitmapsize = 0;
+			ctx->pagecounts[i] = 0;
+
+			htup = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+			SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(htup));
+		}
+
+		/*
+		 * Bitmaps and the path of the current file have to survive until all
+		 * of them are returned by the next calls.
+		 */
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		/* Take next file from the list */
+		if (ptrack_filelist_getnext(&ctx->scan) < 0)
+		{
+			MemoryContextSwitchTo(oldcontext);
+			SRF_RETURN_DONE(funcctx);
+		}
+
+		ptrack_scan_file_multi(ctx);
+		ctx->next = 0;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+}
+
+/*
+ * Estimate amount of changes since specified LSN without probing every block.
+ *
+ * We take a random sample of blocks of each data file, so that every file is
+ * a separate stratum, and extrapolate a share of changed blocks in the sample
+ * to the whole file.  Returned bounds correspond to the 95% confidence
+ * interval of the stratified estimate.  Since map can return false positives,
+ * this is an estimate of what ptrack_get_pagemapset() would return, not of the
+ * real amount of changes.
+ *
+ * Only blocks are sampled, the data directory is still listed and every
+ * segment is stat()'ed to know its size, so the cost is still proportional to
+ * the number of segments.
+ */
+PG_FUNCTION_INFO_V1(ptrack_estimate_change);
+Datum
+ptrack_estimate_change(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	lsn = PG_GETARG_LSN(0);
+	double		fraction = PG_GETARG_FLOAT8(1);
+	PtScanCtx	ctx;
+	TupleDesc	tupdesc;
+	Datum		values[9];
+	bool		nulls[9] = {false};
+	int64		files = 0;
+	int64		total_pages = 0;
+	int64		sampled_pages = 0;
+	int64		sampled_changed = 0;
+	double		estimate = 0;
+	double		variance = 0;
+	double		margin;
+	double		pages_low;
+	double		pages_high;
+
+	/* Exit immediately if there is no map */
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (isnan(fraction) || fraction <= 0 || fraction > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample fraction must be between 0 and 1, got %g", fraction)));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	MemSet(&ctx, 0, sizeof(ctx));
+	ctx.lsn = lsn;
+	ctx.filelist = NIL;
+
+	ptrack_gather_datadir(&ctx.filelist);
+
+	while (ptrack_filelist_getnext(&ctx) == 0)
+	{
+		BlockSamplerData bs;
+		BlockNumber segstart = ctx.bid.blocknum;
+		BlockNumber nblocks = ctx.relsize - segstart;
+		int			samplesize;
+		int			nsampled = 0;
+		int			nchanged = 0;
+		double		share;
+
+		/* Skip files shorter than one block, as ptrack_get_pagemapset does */
+		if (ctx.relsize <= segstart)
+			continue;
+
+		samplesize = (int) Min(ceil(fraction * nblocks), (double) nblocks);
+		samplesize = Max(samplesize, 1);
+
+#if PG_VERSION_NUM >= 150000
+		BlockSampler_Init(&bs, nblocks, samplesize, pg_prng_uint32(&pg_global_prng_state));
+#else
+		BlockSampler_Init(&bs, nblocks, samplesize, random());
+#endif
+
+		while (BlockSampler_HasMore(&bs))
+		{
+			ctx.bid.blocknum = segstart + BlockSampler_Next(&bs);
+
+			if (ptrack_block_changed(&ctx, lsn))
+				nchanged++;
+
+			nsampled++;
+		}
+
+		CHECK_FOR_INTERRUPTS();
+
+		files++;
+		total_pages += nblocks;
+		sampled_pages += nsampled;
+		sampled_changed += nchanged;
+		estimate += (double) nblocks * nchanged / nsampled;
+
+		/*
+		 * Variance of the stratum estimate with the finite population
+		 * correction, so that fully scanned files do not contribute any
+		 * uncertainty.  Use Laplace-smoothed share of changed blocks to avoid
+		 * zero variance for small samples, which are often all unchanged.
+		 */
+		share = (nchanged + 1.0) / (nsampled + 2.0);
+		variance += (double) nblocks * nblocks *
+			(1.0 - (double) nsampled / nblocks) *
+			share * (1.0 - share) / nsampled;
+
+		elog(DEBUG3, "ptrack: sampled %d of %u blocks of file %s, %d changed",
+			 nsampled, nblocks, ctx.relpath, nchanged);
+	}
+
+	/*
+	 * Sampled changed blocks are definitely changed and sampled unchanged
+	 * blocks are definitely not, so the bounds could be narrowed even more.
+	 */
+	margin = PTRACK_ESTIMATE_Z * sqrt(variance);
+	pages_low = Max(estimate - margin, (double) sampled_changed);
+	pages_high = Min(estimate + margin,
+					 (double) (total_pages - (sampled_pages - sampled_changed)));
+
+	values[0] = Int64GetDatum(files);
+	values[1] = Int64GetDatum(total_pages);
+	values[2] = Int64GetDatum(sampled_pages);
+	values[3] = Int64GetDatum((int64) rint(estimate));
+	values[4] = Int64GetDatum((int64) floor(pages_low));
+	values[5] = Int64GetDatum((int64) ceil(pages_high));
+	values[6] = Float8GetDatum(estimate * BLCKSZ / (1024.0 * 1024));
+	values[7] = Float8GetDatum(floor(pages_low) * BLCKSZ / (1024.0 * 1024));
+	values[8] = Float8GetDatum(ceil(pages_high) * BLCKSZ / (1024.0 * 1024));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+static int
+ptrack_profile_entry_cmp(const void *a, const void *b)
+{
+	Oid			spc_a = ((const PtScanProfileEntry *) a)->spcOid;
+	Oid			spc_b = ((const PtScanProfileEntry *) b)->spcOid;
+
+	if (spc_a < spc_b)
+		return -1;
+	if (spc_a > spc_b)
+		return 1;
+	return 0;
+}
+
+/*
+ * Run the scan of ptrack_get_pagemapset() and return its counters and time
+ * of its phases in ms for every tablespace, followed by a row of totals with
+ * NULL tablespace.  Time of listing of data files and total time of the scan
+ * are known only for the whole data directory.  Tuples are formed exactly as
+ * ptrack_get_pagemapset() does it, but not returned.
+ */
+PG_FUNCTION_INFO_V1(ptrack_profile_pagemapset);
+Datum
+ptrack_profile_pagemapset(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	PtScanCtx	ctx;
+	PtScanProfile profile;
+	PtScanProfileEntry total;
+	TupleDesc	tupdesc;
+	TupleDesc	pagemap_tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext filecxt;
+	MemoryContext oldcontext;
+	instr_time	start_time;
+	instr_time	gather_time;
+	instr_time	total_time;
+	int			i;
+	int			phase;
+
+	/* Exit immediately if there is no map */
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	MemoryContextSwitchTo(oldcontext);
+
+	MemSet(&ctx, 0, sizeof(ctx));
+	MemSet(&profile, 0, sizeof(profile));
+	profile.cxt = CurrentMemoryContext;
+	ctx.lsn = PG_GETARG_LSN(0);
+	ctx.filelist = NIL;
+	ctx.profile = &profile;
+	if (PG_GETARG_BOOL(1))
+	{
+		ctx.check_page_lsn = true;
+		ctx.readbuf = palloc((Size) PTRACK_READ_CHUNK_BLOCKS * BLCKSZ);
+	}
+
+	pagemap_tupdesc = ptrack_pagemapset_tupdesc();
+
+	INSTR_TIME_SET_CURRENT(start_time);
+	ptrack_gather_datadir(&ctx.filelist);
+	INSTR_TIME_SET_CURRENT(gather_time);
+	INSTR_TIME_SUBTRACT(gather_time, start_time);
+
+	/* Do not accumulate memory used for scanning of every file */
+	filecxt = AllocSetContextCreate(CurrentMemoryContext,
+									"ptrack profile",
+									ALLOCSET_DEFAULT_SIZES);
+	oldcontext = MemoryContextSwitchTo(filecxt);
+
+	while (true)
+	{
+		datapagemap_t pagemap;
+		int64		pagecount;
+		instr_time	tuple_start;
+		HeapTuple	htup;
+		PtScanProfileEntry *entry;
+
+		MemoryContextReset(filecxt);
+
+		if (!ptrack_pagemap_next(&ctx, &pagemap, &pagecount))
+			break;
+
+		INSTR_TIME_SET_CURRENT(tuple_start);
+		htup = ptrack_pagemapset_tuple(pagemap_tupdesc, &ctx, &pagemap, pagecount);
+		ptrack_profile_add(&ctx, PT_PROFILE_TUPLE, tuple_start);
+
+		entry = ptrack_profile_current(&ctx);
+		entry->rows++;
+		entry->changed_blocks += pagecount;
+		entry->bytes += htup->t_len;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextDelete(filecxt);
+
+	INSTR_TIME_SET_CURRENT(total_time);
+	INSTR_TIME_SUBTRACT(total_time, start_time);
+
+	/* Second probes of the last file */
+	if (profile.nentries > 0)
+		ptrack_profile_current(&ctx)->second_probes += ctx.second_probes;
+
+	if (profile.nentries > 0)
+		qsort(profile.entries, profile.nentries, sizeof(PtScanProfileEntry),
+			  ptrack_profile_entry_cmp);
+
+	MemSet(&total, 0, sizeof(total));
+
+	for (i = 0; i <= profile.nentries; i++)
+	{
+		PtScanProfileEntry *entry = i < profile.nentries ? &profile.entries[i] : &total;
+		Datum		values[17];
+		bool		nulls[17] = {false};
+
+		if (entry != &total)
+		{
+			total.files += entry->files;
+			total.segments += entry->segments;
+			total.skipped += entry->skipped;
+			total.blocks += entry->blocks;
+			total.whole_file_blocks += entry->whole_file_blocks;
+			total.second_probes += entry->second_probes;
+			total.changed_blocks += entry->changed_blocks;
+			total.rows += entry->rows;
+			total.bytes += entry->bytes;
+			for (phase = 0; phase < PT_PROFILE_NPHASES; phase++)
+				INSTR_TIME_ADD(total.time[phase], entry->time[phase]);
+		}
+
+		if (entry == &total)
+			nulls[0] = true;
+		else
+			values[0] = ObjectIdGetDatum(entry->spcOid);
+		values[1] = Int64GetDatum(entry->files);
+		values[2] = Int64GetDatum(entry->segments);
+		values[3] = Int64GetDatum(entry->skipped);
+		values[4] = Int64GetDatum(entry->blocks);
+		values[5] = Int64GetDatum(entry->whole_file_blocks);
+		values[6] = Int64GetDatum(entry->second_probes);
+		values[7] = Float8GetDatum(entry->blocks > 0 ?
+								   (double) entry->second_probes / entry->blocks : 0);
+		values[8] = Int64GetDatum(entry->changed_blocks);
+		values[9] = Int64GetDatum(entry->rows);
+		values[10] = Int64GetDatum(entry->bytes);
+		values[11] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(gather_time));
+		nulls[11] = entry != &total;
+		for (phase = 0; phase < PT_PROFILE_NPHASES; phase++)
+			values[12 + phase] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(entry->time[phase]));
+		values[16] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(total_time));
+		nulls[16] = entry != &total;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	return (Datum) 0;
+}
+
+/*
+ * Return shared ptrack counters summed up over all stripes.
+ */
+PG_FUNCTION_INFO_V1(ptrack_get_stats);
+Datum
+ptrack_get_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[9];
+	bool		nulls[9] = {false};
+	uint64		marks = 0;
+	uint64		cas_retries = 0;
+	uint64		checkpoints;
+	int			i;
+
+	/* Exit immediately if there is no map */
+	if (ptrack_map == NULL || ptrack_stats == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	for (i = 0; i < PTRACK_STATS_STRIPES; i++)
+	{
+		marks += pg_atomic_read_u64(&ptrack_stats->stripes[i].stripe.marks);
+		cas_retries += pg_atomic_read_u64(&ptrack_stats->stripes[i].stripe.cas_retries);
+	}
+
+	checkpoints = pg_atomic_read_u64(&ptrack_stats->checkpoints);
+
+	values[0] = Int64GetDatum((int64) marks);
+	values[1] = Int64GetDatum((int64) cas_retries);
+	values[2] = Int64GetDatum((int64) checkpoints);
+	values[3] = Float8GetDatum(pg_atomic_read_u64(&ptrack_stats->checkpoint_time) / 1000.0);
+	values[4] = Float8GetDatum(pg_atomic_read_u64(&ptrack_stats->last_checkpoint_time) / 1000.0);
+	values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&ptrack_stats->checkpoint_bytes));
+	values[6] = Int64GetDatum((int64) pg_atomic_read_u64(&ptrack_stats->used_slots));
+	values[7] = Int64GetDatum((int64) ptrackTotalSlots());
+	values[8] = TimestampTzGetDatum((TimestampTz) pg_atomic_read_u64(&ptrack_stats->stats_reset));
+
+	/* Last checkpoint time is meaningless if there were no checkpoints */
+	if (checkpoints == 0)
+		nulls[4] = true;
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Reset shared ptrack counters.
+ */
+PG_FUNCTION_INFO_V1(ptrack_stats_reset);
+Datum
+ptrack_stats_reset(PG_FUNCTION_ARGS)
+{
+	/* Exit immediately if there is no map */
+	if (ptrack_map == NULL || ptrack_stats == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	ptrackStatsReset();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Restore changes since start_lsn, which are not in the map, e.g. after it
+ * was reinitialized, from WAL still kept in pg_wal.  See ptrackBackfill().
+ */
+PG_FUNCTION_INFO_V1(ptrack_backfill);
+Datum
+ptrack_backfill(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 150000
+	XLogRecPtr	start_lsn = PG_GETARG_LSN(0);
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		nulls[3] = {false};
+	uint64		records;
+	uint64		blocks;
+	XLogRecPtr	init_lsn;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	init_lsn = ptrackBackfill(start_lsn, &records, &blocks);
+
+	values[0] = Int64GetDatum((int64) records);
+	values[1] = Int64GetDatum((int64) blocks);
+	values[2] = LSNGetDatum(init_lsn);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+#else
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("ptrack_backfill() requires PostgreSQL 15 or newer")));
+	PG_RETURN_NULL();
+#endif
+}
+
+/*
+ * Map size in MB needed to have the same number of changed blocks with the
+ * target false positive rate, given that fraction 'occupancy' of slots is
+ * marked in the map of 'nslots' slots.
+ *
+ * Each changed block marks two slots, so after k changed blocks a fraction
+ * q = 1 - (1 - 1/M)^2k ~ 1 - exp(-2k/M) of slots is marked.  An unchanged
+ * block is reported only if both its slots are marked, which happens with
+ * probability q^2.  Thus k = -M ln(1 - q) / 2, and to get false positive
+ * rate r with the same k we need M' = -2k / ln(1 - sqrt(r)) slots.
+ */
+static int64
+ptrack_recommended_map_size(uint64 nslots, double occupancy, double target_fpr)
+{
+	double		slots;
+	double		bytes;
+
+	slots = nslots * log(1.0 - occupancy) / log(1.0 - sqrt(target_fpr));
+	bytes = slots * sizeof(pg_atomic_uint64) +
+		offsetof(PtrackMapHdr, entries) + sizeof(pg_crc32c);
+
+	return Max((int64) ceil(bytes / (1024.0 * 1024)), 1);
+}
+
+/*
+ * Return map occupancy since specified LSN and the expected false positive
+ * rate of ptrack_get_pagemapset() with this LSN.
+ */
+PG_FUNCTION_INFO_V1(ptrack_map_occupancy);
+Datum
+ptrack_map_occupancy(PG_FUNCTION_ARGS)
+{
+	XLogRecPtr	lsn = PG_GETARG_LSN(0);
+	double		target_fpr = PG_GETARG_FLOAT8(1);
+	TupleDesc	tupdesc;
+	Datum		values[7];
+	bool		nulls[7] = {false};
+	uint64		nslots = PtrackContentNblocks;
+	uint64		used_slots = 0;
+	uint64		newer_slots = 0;
+	double		occupancy;
+	uint64		i;
+
+	/* Exit immediately if there is no map */
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (isnan(target_fpr) || target_fpr <= 0 || target_fpr >= 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("target false positive rate must be between 0 and 1, got %g", target_fpr)));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	for (i = 0; i < nslots; i++)
+	{
+		XLogRecPtr	slot_lsn = pg_atomic_read_u64(&ptrack_map->entries[i]);
+
+		if (slot_lsn != InvalidXLogRecPtr)
+			used_slots++;
+		if (slot_lsn >= lsn)
+			newer_slots++;
+
+		if ((i & 0xFFFF) == 0)
+			CHECK_FOR_INTERRUPTS();
+	}
+
+	occupancy = (double) newer_slots / nslots;
+
+	values[0] = Int64GetDatum((int64) nslots);
+	values[1] = Int64GetDatum((int64) used_slots);
+	values[2] = Int64GetDatum((int64) newer_slots);
+	values[3] = Float8GetDatum(occupancy);
+	values[4] = Float8GetDatum(occupancy * occupancy);
+
+	/* Number of changes cannot be estimated if the map is saturated */
+	if (newer_slots < nslots)
+	{
+		values[5] = Int64GetDatum((int64) rint(-(double) nslots * log(1.0 - occupancy) / 2));
+		values[6] = Int64GetDatum(ptrack_recommended_map_size(nslots, occupancy, target_fpr));
+	}
+	else
+	{
+		nulls[5] = true;
+		nulls[6] = true;
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+typedef struct PtHistogramCtx
+{
+	XLogRecPtr	lo;
+	uint64		width;
+	int			nbuckets;
+	int			next;
+	uint64		nslots;
+	uint64		newer_slots;	/* slots in the current and newer buckets */
+	uint64	   *counts;
+}			PtHistogramCtx;
+
+/*
+ * Return histogram of LSNs stored in used map slots.  Buckets are of equal
+ * width and span LSNs from the map initialization up to the current one.
+ * For every bucket the map occupancy and false positive rate for a backup
+ * starting at the bucket lower bound are returned as well.  No buckets are
+ * returned if the map is not initialized yet.
+ */
+PG_FUNCTION_INFO_V1(ptrack_map_histogram);
+Datum
+ptrack_map_histogram(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	PtHistogramCtx *ctx;
+	Datum		values[5];
+	bool		nulls[5] = {false};
+	XLogRecPtr	lsn_from;
+	double		occupancy;
+
+	/* Exit immediately if there is no map */
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		TupleDesc	tupdesc;
+		int			nbuckets = PG_GETARG_INT32(0);
+		XLogRecPtr	hi;
+		uint64		i;
+
+		if (nbuckets < 1 || nbuckets > 1000)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("number of buckets must be between 1 and 1000, got %d", nbuckets)));
+
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		ctx = (PtHistogramCtx *) palloc0(sizeof(PtHistogramCtx));
+		ctx->nbuckets = nbuckets;
+		ctx->nslots = PtrackContentNblocks;
+		ctx->counts = (uint64 *) palloc0(sizeof(uint64) * nbuckets);
+
+		/*
+		 * Do not use ptrack_set_init_lsn() for the upper bound, since reporting
+		 * should not move the validity point of the map.
+		 */
+		if (RecoveryInProgress())
+			hi = GetXLogReplayRecPtr(NULL);
+		else
+			hi = GetXLogInsertRecPtr();
+		ctx->lo = pg_atomic_read_u64(&ptrack_map->init_lsn);
+		if (ctx->lo > hi)
+			ctx->lo = hi;
+		ctx->width = (hi - ctx->lo) / nbuckets + 1;
+
+		/* Map does not cover any changes yet */
+		if (XLogRecPtrIsInvalid(ctx->lo))
+			ctx->nbuckets = 0;
+
+		for (i = 0; ctx->nbuckets > 0 && i < ctx->nslots; i++)
+		{
+			XLogRecPtr	slot_lsn = pg_atomic_read_u64(&ptrack_map->entries[i]);
+			uint64		bucket;
+
+			if (slot_lsn == InvalidXLogRecPtr)
+				continue;
+
+			/* Slots may be marked concurrently beyond the upper bound */
+			bucket = slot_lsn > ctx->lo ? (slot_lsn - ctx->lo) / ctx->width : 0;
+			ctx->counts[Min(bucket, (uint64) nbuckets - 1)]++;
+			ctx->newer_slots++;
+
+			if ((i & 0xFFFF) == 0)
+				CHECK_FOR_INTERRUPTS();
+		}
+
+		funcctx->user_fctx = ctx;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	ctx = (PtHistogramCtx *) funcctx->user_fctx;
+
+	if (ctx->next >= ctx->nbuckets)
+		SRF_RETURN_DONE(funcctx);
+
+	lsn_from = ctx->lo + ctx->width * ctx->next;
+	occupancy = (double) ctx->newer_slots / ctx->nslots;
+
+	values[0] = LSNGetDatum(lsn_from);
+	values[1] = LSNGetDatum(lsn_from + ctx->width);
+	values[2] = Int64GetDatum((int64) ctx->counts[ctx->next]);
+	values[3] = Float8GetDatum(occupancy);
+	values[4] = Float8GetDatum(occupancy * occupancy);
+
+	ctx->newer_slots -= ctx->counts[ctx->next];
+	ctx->next++;
+
+	SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+}
+
+/*
+ * Result of comparison of the map with LSNs of pages of a single file.
+ */
+typedef struct PtVerifyCounts
+{
+	int64		pages;			/* blocks read */
+	int64		true_positives; /* reported by map, pd_lsn >= start_lsn */
+	int64		false_positives;	/* reported by map, pd_lsn < start_lsn */
+	int64		suspicious;		/* reported by map, page is new or has no
+								 * LSN, so we are not able to check it */
+	int64		missed;			/* not reported by map, pd_lsn >= start_lsn */
+}			PtVerifyCounts;
+
+typedef struct PtVerifyCtx
+{
+	PtScanCtx	scan;
+	char	   *buf;			/* PTRACK_READ_CHUNK_BLOCKS blocks */
+}			PtVerifyCtx;
+
+/*
+ * Read the current file of the scan context sequentially in big chunks and
+ * check every block against the map.  Returns false if the file has gone.
+ */
+static bool
+ptrack_verify_file(PtVerifyCtx * ctx, PtVerifyCounts * counts)
+{
+	PtScanCtx  *scan = &ctx->scan;
+	char	   *fullpath;
+	int			fd;
+
+	fullpath = psprintf("%s/%s", DataDir, scan->relpath);
+
+	fd = OpenTransientFile(fullpath, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		/* Relation may be dropped concurrently */
+		if (errno == ENOENT)
+		{
+			pfree(fullpath);
+			return false;
+		}
+
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not open file \"%s\": %m", fullpath)));
+	}
+
+#if defined(USE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	while (scan->bid.blocknum < scan->relsize)
+	{
+		BlockNumber nblocks;
+		BlockNumber i;
+		ssize_t		nread;
+
+		CHECK_FOR_INTERRUPTS();
+
+		nblocks = Min(scan->relsize - scan->bid.blocknum, PTRACK_READ_CHUNK_BLOCKS);
+		nread = read(fd, ctx->buf, (size_t) nblocks * BLCKSZ);
+		if (nread < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("ptrack: could not read file \"%s\": %m", fullpath)));
+
+		/* File may be truncated concurrently, so use what we have got */
+		nblocks = nread / BLCKSZ;
+		if (nblocks == 0)
+			break;
+
+		for (i = 0; i < nblocks; i++, scan->bid.blocknum++)
+		{
+			Page		page = (Page) (ctx->buf + (size_t) i * BLCKSZ);
+			bool		changed = ptrack_block_changed(scan, scan->lsn);
+			XLogRecPtr	page_lsn = PageIsNew(page) ? InvalidXLogRecPtr : PageGetLSN(page);
+
+			counts->pages++;
+
+			if (page_lsn == InvalidXLogRecPtr)
+			{
+				if (changed)
+					counts->suspicious++;
+			}
+			else if (page_lsn >= scan->lsn)
+			{
+				if (changed)
+					counts->true_positives++;
+				else
+				{
+					counts->missed++;
+					ereport(WARNING,
+							(errmsg("ptrack: block %u of file \"%s\" with LSN %X/%X is not marked in ptrack map",
+									scan->bid.blocknum % ((BlockNumber) RELSEG_SIZE), scan->relpath,
+									(uint32) (page_lsn >> 32), (uint32) page_lsn)));
+				}
+			}
+			else if (changed)
+				counts->false_positives++;
+		}
+	}
+
+	if (CloseTransientFile(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not close file \"%s\": %m", fullpath)));
+
+	pfree(fullpath);
+
+	return true;
+}
+
+/*
+ * Compare blocks reported by ptrack_get_pagemapset() with LSNs stored in
+ * their headers.  Returns a row per data file with any blocks reported by
+ * the map or changed since specified LSN according to their pd_lsn.
+ */
+PG_FUNCTION_INFO_V1(ptrack_verify_pagemap);
+Datum
+ptrack_verify_pagemap(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	PtVerifyCtx *ctx;
+	MemoryContext oldcontext;
+
+	/* Exit immediately if there is no map */
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		TupleDesc	tupdesc;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		ctx = (PtVerifyCtx *) palloc0(sizeof(PtVerifyCtx));
+		ctx->scan.lsn = PG_GETARG_LSN(0);
+		ctx->scan.filelist = NIL;
+		ctx->buf = palloc((Size) PTRACK_READ_CHUNK_BLOCKS * BLCKSZ);
+
+		ptrack_gather_datadir(&ctx->scan.filelist);
+
+		funcctx->user_fctx = ctx;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	ctx = (PtVerifyCtx *) funcctx->user_fctx;
+
+	while (ptrack_filelist_getnext(&ctx->scan) == 0)
+	{
+		PtVerifyCounts counts;
+		Datum		values[6];
+		bool		nulls[6] = {false};
+
+		MemSet(&counts, 0, sizeof(counts));
+
+		if (!ptrack_verify_file(ctx, &counts))
+			continue;
+
+		if (counts.true_positives + counts.false_positives +
+			counts.suspicious + counts.missed == 0)
+			continue;
+
+		values[0] = CStringGetTextDatum(ctx->scan.relpath);
+		values[1] = Int64GetDatum(counts.pages);
+		values[2] = Int64GetDatum(counts.true_positives);
+		values[3] = Int64GetDatum(counts.false_positives);
+		values[4] = Int64GetDatum(counts.suspicious);
+		values[5] = Int64GetDatum(counts.missed);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Context for ptrack_get_changed_pages() set returning function.
+ */
+typedef struct PtStreamCtx
+{
+	PtScanCtx	scan;
+	int			batch_pages;	/* max number of pages in a single row */
+	char	   *relpath;		/* path of the current file */
+	BlockNumber *blocks;		/* changed blocks of the current file */
+	int			nblocks;
+	int			next;			/* next block to return */
+}			PtStreamCtx;
+
+/*
+ * Read the next batch of changed blocks of the current file.  Every block is
+ * put into the result as its number within segment (uint32 in network byte
+ * order) followed by BLCKSZ bytes of the page.  Returns NULL if the file has
+ * gone, otherwise number of blocks put into the result is returned via
+ * npages.
+ */
+static bytea *
+ptrack_read_changed_pages(PtStreamCtx * ctx, int *npages)
+{
+	bytea	   *result;
+	char	   *out;
+	char	   *fullpath;
+	int			fd;
+	int			end = Min(ctx->next + ctx->batch_pages, ctx->nblocks);
+	int			first;
+
+	fullpath = psprintf("%s/%s", DataDir, ctx->relpath);
+
+	fd = OpenTransientFile(fullpath, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		/* Relation may be dropped concurrently */
+		if (errno == ENOENT)
+		{
+			pfree(fullpath);
+			return NULL;
+		}
+
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not open file \"%s\": %m", fullpath)));
+	}
+
+#if defined(USE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	/* Ask kernel to prefetch all changed blocks of the file at once */
+	if (ctx->next == 0)
+	{
+		for (first = 0; first < ctx->nblocks;
+			 first = ptrack_next_run(ctx->blocks, ctx->nblocks, first))
+		{
+			int			last = ptrack_next_run(ctx->blocks, ctx->nblocks, first) - 1;
+
+			(void) posix_fadvise(fd, (off_t) ctx->blocks[first] * BLCKSZ,
+								 (off_t) (ctx->blocks[last] - ctx->blocks[first] + 1) * BLCKSZ,
+								 POSIX_FADV_WILLNEED);
+		}
+	}
+#endif
+
+	result = (bytea *) palloc(VARHDRSZ + (Size) (end - ctx->next) * (sizeof(uint32) + BLCKSZ));
+	out = VARDATA(result);
+	*npages = 0;
+
+	for (first = ctx->next; first < end;)
+	{
+		int			next = ptrack_next_run(ctx->blocks, end, first);
+		BlockNumber start = ctx->blocks[first];
+		size_t		nbytes = (size_t) (ctx->blocks[next - 1] - start + 1) * BLCKSZ;
+		ssize_t		nread;
+		int			i;
+
+		CHECK_FOR_INTERRUPTS();
+
+		nread = ptrack_pread(fd, ctx->scan.readbuf, nbytes, (off_t) start * BLCKSZ);
+		if (nread < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("ptrack: could not read file \"%s\": %m", fullpath)));
+
+		for (i = first; i < next; i++)
+		{
+			size_t		offset = (size_t) (ctx->blocks[i] - start) * BLCKSZ;
+			uint32		blkno = pg_hton32(ctx->blocks[i]);
+
+			/* File may be truncated concurrently, skip blocks we do not have */
+			if (offset + BLCKSZ > (size_t) nread)
+				break;
+
+			memcpy(out, &blkno, sizeof(blkno));
+			out += sizeof(blkno);
+			memcpy(out, ctx->scan.readbuf + offset, BLCKSZ);
+			out += BLCKSZ;
+			(*npages)++;
+		}
+
+		first = next;
+	}
+
+	ctx->next = end;
+
+	if (CloseTransientFile(fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not close file \"%s\": %m", fullpath)));
+
+	pfree(fullpath);
+
+	SET_VARSIZE(result, out - (char *) result);
+
+	return result;
+}
+
+/*
+ * Return content of blocks changed since specified LSN.  Changed blocks of
+ * every file are read in ascending order coalescing close blocks into single
+ * reads and returned in batches of up to batch_pages blocks.  Pages are read
+ * without any locks, so they may be torn exactly like when the backup tool
+ * reads them from files itself.
+ */
+PG_FUNCTION_INFO_V1(ptrack_get_changed_pages);
+Datum
+ptrack_get_changed_pages(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	PtStreamCtx *ctx;
+	MemoryContext oldcontext;
+
+	/* Exit immediately if there is no map */
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		TupleDesc	tupdesc;
+		int			batch_pages = PG_GETARG_INT32(2);
+
+		/* Keep result below MaxAllocSize */
+		if (batch_pages < 1 || batch_pages > 8192)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("batch size must be between 1 and 8192 pages, got %d", batch_pages)));
+
+		funcctx = SRF_FIRSTCALL_INIT();
+
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		ctx = (PtStreamCtx *) palloc0(sizeof(PtStreamCtx));
+		ctx->scan.lsn = PG_GETARG_LSN(0);
+		ctx->scan.filelist = NIL;
+		ctx->scan.check_page_lsn = PG_GETARG_BOOL(1);
+		ctx->scan.readbuf = palloc((Size) PTRACK_READ_CHUNK_BLOCKS * BLCKSZ);
+		ctx->batch_pages = batch_pages;
+
+		ptrack_gather_datadir(&ctx->scan.filelist);
+
+		funcctx->user_fctx = ctx;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	ctx = (PtStreamCtx *) funcctx->user_fctx;
+
+	while (true)
+	{
+		Datum		values[3];
+		bool		nulls[3] = {false};
+		bytea	   *pages;
+		int			npages;
+
+		/* Take the next changed file */
+		if (ctx->next >= ctx->nblocks)
+		{
+			datapagemap_t pagemap;
+			int64		pagecount;
+			datapagemap_iterator_t *iter;
+			BlockNumber blkno;
+
+			if (!ptrack_pagemap_next(&ctx->scan, &pagemap, &pagecount))
+				break;
+
+			if (ctx->blocks != NULL)
+			{
+				pfree(ctx->blocks);
+				pfree(ctx->relpath);
+			}
+
+			ctx->relpath = MemoryContextStrdup(funcctx->multi_call_memory_ctx,
+											   ctx->scan.relpath);
+			ctx->blocks = (BlockNumber *) MemoryContextAlloc(funcctx->multi_call_memory_ctx,
+															 sizeof(BlockNumber) * pagecount);
+			ctx->nblocks = 0;
+			ctx->next = 0;
+
+			iter = datapagemap_iterate(&pagemap);
+			while (datapagemap_next(iter, &blkno))
+				ctx->blocks[ctx->nblocks++] = blkno;
+			pfree(iter);
+			pfree(pagemap.bitmap);
+		}
+
+		pages = ptrack_read_changed_pages(ctx, &npages);
+
+		if (pages == NULL)
+		{
+			/* Skip the rest of the gone file */
+			ctx->next = ctx->nblocks;
+			continue;
+		}
+
+		if (npages == 0)
+			continue;
+
+		values[0] = CStringGetTextDatum(ctx->relpath);
+		values[1] = Int32GetDatum(npages);
+		values[2] = PointerGetDatum(pages);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+typedef struct PtExportFile
+{
+	int			fd;
+	char	   *path;
+	pg_crc32c	crc;
+	size_t		len;			/* bytes in buf */
+	size_t		pos;			/* next byte of buf to read */
+	uint64		total;			/* bytes written or read so far */
+	char		buf[PTRACK_EXPORT_BUF_SIZE];
+}			PtExportFile;
+
+/*
+ * Write out buffered data of the export file.
+ */
+static void
+ptrack_export_flush(PtExportFile * f)
+{
+	if (f->len == 0)
+		return;
+
+	errno = 0;
+	if (write(f->fd, f->buf, f->len) != f->len)
+	{
+		/* If write didn't set errno, assume problem is no disk space */
+		if (errno == 0)
+			errno = ENOSPC;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not write file \"%s\": %m", f->path)));
+	}
+
+	f->total += f->len;
+	f->len = 0;
+}
+
+/*
+ * Append data to the export file through its buffer.
+ */
+static void
+ptrack_export_write(PtExportFile * f, const void *data, size_t size)
+{
+	const char *ptr = (const char *) data;
+
+	COMP_CRC32C(f->crc, data, size);
+
+	while (size > 0)
+	{
+		size_t		n = Min(size, sizeof(f->buf) - f->len);
+
+		memcpy(f->buf + f->len, ptr, n);
+		f->len += n;
+		ptr += n;
+		size -= n;
+
+		if (f->len == sizeof(f->buf))
+			ptrack_export_flush(f);
+	}
+}
+
+/*
+ * Read exactly size bytes from the export file through its buffer.
+ */
+static void
+ptrack_export_read(PtExportFile * f, void *data, size_t size, bool update_crc)
+{
+	char	   *ptr = (char *) data;
+	size_t		left = size;
+
+	while (left > 0)
+	{
+		size_t		n;
+
+		if (f->pos == f->len)
+		{
+			ssize_t		nread = read(f->fd, f->buf, sizeof(f->buf));
+
+			if (nread < 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("ptrack: could not read file \"%s\": %m", f->path)));
+			if (nread == 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("ptrack: unexpected end of file \"%s\"", f->path)));
+
+			f->len = nread;
+			f->pos = 0;
+		}
+
+		n = Min(left, f->len - f->pos);
+		memcpy(ptr, f->buf + f->pos, n);
+		f->pos += n;
+		ptr += n;
+		left -= n;
+	}
+
+	if (update_crc)
+		COMP_CRC32C(f->crc, data, size);
+	f->total += size;
+}
+
+/*
+ * Write a set of changed data files with bitmaps of their changed blocks into
+ * a binary file (see ptrack_export.h for the format).  File is written under
+ * a temporary name and renamed only once it is complete, the temporary file
+ * is removed on error.
+ */
+PG_FUNCTION_INFO_V1(ptrack_export_pagemapset);
+Datum
+ptrack_export_pagemapset(PG_FUNCTION_ARGS)
+{
+	char	   *target_path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char	   *tmp_path;
+	PtExportFile *f;
+	PtScanCtx	ctx;
+	PtrackExportHdr hdr;
+	PtrackExportFileHdr fhdr;
+	MemoryContext filecxt;
+	MemoryContext oldcontext;
+	TupleDesc	tupdesc;
+	Datum		values[3];
+	bool		nulls[3] = {false};
+	uint32		files = 0;
+	int64		pages = 0;
+	pg_crc32c	crc;
+	int			ret;
+
+	/* Exit immediately if there is no map */
+	if (ptrack_map == NULL)
+		elog(ERROR, "ptrack is disabled");
+
+	/* The same rules as for COPY TO file */
+	if (!has_privs_of_role(GetUserId(), ROLE_PG_WRITE_SERVER_FILES))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied to export ptrack pagemapset"),
+				 errhint("Only roles with privileges of the \"%s\" role may write files on the server.",
+						 "pg_write_server_files")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	MemSet(&ctx, 0, sizeof(ctx));
+	ctx.lsn = PG_GETARG_LSN(0);
+	ctx.filelist = NIL;
+	if (PG_GETARG_BOOL(2))
+	{
+		ctx.check_page_lsn = true;
+		ctx.readbuf = palloc((Size) PTRACK_READ_CHUNK_BLOCKS * BLCKSZ);
+	}
+
+	f = (PtExportFile *) palloc0(sizeof(PtExportFile));
+	f->path = tmp_path = psprintf("%s.tmp", target_path);
+	INIT_CRC32C(f->crc);
+
+	f->fd = OpenTransientFile(tmp_path, O_CREAT | O_TRUNC | O_WRONLY | PG_BINARY);
+	if (f->fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not create file \"%s\": %m", tmp_path)));
+
+	/* Do not leave a partial file behind on error */
+	PG_TRY();
+	{
+		memcpy(hdr.magic, PTRACK_EXPORT_MAGIC, PTRACK_EXPORT_MAGIC_SIZE);
+		hdr.version = pg_hton32(PTRACK_EXPORT_VERSION);
+		hdr.blcksz = pg_hton32(BLCKSZ);
+		hdr.relseg_size = pg_hton32(RELSEG_SIZE);
+		hdr.start_lsn = pg_hton64(ctx.lsn);
+		hdr.init_lsn = pg_hton64(pg_atomic_read_u64(&ptrack_map->init_lsn));
+		ptrack_export_write(f, &hdr, sizeof(hdr));
+
+		ptrack_gather_datadir(&ctx.filelist);
+
+		/* Do not accumulate memory used for scanning of every file */
+		filecxt = AllocSetContextCreate(CurrentMemoryContext,
+										"ptrack export",
+										ALLOCSET_DEFAULT_SIZES);
+		oldcontext = MemoryContextSwitchTo(filecxt);
+
+		while (true)
+		{
+			datapagemap_t pagemap;
+			int64		pagecount;
+			size_t		pathlen;
+
+			MemoryContextReset(filecxt);
+
+			if (!ptrack_pagemap_next(&ctx, &pagemap, &pagecount))
+				break;
+
+			pathlen = strlen(ctx.relpath);
+			fhdr.pathlen = pg_hton32((uint32) pathlen);
+			fhdr.pagecount = pg_hton32((uint32) pagecount);
+			fhdr.bitmapsize = pg_hton32((uint32) pagemap.bitmapsize);
+
+			ptrack_export_write(f, &fhdr, sizeof(fhdr));
+			ptrack_export_write(f, ctx.relpath, pathlen);
+			ptrack_export_write(f, pagemap.bitmap, pagemap.bitmapsize);
+
+			files++;
+			pages += pagecount;
+		}
+
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextDelete(filecxt);
+
+		/* Terminating record contains number of files */
+		fhdr.pathlen = 0;
+		fhdr.pagecount = pg_hton32(files);
+		fhdr.bitmapsize = 0;
+		ptrack_export_write(f, &fhdr, sizeof(fhdr));
+
+		FIN_CRC32C(f->crc);
+		crc = pg_hton32(f->crc);
+		ptrack_export_write(f, &crc, sizeof(crc));
+		ptrack_export_flush(f);
+
+		if (pg_fsync(f->fd) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("ptrack: could not fsync file \"%s\": %m", tmp_path)));
+
+		ret = CloseTransientFile(f->fd);
+		f->fd = -1;
+		if (ret != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("ptrack: could not close file \"%s\": %m", tmp_path)));
+
+		durable_rename(tmp_path, target_path, ERROR);
+	}
+	PG_CATCH();
+	{
+		if (f->fd >= 0)
+			CloseTransientFile(f->fd);
+		unlink(tmp_path);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	values[0] = Int64GetDatum((int64) files);
+	values[1] = Int64GetDatum(pages);
+	values[2] = Int64GetDatum((int64) f->total);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * Read a file written by ptrack_export_pagemapset().  The whole file is
+ * checked against its CRC before any rows are returned, so rows are
+ * materialized in a tuplestore.
+ */
+PG_FUNCTION_INFO_V1(ptrack_read_pagemapset);
+Datum
+ptrack_read_pagemapset(PG_FUNCTION_ARGS)
+{
+	char	   *source_path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	PtExportFile *f;
+	PtrackExportHdr hdr;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	uint32		files = 0;
+	pg_crc32c	crc;
+
+	/* The same rules as for pg_read_binary_file() */
+	if (!has_privs_of_role(GetUserId(), ROLE_PG_READ_SERVER_FILES))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied to read ptrack pagemapset"),
+				 errhint("Only roles with privileges of the \"%s\" role may read files on the server.",
+						 "pg_read_server_files")));
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	MemoryContextSwitchTo(oldcontext);
+
+	f = (PtExportFile *) palloc0(sizeof(PtExportFile));
+	f->path = source_path;
+	INIT_CRC32C(f->crc);
+
+	f->fd = OpenTransientFile(source_path, O_RDONLY | PG_BINARY);
+	if (f->fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not open file \"%s\": %m", source_path)));
+
+	ptrack_export_read(f, &hdr, sizeof(hdr), true);
+
+	if (memcmp(hdr.magic, PTRACK_EXPORT_MAGIC, PTRACK_EXPORT_MAGIC_SIZE) != 0 ||
+		pg_ntoh32(hdr.version) != PTRACK_EXPORT_VERSION)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("ptrack: file \"%s\" is not a ptrack pagemapset of version %d",
+						source_path, PTRACK_EXPORT_VERSION)));
+
+	if (pg_ntoh32(hdr.blcksz) != BLCKSZ || pg_ntoh32(hdr.relseg_size) != RELSEG_SIZE)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("ptrack: file \"%s\" is written by incompatible server", source_path),
+				 errdetail("File was written with BLCKSZ %u and RELSEG_SIZE %u, but the server was compiled with BLCKSZ %d and RELSEG_SIZE %d.",
+						   pg_ntoh32(hdr.blcksz), pg_ntoh32(hdr.relseg_size),
+						   BLCKSZ, RELSEG_SIZE)));
+
+	while (true)
+	{
+		PtrackExportFileHdr fhdr;
+		uint32		pathlen;
+		uint32		bitmapsize;
+		char		path[MAXPGPATH];
+		bytea	   *pagemap;
+		Datum		values[3];
+		bool		nulls[3] = {false};
+
+		CHECK_FOR_INTERRUPTS();
+
+		ptrack_export_read(f, &fhdr, sizeof(fhdr), true);
+		pathlen = pg_ntoh32(fhdr.pathlen);
+		bitmapsize = pg_ntoh32(fhdr.bitmapsize);
+
+		/* Terminating record */
+		if (pathlen == 0)
+		{
+			if (pg_ntoh32(fhdr.pagecount) != files)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("ptrack: file \"%s\" contains %u files instead of %u",
+								source_path, files, pg_ntoh32(fhdr.pagecount))));
+			break;
+		}
+
+		if (pathlen >= MAXPGPATH || bitmapsize > RELSEG_SIZE / 8 + 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("ptrack: invalid record of file %u in \"%s\"", files, source_path)));
+
+		ptrack_export_read(f, path, pathlen, true);
+		path[pathlen] = '\0';
+
+		pagemap = (bytea *) palloc(VARHDRSZ + bitmapsize);
+		SET_VARSIZE(pagemap, VARHDRSZ + bitmapsize);
+		ptrack_export_read(f, VARDATA(pagemap), bitmapsize, true);
+
+		values[0] = CStringGetTextDatum(path);
+		values[1] = Int64GetDatum((int64) pg_ntoh32(fhdr.pagecount));
+		values[2] = PointerGetDatum(pagemap);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+		pfree(DatumGetPointer(values[0]));
+		pfree(pagemap);
+		files++;
+	}
+
+	FIN_CRC32C(f->crc);
+	ptrack_export_read(f, &crc, sizeof(crc), false);
+
+	if (!EQ_CRC32C(f->crc, pg_ntoh32(crc)))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("ptrack: incorrect checksum of file \"%s\"", source_path)));
+
+	if (CloseTransientFile(f->fd) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("ptrack: could not close file \"%s\": %m", source_path)));
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	return (Datum) 0;
+}
@@ -26,12 +26,13 @@
 #include "storage/smgr.h"
 #include "utils/relcache.h"
 
+#include "datapagemap.h"
+#include "ptrack_map.h"
+
 /* Ptrack version as a string */
-#define PTRACK_VERSION "2.4"
+#define PTRACK_VERSION "2.5"
 /* Ptrack version as a number */
-#define PTRACK_VERSION_NUM 240
-/* Last ptrack version that changed map file format */
-#define PTRACK_MAP_FILE_VERSION_NUM 220
+#define PTRACK_VERSION_NUM 250
 
 #if PG_VERSION_NUM >= 160000
 #define RelFileNode			RelFileLocator
@@ -51,6 +52,11 @@
 #define InvalidBackendId	INVALID_PROC_NUMBER
 #endif
 
+#if PG_VERSION_NUM < 140000
+#define ROLE_PG_READ_SERVER_FILES	DEFAULT_ROLE_READ_SERVER_FILES
+#define ROLE_PG_WRITE_SERVER_FILES	DEFAULT_ROLE_WRITE_SERVER_FILES
+#endif
+
 /*
  * Structure identifying block on the disk.
  */
@@ -71,8 +77,27 @@ typedef struct PtScanCtx
 	uint32		relsize;
 	char	   *relpath;
 	List	   *filelist;
+	bool		check_page_lsn; /* drop blocks with older pd_lsn */
+	char	   *readbuf;		/* buffer for reading blocks */
+	struct PtrackPartition *part;	/* map partition of the current file */
+	XLogRecPtr	file_lsn;		/* whole file change LSN of the current file */
+	int64		second_probes;	/* probes of the second slots */
+	struct PtScanProfile *profile;	/* counters of ptrack_profile_pagemapset() */
 }			PtScanCtx;
 
+/*
+ * Context for ptrack_get_pagemapset_multi set returning function.
+ */
+typedef struct PtMultiScanCtx
+{
+	PtScanCtx	scan;
+	int			nlsns;
+	XLogRecPtr *lsns;			/* distinct LSNs in ascending order */
+	datapagemap_t *pagemaps;	/* bitmaps of the current file, one per LSN */
+	int64	   *pagecounts;
+	int			next;			/* next LSN to return bitmap for */
+}			PtMultiScanCtx;
+
 /*
  * List item type for ptrack data files list.
  */
@@ -85,4 +110,6 @@ typedef struct PtrackFileList_i
 
 }			PtrackFileList_i;
 
+extern bool ptrack_block_changed(PtScanCtx * ctx, XLogRecPtr lsn);
+
 #endif							/* PTRACK_H */
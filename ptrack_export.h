@@ -0,0 +1,55 @@
+/*-------------------------------------------------------------------------
+ *
+ * ptrack_export.h
+ *	  format of the pagemapset file written by ptrack_export_pagemapset()
+ *
+ * This header is used by both backend and frontend code, so it should not
+ * include anything except c.h definitions.
+ *
+ * Copyright (c) 2019-2022, Postgres Professional
+ *
+ * ptrack/ptrack_export.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PTRACK_EXPORT_H
+#define PTRACK_EXPORT_H
+
+/*
+ * The file consists of:
+ *
+ * - PtrackExportHdr;
+ * - PtrackExportFileHdr of every changed data file followed by its path
+ *   (pathlen bytes, not terminated with \0) and its bitmap (bitmapsize bytes,
+ *   the same as pagemap returned by ptrack_get_pagemapset());
+ * - terminating PtrackExportFileHdr with zero pathlen and bitmapsize, and
+ *   total number of files in pagecount;
+ * - CRC32C of all the above.
+ *
+ * All integers are stored in network byte order.
+ */
+#define PTRACK_EXPORT_MAGIC "ptke"
+#define PTRACK_EXPORT_MAGIC_SIZE 4
+#define PTRACK_EXPORT_VERSION 1
+
+/* Size of the buffer used for reading and writing of the file */
+#define PTRACK_EXPORT_BUF_SIZE (64 * 1024)
+
+typedef struct PtrackExportHdr
+{
+	char		magic[PTRACK_EXPORT_MAGIC_SIZE];
+	uint32		version;
+	uint32		blcksz;			/* BLCKSZ of the cluster */
+	uint32		relseg_size;	/* RELSEG_SIZE of the cluster */
+	uint64		start_lsn;		/* LSN the bitmaps are built for */
+	uint64		init_lsn;		/* ptrack_init_lsn() at the time of export */
+}			PtrackExportHdr;
+
+typedef struct PtrackExportFileHdr
+{
+	uint32		pathlen;
+	uint32		pagecount;
+	uint32		bitmapsize;
+}			PtrackExportFileHdr;
+
+#endif							/* PTRACK_EXPORT_H */
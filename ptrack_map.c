@@ -0,0 +1,283 @@
+/*
+ * ptrack_map.c
+ *		Encoding of ptrack map file chunks
+ *
+ * Copyright (c) 2019-2022, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/ptrack_map.c
+ *
+ * INTERFACE ROUTINES
+ *	  ptrack_chunk_crc()    --- compute CRC of the map file chunk
+ *	  ptrack_chunk_encode() --- encode slots of the chunk for writing to file
+ *	  ptrack_chunk_decode() --- decode slots of the chunk read from file
+ *	  ptrack_policy_format() --- format tracking policy for writing to file
+ *	  ptrack_policy_parse()  --- parse tracking policy read from file
+ *
+ * This file is compiled into both the extension and frontend tools, see
+ * ptrack_map.h for the description of the map and policy file formats.
+ */
+
+#ifndef FRONTEND
+#include "postgres.h"
+#else
+#include "postgres_fe.h"
+#endif
+
+#include "port/pg_crc32c.h"
+
+#include "ptrack_map.h"
+
+/* Maximal length of a varint holding uint64 */
+#define PTRACK_VARINT_MAXLEN 10
+
+/*
+ * Append 'value' to 'dst' as a varint (7 bits per byte, lowest first, high
+ * bit is set in all bytes except the last one).  Returns the number of bytes
+ * written or 0 if there is not enough space before 'end'.
+ */
+static inline size_t
+ptrack_varint_put(char *dst, const char *end, uint64 value)
+{
+	size_t		len = 0;
+
+	do
+	{
+		uint8		byte = value & 0x7F;
+
+		value >>= 7;
+		if (value != 0)
+			byte |= 0x80;
+
+		if (dst + len >= end)
+			return 0;
+		dst[len++] = (char) byte;
+	} while (value != 0);
+
+	return len;
+}
+
+/*
+ * Read a varint from 'src' into 'value'.  Returns the number of bytes read
+ * or 0 if the varint is truncated or too long.
+ */
+static inline size_t
+ptrack_varint_get(const char *src, const char *end, uint64 *value)
+{
+	size_t		len = 0;
+	int			shift = 0;
+
+	*value = 0;
+	while (src + len < end && len < PTRACK_VARINT_MAXLEN)
+	{
+		uint8		byte = (uint8) src[len++];
+
+		*value |= (uint64) (byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0)
+			return len;
+		shift += 7;
+	}
+
+	return 0;
+}
+
+/*
+ * CRC32C of the map file chunk.  Generation and chunk number are included,
+ * so that a stale chunk or a chunk written at a wrong place is detected as
+ * well.
+ */
+pg_crc32c
+ptrack_chunk_crc(uint64 generation, uint64 chunkno, const char *data, size_t size)
+{
+	pg_crc32c	crc;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, (const char *) &generation, sizeof(generation));
+	COMP_CRC32C(crc, (const char *) &chunkno, sizeof(chunkno));
+	COMP_CRC32C(crc, data, size);
+	FIN_CRC32C(crc);
+
+	return crc;
+}
+
+/*
+ * Encode 'nslots' slots of the chunk into 'dst', which must have space for
+ * nslots * sizeof(uint64) bytes.  Sparse encoding is used if it is smaller
+ * than raw slots, which is true for all but almost full maps.  Returns the
+ * size of encoded data and sets 'encoding'.
+ */
+uint32
+ptrack_chunk_encode(const uint64 *slots, size_t nslots, char *dst,
+					uint32 *encoding)
+{
+	const char *end = dst + nslots * sizeof(uint64);
+	char	   *ptr = dst;
+	uint64		base = PG_UINT64_MAX;
+	size_t		len;
+	size_t		i;
+
+	for (i = 0; i < nslots; i++)
+		if (slots[i] != 0 && slots[i] < base)
+			base = slots[i];
+
+	/* Base LSN, 0 for the chunk without used slots */
+	if (base == PG_UINT64_MAX)
+		base = 0;
+	if ((len = ptrack_varint_put(ptr, end, base)) == 0)
+		goto raw;
+	ptr += len;
+
+	i = 0;
+	while (i < nslots)
+	{
+		size_t		zeros = 0;
+		size_t		used = 0;
+		size_t		j;
+
+		while (i + zeros < nslots && slots[i + zeros] == 0)
+			zeros++;
+		while (i + zeros + used < nslots && slots[i + zeros + used] != 0)
+			used++;
+
+		if ((len = ptrack_varint_put(ptr, end, zeros)) == 0)
+			goto raw;
+		ptr += len;
+		if ((len = ptrack_varint_put(ptr, end, used)) == 0)
+			goto raw;
+		ptr += len;
+
+		for (j = i + zeros; j < i + zeros + used; j++)
+		{
+			if ((len = ptrack_varint_put(ptr, end, slots[j] - base)) == 0)
+				goto raw;
+			ptr += len;
+		}
+
+		i += zeros + used;
+	}
+
+	*encoding = PTRACK_CHUNK_SPARSE;
+	return (uint32) (ptr - dst);
+
+raw:
+	memcpy(dst, slots, nslots * sizeof(uint64));
+	*encoding = PTRACK_CHUNK_RAW;
+	return (uint32) (nslots * sizeof(uint64));
+}
+
+/*
+ * Decode 'size' bytes of the chunk encoded with 'encoding' into exactly
+ * 'nslots' slots.  Returns false if data is malformed.
+ */
+bool
+ptrack_chunk_decode(uint32 encoding, const char *src, size_t size,
+					uint64 *slots, size_t nslots)
+{
+	const char *end = src + size;
+	const char *ptr = src;
+	uint64		base;
+	size_t		len;
+	size_t		i = 0;
+
+	if (encoding == PTRACK_CHUNK_RAW)
+	{
+		if (size != nslots * sizeof(uint64))
+			return false;
+		memcpy(slots, src, size);
+		return true;
+	}
+	else if (encoding != PTRACK_CHUNK_SPARSE)
+		return false;
+
+	if ((len = ptrack_varint_get(ptr, end, &base)) == 0)
+		return false;
+	ptr += len;
+
+	while (i < nslots)
+	{
+		uint64		zeros;
+		uint64		used;
+
+		if ((len = ptrack_varint_get(ptr, end, &zeros)) == 0)
+			return false;
+		ptr += len;
+		if ((len = ptrack_varint_get(ptr, end, &used)) == 0)
+			return false;
+		ptr += len;
+
+		if (zeros > nslots - i || used > nslots - i - zeros)
+			return false;
+
+		memset(&slots[i], 0, zeros * sizeof(uint64));
+		i += zeros;
+
+		while (used-- > 0)
+		{
+			uint64		delta;
+
+			if ((len = ptrack_varint_get(ptr, end, &delta)) == 0)
+				return false;
+			ptr += len;
+			slots[i++] = base + delta;
+		}
+	}
+
+	/* All data should be consumed */
+	return ptr == end;
+}
+
+/*
+ * Format policy as "forks F unlogged U tablespaces OID...\n".  'size' of
+ * PTRACK_POLICY_MAXLEN is always enough.
+ */
+void
+ptrack_policy_format(const PtrackPolicy * policy, char *buf, size_t size)
+{
+	size_t		len;
+	int			i;
+
+	len = snprintf(buf, size, "forks %u unlogged %d tablespaces",
+				   policy->forks, policy->track_unlogged ? 1 : 0);
+
+	for (i = 0; i < policy->nignored && len < size; i++)
+		len += snprintf(buf + len, size - len, " %u", policy->ignored[i]);
+
+	if (len < size)
+		snprintf(buf + len, size - len, "\n");
+}
+
+/*
+ * Parse policy formatted by ptrack_policy_format().  Returns false if the
+ * text is malformed.
+ */
+bool
+ptrack_policy_parse(const char *buf, PtrackPolicy * policy)
+{
+	unsigned int forks;
+	int			unlogged;
+	int			len = 0;
+	const char *ptr;
+
+	if (sscanf(buf, "forks %u unlogged %d tablespaces%n",
+			   &forks, &unlogged, &len) != 2 || len == 0)
+		return false;
+
+	memset(policy, 0, sizeof(PtrackPolicy));
+	policy->forks = forks;
+	policy->track_unlogged = unlogged != 0;
+
+	ptr = buf + len;
+	while (*ptr == ' ')
+	{
+		char	   *end;
+		unsigned long spcOid = strtoul(ptr + 1, &end, 10);
+
+		if (end == ptr + 1 || policy->nignored == PTRACK_MAX_IGNORED_TABLESPACES)
+			return false;
+
+		policy->ignored[policy->nignored++] = (Oid) spcOid;
+		ptr = end;
+	}
+
+	return *ptr == '\n' || *ptr == '\0';
+}
@@ -28,7 +28,7 @@ BEGIN
 	}
 }
 
-plan tests => 23;
+plan tests => 57;
 
 note('PostgreSQL 15 modules are used: ' . ($pg_15_modules ? 'yes' : 'no'));
 
@@ -148,10 +148,273 @@ like(
 	qr/$rel_oid/,
 	'ptrack pagemapset should contain new relation oid');
 
+# Single pass over the map should give the same bitmaps for every LSN
+$res_stdout = $node->safe_psql("postgres", qq{
+	SELECT count(*) FROM
+		(SELECT path, pagemap FROM ptrack_get_pagemapset_multi('{$flush_lsn, 0/0}')
+		  WHERE start_lsn = '$flush_lsn') m
+		FULL JOIN ptrack_get_pagemapset('$flush_lsn') s USING (path, pagemap)
+	WHERE (m.path IS NULL OR s.path IS NULL) AND path LIKE 'base/$db_oid/%'});
+is($res_stdout, 0, 'multi-LSN pagemapset should match pagemapset for the same LSN');
+
+# Map should not miss any page changed according to its LSN
+$res_stdout = $node->safe_psql("postgres",
+	"SELECT sum(true_positives) > 0 AND sum(missed) = 0 FROM ptrack_verify_pagemap('$flush_lsn')");
+is($res_stdout, 't', 'ptrack map should cover all pages with newer LSN');
+
+# Checking page LSNs should only drop blocks from bitmaps
+$res_stdout = $node->safe_psql("postgres", qq{
+	SELECT count(*) FROM ptrack_get_pagemapset('$flush_lsn', true) c
+		LEFT JOIN ptrack_get_pagemapset('$flush_lsn') s USING (path)
+	WHERE s.path IS NULL OR c.pagecount > s.pagecount OR c.pagecount = 0});
+is($res_stdout, 0, 'pagemapset with page LSN check should be a subset of pagemapset');
+
+# Visibility map bits are cleared without updating the page LSN, so the VM
+# fork should not be filtered by page LSN
+my $rel_path = $node->safe_psql("postgres", "SELECT pg_relation_filepath('ptrack_test')");
+$node->safe_psql("postgres", "VACUUM ptrack_test");
+$node->safe_psql("postgres", "CHECKPOINT");
+my $vm_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_flush_lsn()");
+$node->safe_psql("postgres", "UPDATE ptrack_test SET id = id WHERE id = 0");
+$node->safe_psql("postgres", "CHECKPOINT");
+$res_stdout = $node->safe_psql("postgres", "SELECT path FROM ptrack_get_pagemapset('$vm_lsn', true)");
+like($res_stdout, qr/^\Q${rel_path}_vm\E$/m, 'cleared visibility map page should be kept with page LSN check');
+
+# Streamed pages should match the bitmap of the relation
+$res_stdout = $node->safe_psql("postgres", qq{
+	SELECT sum(c.pagecount) = min(s.pagecount)
+		AND bool_and(length(c.pages) = c.pagecount * (4 + current_setting('block_size')::int))
+	FROM ptrack_get_changed_pages('$flush_lsn', false, 2) c
+		JOIN ptrack_get_pagemapset('$flush_lsn') s USING (path)
+	WHERE path ~ '/$rel_oid\$'});
+is($res_stdout, 't', 'should be able to get content of changed pages');
+
+# Exported pagemapset should be read back exactly
+my $export_path = $node->basedir . '/ptrack.pagemapset';
+$res_stdout = $node->safe_psql("postgres",
+	"SELECT files > 0 FROM ptrack_export_pagemapset('$flush_lsn', '$export_path')");
+is($res_stdout, 't', 'should be able to export pagemapset');
+$res_stdout = $node->safe_psql("postgres", qq{
+	SELECT count(*) FROM ptrack_read_pagemapset('$export_path') r
+		FULL JOIN ptrack_get_pagemapset('$flush_lsn') s USING (path, pagecount, pagemap)
+	WHERE (r.path IS NULL OR s.path IS NULL) AND path LIKE 'base/$db_oid/%'});
+is($res_stdout, 0, 'exported pagemapset should match pagemapset');
+
+# Relation pagemap should only contain segments of that relation
+$res_stdout = $node->safe_psql("postgres", qq{
+	SELECT count(*) > 0 AND bool_and(path ~ '/$rel_oid(_[a-z]+)?\$')
+	FROM ptrack_get_relation_pagemap('ptrack_test', '$flush_lsn')});
+is($res_stdout, 't', 'should be able to get pagemap of a single relation');
+
+# Pagemap of a relation should not be available to roles, which cannot read it
+$node->safe_psql("postgres", "CREATE ROLE ptrack_noread");
+($res, $res_stdout, $res_stderr) = $node->psql("postgres", qq{
+	SET ROLE ptrack_noread;
+	SELECT count(*) FROM ptrack_get_relation_pagemap('ptrack_test', '$flush_lsn')});
+like($res_stderr, qr/permission denied/, 'pagemap of a relation should require SELECT privilege');
+
 # Check change stats
 $res_stdout = $node->safe_psql("postgres", "SELECT pages FROM ptrack_get_change_stat('$flush_lsn')");
 is($res_stdout > 0, 1, 'should be able to get aggregated stats of changes');
 
+# Sampling the whole cluster should give the same picture within the bounds
+$res_stdout = $node->safe_psql("postgres",
+	"SELECT pages > 0 AND pages_low <= pages AND pages <= pages_high FROM ptrack_estimate_change('$flush_lsn', 1.0)");
+is($res_stdout, 't', 'should be able to estimate amount of changes');
+
+# Profile of the scan should count the same changes as the scan itself
+$res_stdout = $node->safe_psql("postgres", qq{
+	WITH p AS (SELECT * FROM ptrack_profile_pagemapset('$flush_lsn'))
+	SELECT t.rows = (SELECT sum(rows) FROM p WHERE tablespace IS NOT NULL)
+		AND t.changed_blocks > 0 AND t.blocks + t.whole_file_blocks >= t.changed_blocks
+		AND t.total_ms >= t.gather_ms
+	FROM p t WHERE t.tablespace IS NULL});
+is($res_stdout, 't', 'should be able to profile pagemapset scan');
+
+# Map occupancy should be consistent with the histogram of slots
+$res_stdout = $node->safe_psql("postgres", qq{
+	SELECT o.newer_slots > 0 AND o.newer_slots <= o.used_slots
+		AND o.false_positive_rate = o.occupancy * o.occupancy
+		AND o."recommended_size, MB" > 0
+		AND (SELECT sum(slots) FROM ptrack_map_histogram(5)) > 0
+	FROM ptrack_map_occupancy('$flush_lsn', 0.01) o});
+is($res_stdout, 't', 'should be able to get map occupancy');
+$res_stdout = $node->safe_psql("postgres", "SELECT count(*) FROM ptrack_map_histogram(5)");
+is($res_stdout, 5, 'histogram should have requested number of buckets');
+
+# Counters should reflect marks and checkpoints done so far
+$node->safe_psql("postgres", "CHECKPOINT");
+$res_stdout = $node->safe_psql("postgres",
+	"SELECT marks > 0 AND checkpoints > 0 AND used_slots > 0 AND used_slots <= total_slots FROM ptrack_stats");
+is($res_stdout, 't', 'ptrack_stats should show marks and checkpoints');
+$res_stdout = $node->safe_psql("postgres",
+	"SELECT checkpoint_bytes < checkpoints * total_slots * 8 FROM ptrack_stats");
+is($res_stdout, 't', 'sparse map should take less space than raw slots');
+ok(! -f $node->data_dir . "/global/ptrack.map.tmp", "map should be updated in place");
+
+$node->safe_psql("postgres", "SELECT ptrack_stats_reset()");
+$res_stdout = $node->safe_psql("postgres", "SELECT checkpoints FROM ptrack_stats");
+is($res_stdout, 0, 'ptrack_stats_reset() should reset counters');
+
+# Corrupted chunk of the map should not invalidate the whole map
+$node->stop;
+my $map_path = $node->data_dir . '/global/ptrack.map';
+open(my $map_fh, '+<', $map_path) or die "could not open $map_path: $!";
+binmode($map_fh);
+# Map file holds two regions starting with 48-byte header with generation at
+# offset 24 and number of slots at offset 32.  Header is followed by 8-byte
+# infos of 8192-slot chunks, chunks start and regions end at 4 kB boundary.
+# Spoil the first byte of the first chunk of the region with the greatest
+# generation.
+sub map_align { my ($size) = @_; return int(($size + 4095) / 4096) * 4096; }
+my $map_hdr;
+read($map_fh, $map_hdr, 48);
+my $map_nslots = unpack('Q<', substr($map_hdr, 32, 8));
+my $map_nchunks = int(($map_nslots + 8191) / 8192);
+my $map_chunks_offset = map_align(48 + $map_nchunks * 8);
+my $map_region_size = map_align($map_chunks_offset + $map_nslots * 8 + $map_nchunks * 4);
+my $map_gen0 = unpack('Q<', substr($map_hdr, 24, 8));
+seek($map_fh, $map_region_size, 0);
+read($map_fh, $map_hdr, 48);
+my $map_gen1 = unpack('Q<', substr($map_hdr, 24, 8));
+my $map_chunk_offset = ($map_gen1 > $map_gen0 ? $map_region_size : 0) + $map_chunks_offset;
+my $map_byte;
+seek($map_fh, $map_chunk_offset, 0);
+read($map_fh, $map_byte, 1);
+seek($map_fh, $map_chunk_offset, 0);
+print $map_fh chr(ord($map_byte) ^ 0xff);
+close($map_fh);
+$node->start;
+$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_init_lsn()");
+is($res_stdout, $init_lsn, 'ptrack init_lsn should be the same after chunk corruption');
+open(my $log_fh, '<', $node->logfile) or die "could not open server log: $!";
+my $log = do { local $/; <$log_fh> };
+close($log_fh);
+like(
+	$log,
+	qr/1 of \d+ chunks of file ".*ptrack\.map" have incorrect checksum/,
+	'corrupted chunk should be reported');
+
+# Map written with direct I/O should be read back the same way (buffered
+# writes are used instead if filesystem does not support direct I/O)
+$node->append_conf(
+	'postgresql.conf', q{
+ptrack.flush_method = 'direct'
+});
+$node->reload;
+$node->safe_psql("postgres", "CHECKPOINT");
+$node->restart;
+$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$flush_lsn')");
+like(
+	$res_stdout,
+	qr/base\/$db_oid/,
+	'map written with direct I/O should keep changes');
+
+# Map should be loaded the same way into huge pages if they are available
+$node->append_conf(
+	'postgresql.conf', q{
+ptrack.huge_pages = try
+});
+$node->restart;
+$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$flush_lsn')");
+like(
+	$res_stdout,
+	qr/base\/$db_oid/,
+	'map should keep changes with ptrack.huge_pages = try');
+
+# Blocks of a tablespace listed in ptrack.partitions should be tracked in its
+# own map file
+my $tbs_dir = $node->basedir . '/tbs_part';
+mkdir($tbs_dir) or die "could not create $tbs_dir: $!";
+$node->safe_psql("postgres", "CREATE TABLESPACE tbs_part LOCATION '$tbs_dir'");
+my $tbs_oid = $node->safe_psql("postgres", "SELECT oid FROM pg_tablespace WHERE spcname = 'tbs_part'");
+$node->append_conf(
+	'postgresql.conf', qq{
+ptrack.partitions = '$tbs_oid:1'
+});
+$node->restart;
+$node->safe_psql("postgres", "CHECKPOINT");
+my $part_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_flush_lsn()");
+$node->safe_psql("postgres",
+	"CREATE TABLE tbs_part_tbl TABLESPACE tbs_part AS SELECT i FROM generate_series(1, 1000) i");
+$node->safe_psql("postgres", "CHECKPOINT");
+ok(-f $node->data_dir . "/global/ptrack_$tbs_oid.map", "partition map file should be created");
+$node->restart;
+$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$part_lsn')");
+like(
+	$res_stdout,
+	qr/pg_tblspc\/$tbs_oid\//,
+	'changes in partitioned tablespace should be kept');
+
+# Profile should have a row for every tablespace with data files, so that its
+# counters survive the scan of several tablespaces
+$res_stdout = $node->safe_psql("postgres", qq{
+	WITH p AS (SELECT * FROM ptrack_profile_pagemapset('$part_lsn'))
+	SELECT (SELECT count(*) FROM p WHERE tablespace IN ($tbs_oid, 1663, 1664)) = 3
+		AND (SELECT segments FROM p WHERE tablespace = $tbs_oid) > 0
+		AND t.rows = (SELECT sum(rows) FROM p WHERE tablespace IS NOT NULL)
+	FROM p t WHERE t.tablespace IS NULL});
+is($res_stdout, 't', 'should be able to profile pagemapset scan of several tablespaces');
+
+# Files copied by CREATE DATABASE should be registered as changed as a whole
+# instead of marking all their blocks in the map
+my $strategy = $node->safe_psql("postgres", "SHOW server_version_num") >= 150000
+	? "STRATEGY = FILE_COPY" : "";
+$node->safe_psql("postgres", "CHECKPOINT");
+my $files_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_flush_lsn()");
+$node->safe_psql("postgres", "CREATE DATABASE ptrack_files_test $strategy");
+my $files_db_oid = $node->safe_psql("postgres",
+	"SELECT oid FROM pg_database WHERE datname = 'ptrack_files_test'");
+$node->safe_psql("postgres", "CHECKPOINT");
+ok(-f $node->data_dir . "/global/ptrack.files", "registry of files changed as a whole should be created");
+$node->stop('immediate');
+$node->start;
+$res_stdout = $node->safe_psql("postgres", qq{
+	SELECT count(*) > 0 AND
+		bool_and(pagecount * current_setting('block_size')::int = (pg_stat_file(path)).size)
+	FROM ptrack_get_pagemapset('$files_lsn')
+	WHERE path LIKE 'base/$files_db_oid/%'});
+is($res_stdout, 't', 'all blocks of copied files should be reported as changed');
+
+# Writes to unlogged relations should not reach the map with
+# ptrack.track_unlogged = off, while their files are reported as changed as a
+# whole
+$node->append_conf(
+	'postgresql.conf', q{
+ptrack.track_unlogged = off
+});
+$node->restart;
+$node->safe_psql("postgres", "CREATE UNLOGGED TABLE ptrack_unlogged (i int)");
+$node->safe_psql("postgres", "CHECKPOINT");
+my $unlogged_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_flush_lsn()");
+my $marks = $node->safe_psql("postgres", "SELECT marks FROM ptrack_stats");
+$node->safe_psql("postgres", "INSERT INTO ptrack_unlogged SELECT generate_series(1, 100000)");
+$node->safe_psql("postgres", "CHECKPOINT");
+$res_stdout = $node->safe_psql("postgres", qq{
+	SELECT marks - $marks < pg_relation_size('ptrack_unlogged') / current_setting('block_size')::int
+	FROM ptrack_stats});
+is($res_stdout, 't', 'blocks of unlogged relation should not be marked in the map');
+$res_stdout = $node->safe_psql("postgres", qq{
+	SELECT pagecount * current_setting('block_size')::int = pg_relation_size('ptrack_unlogged')
+	FROM ptrack_get_pagemapset('$unlogged_lsn')
+	WHERE path = pg_relation_filepath('ptrack_unlogged')});
+is($res_stdout, 't', 'unlogged relation should be reported as changed as a whole');
+
+# Keep WAL to restore changes lost with the map, see ptrack_backfill() below
+my $pg_version_num = $node->safe_psql("postgres", "SHOW server_version_num");
+my $backfill_lsn;
+my $backfill_rel;
+if ($pg_version_num >= 150000)
+{
+	$node->safe_psql("postgres", "ALTER SYSTEM SET wal_keep_size = '256MB'");
+	$node->reload;
+	$node->safe_psql("postgres", "CHECKPOINT");
+	$backfill_lsn = $node->safe_psql("postgres", "SELECT redo_lsn FROM pg_control_checkpoint()");
+	$node->safe_psql("postgres",
+		"CREATE TABLE ptrack_backfill AS SELECT i FROM generate_series(1, 1000) i");
+	$backfill_rel = $node->safe_psql("postgres", "SELECT pg_relation_filepath('ptrack_backfill')");
+}
+
 # We should be able to change ptrack map size (but loose all changes)
 $node->append_conf(
 	'postgresql.conf', q{
@@ -172,6 +435,73 @@ unlike(
 	qr/base\/$db_oid/,
 	'we should loose changes after ptrack map resize');
 
+# Changes lost with the map should be restored from WAL kept in pg_wal
+SKIP:
+{
+	skip "ptrack_backfill() requires PostgreSQL 15 or newer", 2
+	  if $pg_version_num < 150000;
+
+	$res_stdout = $node->safe_psql("postgres",
+		"SELECT init_lsn = '$backfill_lsn' FROM ptrack_backfill('$backfill_lsn')");
+	is($res_stdout, 't', 'ptrack_backfill() should move init_lsn back to start LSN');
+	$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$backfill_lsn')");
+	like(
+		$res_stdout,
+		qr/\Q$backfill_rel\E/,
+		'changes lost with the map should be restored from WAL');
+}
+
+# Blocks marked by the microbenchmark should all be found by the probe one
+my $bench_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_insert_lsn()");
+($res, $res_stdout, $res_stderr) = $node->psql("postgres",
+	"SELECT ops FROM ptrack_bench_mark(6400, 'zipf', 10)");
+SKIP:
+{
+	skip "ptrack is built without benchmark functions", 1
+	  if $res_stderr =~ /built without benchmark functions/;
+
+	$res_stdout = $node->safe_psql("postgres",
+		"SELECT changed = ops FROM ptrack_bench_probe('$bench_lsn', 6400, 'zipf', 10)");
+	is($res_stdout, 't', 'blocks marked by ptrack_bench_mark() should be found by ptrack_bench_probe()');
+}
+
+# Changes should be marked from WAL in WAL tracking mode, before the worker
+# reaches them and after crash
+SKIP:
+{
+	skip "ptrack.tracking_mode = wal requires PostgreSQL 15 or newer", 3
+	  if $pg_version_num < 150000;
+
+	$node->append_conf(
+		'postgresql.conf', q{
+ptrack.tracking_mode = wal
+ptrack.wal_delay = 10000
+});
+	$node->restart;
+	$node->safe_psql("postgres", "CHECKPOINT");
+	my $wal_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_flush_lsn()");
+	$node->safe_psql("postgres",
+		"CREATE TABLE ptrack_wal AS SELECT i FROM generate_series(1, 1000) i");
+	my $wal_rel = $node->safe_psql("postgres", "SELECT pg_relation_filepath('ptrack_wal')");
+	$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$wal_lsn')");
+	like($res_stdout, qr/\Q$wal_rel\E/, 'changes should be marked from WAL in WAL tracking mode');
+
+	# Clearing of visibility map bits is not WAL-logged, so it should be
+	# marked on write of the VM page
+	$node->safe_psql("postgres", "VACUUM ptrack_wal");
+	$node->safe_psql("postgres", "CHECKPOINT");
+	my $vm_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_flush_lsn()");
+	$node->safe_psql("postgres", "UPDATE ptrack_wal SET i = 0 WHERE i = 1");
+	$node->safe_psql("postgres", "CHECKPOINT");
+	$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$vm_lsn')");
+	like($res_stdout, qr/\Q${wal_rel}_vm\E/, 'cleared visibility map bits should be marked in WAL tracking mode');
+
+	$node->stop('immediate');
+	$node->start;
+	$res_stdout = $node->safe_psql("postgres", "SELECT ptrack_get_pagemapset('$wal_lsn')");
+	like($res_stdout, qr/\Q$wal_rel\E/, 'changes should be marked from WAL after crash in WAL tracking mode');
+}
+
 # We should be able to turn off ptrack and clean up all files by stting ptrack.map_size = 0
 $node->append_conf(
 	'postgresql.conf', q{
@@ -0,0 +1,214 @@
+#
+# Performance regression suite reproducing benchmarks/README.md.  It runs
+# the modified pgbench workload for several ptrack.map_size values, measures
+# ptrack checkpoint duration and bytes written, and times
+# ptrack_get_pagemapset() on a large synthetic cluster made of sparse files.
+# Results are written as JSON and checked against configurable thresholds.
+#
+# It takes a while, so it is skipped unless PTRACK_BENCHMARK is set.  See
+# benchmarks/README.md for all environment variables.
+#
+
+use strict;
+use warnings;
+use File::Spec;
+use IPC::Run;
+use JSON::PP;
+use Test::More;
+use Time::HiRes qw(time);
+
+my $pg_15_modules;
+
+BEGIN
+{
+	$pg_15_modules = eval
+	{
+		require PostgreSQL::Test::Cluster;
+		require PostgreSQL::Test::Utils;
+		return 1;
+	};
+
+	unless (defined $pg_15_modules)
+	{
+		$pg_15_modules = 0;
+
+		require PostgresNode;
+		require TestLib;
+	}
+}
+
+plan skip_all => 'set PTRACK_BENCHMARK to run ptrack benchmarks'
+  unless $ENV{PTRACK_BENCHMARK};
+
+# Workload parameters
+my $scale = $ENV{PTRACK_BENCH_SCALE} // 10;
+my $clients = $ENV{PTRACK_BENCH_CLIENTS} // 8;
+my $duration = $ENV{PTRACK_BENCH_TIME} // 30;
+my @map_sizes = split(/\s*,\s*/, $ENV{PTRACK_BENCH_MAP_SIZES} // '0, 64, 256');
+my $cluster_gb = $ENV{PTRACK_BENCH_CLUSTER_GB} // 100;
+
+# Regression thresholds
+my $max_tps_drop = $ENV{PTRACK_BENCH_MAX_TPS_DROP} // 10;
+my $max_checkpoint_ms = $ENV{PTRACK_BENCH_MAX_CHECKPOINT_MS} // 5000;
+my $max_flush_ratio = $ENV{PTRACK_BENCH_MAX_FLUSH_RATIO} // 1.1;
+my $max_pagemapset_sec = $ENV{PTRACK_BENCH_MAX_PAGEMAPSET_SEC} // 60;
+
+my $tmp_check = $pg_15_modules ? $PostgreSQL::Test::Utils::tmp_check : $TestLib::tmp_check;
+my $output = $ENV{PTRACK_BENCH_OUTPUT} // "$tmp_check/ptrack_benchmark.json";
+
+my $baseline = grep { $_ == 0 } @map_sizes;
+my $nsizes = grep { $_ > 0 } @map_sizes;
+
+die "PTRACK_BENCH_MAP_SIZES should contain a non-zero map size" unless $nsizes;
+
+# Checkpoint duration and flush bytes for every enabled map, TPS drop for
+# them if there is a baseline, and the pagemapset time
+plan tests => 2 * $nsizes + ($baseline ? $nsizes : 0) + 1;
+
+my $node;
+
+eval
+{
+	if ($pg_15_modules)
+	{
+		$node = PostgreSQL::Test::Cluster->new("bench");
+	}
+	else
+	{
+		$node = PostgresNode::get_new_node("bench");
+	}
+};
+
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'ptrack'
+max_connections = @{[$clients + 10]}
+shared_buffers = 256MB
+max_wal_size = 4GB
+checkpoint_timeout = 1h
+synchronous_commit = off
+});
+$node->start;
+$node->safe_psql("postgres", "CREATE EXTENSION ptrack");
+
+my $pgb_script = File::Spec->catfile('benchmarks', 'pgb.sql');
+my ($stdout, $stderr);
+
+local $ENV{PGHOST} = $node->host;
+local $ENV{PGPORT} = $node->port;
+
+IPC::Run::run([ 'pgbench', '-i', '-q', '-s', $scale, 'postgres' ],
+	'>', \$stdout, '2>', \$stderr)
+  or BAIL_OUT("pgbench initialization failed: $stderr");
+
+my %results = (
+	version => $node->safe_psql("postgres", "SELECT ptrack_version()"),
+	server_version => $node->safe_psql("postgres", "SHOW server_version_num") + 0,
+	scale => $scale,
+	clients => $clients,
+	duration => $duration,
+	runs => [],
+	thresholds => {
+		max_tps_drop => $max_tps_drop,
+		max_checkpoint_ms => $max_checkpoint_ms,
+		max_flush_ratio => $max_flush_ratio,
+		max_pagemapset_sec => $max_pagemapset_sec,
+	},
+);
+my $baseline_tps;
+my $start_lsn;
+
+# Baseline is run first, so that every map is compared with it
+foreach my $map_size (sort { $a <=> $b } @map_sizes)
+{
+	my %run = (map_size_mb => $map_size);
+
+	$node->append_conf('postgresql.conf', "ptrack.map_size = $map_size");
+	$node->restart;
+	$node->safe_psql("postgres", "CHECKPOINT");
+	$node->safe_psql("postgres", "SELECT ptrack_stats_reset()") if $map_size > 0;
+	$start_lsn = $node->safe_psql("postgres", "SELECT pg_current_wal_flush_lsn()");
+
+	IPC::Run::run(
+		[
+			'pgbench', '-n', '-c', $clients, '-j', $clients,
+			'-T', $duration, '-f', $pgb_script, 'postgres'
+		],
+		'>', \$stdout, '2>', \$stderr)
+	  or BAIL_OUT("pgbench failed: $stderr");
+	($run{tps}) = $stdout =~ /tps = ([\d.]+)/ or BAIL_OUT("no TPS in pgbench output: $stdout");
+	$run{tps} += 0;
+
+	my $checkpoint_start = time();
+	$node->safe_psql("postgres", "CHECKPOINT");
+	$run{checkpoint_wall_ms} = (time() - $checkpoint_start) * 1000;
+
+	if ($map_size == 0)
+	{
+		$baseline_tps = $run{tps};
+	}
+	else
+	{
+		my $stats = $node->safe_psql("postgres",
+			"SELECT marks, checkpoints, last_checkpoint_time, checkpoint_bytes, used_slots, total_slots FROM ptrack_stats");
+		my @stats = map { $_ + 0 } split(/\|/, $stats);
+
+		@run{qw(marks checkpoints checkpoint_ms checkpoint_bytes used_slots total_slots)} = @stats;
+
+		cmp_ok($run{checkpoint_ms}, '<=', $max_checkpoint_ms,
+			"ptrack checkpoint with $map_size MB map should take at most $max_checkpoint_ms ms");
+		cmp_ok($run{checkpoint_bytes} / $run{checkpoints}, '<=', $max_flush_ratio * $map_size * 1024 * 1024,
+			"ptrack checkpoint with $map_size MB map should write at most $max_flush_ratio of map size");
+		if ($baseline)
+		{
+			$run{tps_drop} = 100 * (1 - $run{tps} / $baseline_tps);
+			cmp_ok($run{tps_drop}, '<=', $max_tps_drop,
+				"TPS with $map_size MB map should drop by at most $max_tps_drop%");
+		}
+	}
+
+	note("map_size = $map_size MB: " . encode_json(\%run));
+	push @{ $results{runs} }, \%run;
+}
+
+# Synthetic cluster of 1 GB sparse segments of relations, which do not exist
+# in the catalog, so ptrack_get_pagemapset() probes the map for all their
+# blocks without real data volume.  It is built in the last configuration.
+my $db_oid = $node->safe_psql("postgres", "SELECT oid FROM pg_database WHERE datname = 'postgres'");
+my $db_dir = $node->data_dir . "/base/$db_oid";
+my @synthetic;
+
+for (my $i = 0; $i < $cluster_gb; $i++)
+{
+	my $path = "$db_dir/" . (3900000000 + int($i / 10));
+	my $fh;
+
+	$path .= "." . ($i % 10) if $i % 10;
+	open($fh, '>', $path) or die "could not create $path: $!";
+	truncate($fh, 1024 * 1024 * 1024) or die "could not truncate $path: $!";
+	close($fh);
+	push @synthetic, $path;
+}
+
+my $pagemapset_start = time();
+my $files = $node->safe_psql("postgres", "SELECT count(*) FROM ptrack_get_pagemapset('$start_lsn')");
+my %pagemapset = (
+	cluster_gb => $cluster_gb,
+	files => $files + 0,
+	seconds => time() - $pagemapset_start,
+);
+$pagemapset{blocks_per_sec} = $cluster_gb * 131072 / $pagemapset{seconds};
+$results{pagemapset} = \%pagemapset;
+
+unlink @synthetic;
+
+cmp_ok($pagemapset{seconds}, '<=', $max_pagemapset_sec,
+	"ptrack_get_pagemapset() on $cluster_gb GB cluster should take at most $max_pagemapset_sec s");
+
+open(my $out, '>', $output) or die "could not open $output: $!";
+print $out JSON::PP->new->canonical->pretty->encode(\%results);
+close($out);
+note("results are written to $output");
+
+$node->stop;
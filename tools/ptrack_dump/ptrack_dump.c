@@ -0,0 +1,366 @@
+/*
+ * ptrack_dump.c
+ *		Validate ptrack.map and print changed blocks without running server
+ *
+ * Copyright (c) 2019-2022, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/tools/ptrack_dump/ptrack_dump.c
+ *
+ * Without --lsn prints summary of the map.  With --lsn walks the data
+ * directory and prints every data file with blocks changed since LSN in the
+ * same form as ptrack_get_pagemapset() returns them: path, number of changed
+ * blocks and hex bitmap of changed blocks, separated with tabs.  Maps of
+ * tablespaces from ptrack.partitions, the registry of files changed as a
+ * whole and the tracking policy are loaded from the data directory as well,
+ * unless --file is given.
+ */
+
+#include "postgres_fe.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "common/logging.h"
+#include "common/relpath.h"
+#include "getopt_long.h"
+
+#include "ptrack_fe.h"
+
+/* Map of tablespace from ptrack.partitions */
+typedef struct DumpPartition
+{
+	Oid			spcOid;
+	PtrackMapFile *map;
+}			DumpPartition;
+
+typedef struct DumpCtx
+{
+	PtrackMapFile *map;
+	DumpPartition *parts;
+	int			nparts;
+	const char *datadir;
+	PtrackPolicy policy;		/* default one unless loaded */
+	PtrackFilesFile *files_reg;	/* registry of files changed as a whole */
+	XLogRecPtr	lsn;
+	unsigned char *bitmap;		/* RELSEG_SIZE / 8 bytes */
+	int64		files;
+	int64		pages;
+}			DumpCtx;
+
+static const char *progname;
+
+static void
+usage(void)
+{
+	printf("%s validates ptrack map and prints blocks changed since LSN without running server.\n\n", progname);
+	printf("Usage:\n");
+	printf("  %s [OPTION]...\n", progname);
+	printf("\nOptions:\n");
+	printf("  -D, --pgdata=DATADIR   data directory\n");
+	printf("  -f, --file=FILE        map file (default: DATADIR/%s)\n", PTRACK_PATH);
+	printf("  -l, --lsn=LSN          print data files changed since LSN\n");
+	printf("  -V, --version          output version information, then exit\n");
+	printf("  -?, --help             show this help, then exit\n");
+}
+
+/*
+ * Load map files of all partitions found in the data directory.  Blocks of
+ * their tablespaces are not tracked in the main map, so any failure is fatal.
+ */
+static void
+load_partitions(DumpCtx *ctx, const char *datadir)
+{
+	char	   *global_dir = psprintf("%s/global", datadir);
+	DIR		   *dir;
+	struct dirent *de;
+
+	dir = opendir(global_dir);
+	if (dir == NULL)
+	{
+		pg_log_error("could not open directory \"%s\": %m", global_dir);
+		exit(1);
+	}
+
+	while (errno = 0, (de = readdir(dir)) != NULL)
+	{
+		char		name[MAXPGPATH];
+		char	   *path;
+		char	   *errmsg = NULL;
+		Oid			spcOid;
+		PtrackMapFile *map;
+
+		if (sscanf(de->d_name, "ptrack_%u.map", &spcOid) != 1)
+			continue;
+		snprintf(name, sizeof(name), "ptrack_%u.map", spcOid);
+		if (strcmp(de->d_name, name) != 0)
+			continue;
+
+		path = psprintf("%s/%s", global_dir, de->d_name);
+		map = ptrack_map_file_read(path, &errmsg);
+		if (map == NULL)
+		{
+			pg_log_error("%s", errmsg);
+			exit(1);
+		}
+		if (map->init_lsn != ctx->map->init_lsn)
+			pg_log_warning("map file \"%s\" was initialized apart from the main map", path);
+		pg_free(path);
+
+		ctx->parts = pg_realloc(ctx->parts, (ctx->nparts + 1) * sizeof(DumpPartition));
+		ctx->parts[ctx->nparts].spcOid = spcOid;
+		ctx->parts[ctx->nparts].map = map;
+		ctx->nparts++;
+	}
+
+	if (errno != 0)
+	{
+		pg_log_error("could not read directory \"%s\": %m", global_dir);
+		exit(1);
+	}
+
+	closedir(dir);
+	pg_free(global_dir);
+}
+
+static void
+dump_file(const char *relpath, const PtrackBlockKey *key, BlockNumber nblocks,
+		  void *arg)
+{
+	DumpCtx    *ctx = (DumpCtx *) arg;
+	PtrackMapFile *map = ctx->map;
+	PtrackBlockKey bid = *key;
+	BlockNumber blkno;
+	int64		pagecount = 0;
+	int			bitmapsize = 0;
+	bool		file_changed;
+	bool		unlogged = false;
+	int			i;
+
+	for (i = 0; i < ctx->nparts; i++)
+		if (ctx->parts[i].spcOid == key->spcOid)
+			map = ctx->parts[i].map;
+
+	memset(ctx->bitmap, 0, RELSEG_SIZE / 8 + 1);
+
+	/* The whole segment has been changed since LSN */
+	file_changed = ctx->files_reg != NULL &&
+		ptrack_files_file_lsn(ctx->files_reg, key) >= ctx->lsn;
+
+	/* Files excluded by the tracking policy are always changed as a whole */
+	if (!ctx->policy.track_unlogged && key->forknum != INIT_FORKNUM)
+	{
+		char	   *initpath = GetRelationPath(key->dbOid, key->spcOid,
+											   key->relNumber, -1, INIT_FORKNUM);
+		char	   *path = psprintf("%s/%s", ctx->datadir, initpath);
+		struct stat st;
+
+		unlogged = stat(path, &st) == 0;
+		pg_free(initpath);
+		pg_free(path);
+	}
+	if (ptrack_policy_excludes(&ctx->policy, key->spcOid, key->forknum, unlogged))
+		file_changed = true;
+
+	for (blkno = 0; blkno < nblocks && blkno < RELSEG_SIZE; blkno++)
+	{
+		bid.blocknum = key->blocknum + blkno;
+
+		if (file_changed || ptrack_map_block_changed(map, &bid, ctx->lsn))
+		{
+			ctx->bitmap[blkno / 8] |= 1 << (blkno % 8);
+			bitmapsize = blkno / 8 + 1;
+			pagecount++;
+		}
+	}
+
+	if (pagecount == 0)
+		return;
+
+	printf("%s\t" INT64_FORMAT "\t\\x", relpath, pagecount);
+	for (i = 0; i < bitmapsize; i++)
+		printf("%02x", ctx->bitmap[i]);
+	printf("\n");
+
+	ctx->files++;
+	ctx->pages += pagecount;
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"pgdata", required_argument, NULL, 'D'},
+		{"file", required_argument, NULL, 'f'},
+		{"lsn", required_argument, NULL, 'l'},
+		{NULL, 0, NULL, 0}
+	};
+	char	   *datadir = NULL;
+	char	   *mapfile = NULL;
+	bool		partitions = false;
+	char	   *lsnstr = NULL;
+	char	   *errmsg = NULL;
+	DumpCtx		ctx;
+	uint64		used = 0;
+	uint64		i;
+	int			c;
+
+	pg_logging_init(argv[0]);
+	progname = get_progname(argv[0]);
+
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0)
+		{
+			usage();
+			exit(0);
+		}
+		if (strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-V") == 0)
+		{
+			puts("ptrack_dump (PostgreSQL) " PG_VERSION);
+			exit(0);
+		}
+	}
+
+	while ((c = getopt_long(argc, argv, "D:f:l:", long_options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'D':
+				datadir = pg_strdup(optarg);
+				break;
+			case 'f':
+				mapfile = pg_strdup(optarg);
+				break;
+			case 'l':
+				lsnstr = pg_strdup(optarg);
+				break;
+			default:
+				fprintf(stderr, "Try \"%s --help\" for more information.\n", progname);
+				exit(1);
+		}
+	}
+
+	if (optind < argc)
+	{
+		pg_log_error("too many command-line arguments (first is \"%s\")", argv[optind]);
+		fprintf(stderr, "Try \"%s --help\" for more information.\n", progname);
+		exit(1);
+	}
+
+	if (datadir == NULL)
+		datadir = getenv("PGDATA");
+
+	if (datadir == NULL && (mapfile == NULL || lsnstr != NULL))
+	{
+		pg_log_error("no data directory specified");
+		fprintf(stderr, "Try \"%s --help\" for more information.\n", progname);
+		exit(1);
+	}
+
+	if (mapfile == NULL)
+	{
+		mapfile = psprintf("%s/%s", datadir, PTRACK_PATH);
+		partitions = true;
+	}
+
+	MemSet(&ctx, 0, sizeof(ctx));
+	ctx.policy.forks = PTRACK_ALL_FORKS;
+	ctx.policy.track_unlogged = true;
+
+	if (lsnstr != NULL)
+	{
+		uint32		hi;
+		uint32		lo;
+
+		if (sscanf(lsnstr, "%X/%X", &hi, &lo) != 2)
+		{
+			pg_log_error("invalid LSN \"%s\"", lsnstr);
+			exit(1);
+		}
+		ctx.lsn = ((uint64) hi) << 32 | lo;
+	}
+
+	ctx.map = ptrack_map_file_read(mapfile, &errmsg);
+	if (ctx.map == NULL)
+	{
+		pg_log_error("%s", errmsg);
+		exit(1);
+	}
+
+	if (lsnstr == NULL)
+	{
+		for (i = 0; i < ctx.map->nslots; i++)
+			if (ctx.map->entries[i] != InvalidXLogRecPtr)
+				used++;
+
+		printf("map file:       %s\n", mapfile);
+		printf("format version: %u\n", ctx.map->version_num);
+		printf("init LSN:       %X/%X\n",
+			   (uint32) (ctx.map->init_lsn >> 32), (uint32) ctx.map->init_lsn);
+		printf("flush LSN:      %X/%X\n",
+			   (uint32) (ctx.map->flush_lsn >> 32), (uint32) ctx.map->flush_lsn);
+		printf("slots:          " UINT64_FORMAT "\n", ctx.map->nslots);
+		printf("used slots:     " UINT64_FORMAT "\n", used);
+		printf("generation:     " UINT64_FORMAT "\n", ctx.map->generation);
+		printf("region size:    " UINT64_FORMAT "\n", ctx.map->region_size);
+		printf("chunks:         " UINT64_FORMAT "\n", ctx.map->nchunks);
+		printf("sparse chunks:  " UINT64_FORMAT "\n", ctx.map->sparse_chunks);
+		printf("damaged chunks: " UINT64_FORMAT "\n", ctx.map->damaged_chunks);
+		exit(ctx.map->damaged_chunks > 0 ? 2 : 0);
+	}
+
+	if (ctx.map->damaged_chunks > 0)
+		pg_log_warning(UINT64_FORMAT " of " UINT64_FORMAT " chunks of map have incorrect checksum, their blocks are reported as changed since %X/%X",
+					   ctx.map->damaged_chunks, ctx.map->nchunks,
+					   (uint32) (ctx.map->flush_lsn >> 32), (uint32) ctx.map->flush_lsn);
+
+	/* Map cannot tell anything about changes before its initialization */
+	if (ctx.lsn < ctx.map->init_lsn)
+		pg_log_warning("LSN %X/%X is older than map init LSN %X/%X, changes made before it are not tracked",
+					   (uint32) (ctx.lsn >> 32), (uint32) ctx.lsn,
+					   (uint32) (ctx.map->init_lsn >> 32), (uint32) ctx.map->init_lsn);
+
+	if (partitions)
+	{
+		char	   *files_path = psprintf("%s/%s", datadir, PTRACK_FILES_PATH);
+		char	   *policy_path = psprintf("%s/%s", datadir, PTRACK_POLICY_PATH);
+
+		load_partitions(&ctx, datadir);
+
+		if (!ptrack_policy_file_read(policy_path, &ctx.policy, &errmsg))
+		{
+			pg_log_error("%s", errmsg);
+			exit(1);
+		}
+		pg_free(policy_path);
+		ctx.datadir = datadir;
+
+		ctx.files_reg = ptrack_files_file_read(files_path, &errmsg);
+		if (ctx.files_reg == NULL)
+		{
+			pg_log_error("%s", errmsg);
+			exit(1);
+		}
+		pg_free(files_path);
+	}
+
+	ctx.bitmap = pg_malloc(RELSEG_SIZE / 8 + 1);
+
+	if (!ptrack_walk_datadir(datadir, dump_file, &ctx, &errmsg))
+	{
+		pg_log_error("%s", errmsg);
+		exit(1);
+	}
+
+	pg_log_info(INT64_FORMAT " files, " INT64_FORMAT " changed blocks",
+				ctx.files, ctx.pages);
+
+	ptrack_map_file_free(ctx.map);
+	for (c = 0; c < ctx.nparts; c++)
+		ptrack_map_file_free(ctx.parts[c].map);
+	if (ctx.files_reg != NULL)
+		ptrack_files_file_free(ctx.files_reg);
+
+	return 0;
+}
@@ -0,0 +1,740 @@
+/*
+ * ptrack_fe.c
+ *		Frontend routines for reading ptrack map without running server
+ *
+ * Copyright (c) 2019-2022, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/tools/ptrack_dump/ptrack_fe.c
+ *
+ * INTERFACE ROUTINES
+ *	  ptrack_map_file_read()     --- read and validate ptrack.map
+ *	  ptrack_map_file_free()     --- free map read by ptrack_map_file_read()
+ *	  ptrack_map_block_changed() --- check whether block is changed since LSN
+ *	  ptrack_files_file_read()   --- read and validate ptrack.files
+ *	  ptrack_files_file_free()   --- free registry read by ptrack_files_file_read()
+ *	  ptrack_files_file_lsn()    --- whole file change LSN of segment
+ *	  ptrack_policy_file_read()  --- read tracking policy of the maps
+ *	  ptrack_walk_datadir()      --- call a callback for every relation file
+ *	                               segment in data directory
+ *
+ * Blocks are hashed into map slots exactly as the extension does it (see
+ * ptrack_map.h), so hash_bytes_extended() is required, which is available
+ * for frontend code since PostgreSQL 13.
+ */
+
+#include "postgres_fe.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "catalog/pg_tablespace_d.h"
+#include "common/hashfn.h"
+#include "common/relpath.h"
+#include "port/pg_crc32c.h"
+
+#include "ptrack_fe.h"
+
+#if PG_VERSION_NUM < 130000
+#error "ptrack frontend tools require PostgreSQL 13 or newer"
+#endif
+
+/*
+ * Read exactly size bytes from fd.  Returns false and sets errmsg on error or
+ * unexpected end of file.
+ */
+static bool
+ptrack_read_full(int fd, const char *path, char *buf, size_t size, char **errmsg)
+{
+	size_t		done = 0;
+
+	while (done < size)
+	{
+		ssize_t		nread = read(fd, buf + done, size - done);
+
+		if (nread < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			*errmsg = psprintf("could not read file \"%s\": %m", path);
+			return false;
+		}
+		if (nread == 0)
+		{
+			*errmsg = psprintf("unexpected end of file \"%s\"", path);
+			return false;
+		}
+
+		done += nread;
+	}
+
+	return true;
+}
+
+/*
+ * Read and check header and chunk infos of the map file region.  Returns
+ * false and sets errmsg if the region is not valid.  Chunk infos are
+ * returned in malloc'ed memory.
+ */
+static bool
+ptrack_read_region_hdr(int fd, const char *path, uint64 nslots, uint32 region,
+					   PtrackMapFileHdr *hdr, PtrackMapChunkInfo **chunks,
+					   char **errmsg)
+{
+	uint64		nchunks = PTRACK_MAP_NCHUNKS(nslots);
+	off_t		offset = region * PTRACK_MAP_REGION_SIZE(nslots);
+	uint64		chunkno;
+	pg_crc32c	crc;
+
+	*chunks = NULL;
+
+	if (lseek(fd, offset, SEEK_SET) != offset)
+	{
+		*errmsg = psprintf("could not seek in file \"%s\": %m", path);
+		return false;
+	}
+
+	if (!ptrack_read_full(fd, path, (char *) hdr, sizeof(*hdr), errmsg))
+		return false;
+
+	if (hdr->generation == 0 && hdr->crc == 0)
+	{
+		*errmsg = psprintf("region %u of file \"%s\" was never written", region, path);
+		return false;
+	}
+
+	if (memcmp(hdr->magic, PTRACK_MAGIC, PTRACK_MAGIC_SIZE) != 0)
+	{
+		*errmsg = psprintf("wrong map format of region %u of file \"%s\"", region, path);
+		return false;
+	}
+
+	if (hdr->version_num != PTRACK_MAP_FILE_VERSION_NUM)
+	{
+		*errmsg = psprintf("map format version %u in the file \"%s\" is incompatible with supported version %d",
+						   hdr->version_num, path, PTRACK_MAP_FILE_VERSION_NUM);
+		return false;
+	}
+
+	if (hdr->nslots != nslots || hdr->chunk_slots != PTRACK_MAP_CHUNK_SLOTS)
+	{
+		*errmsg = psprintf("region %u of file \"%s\" does not match file size",
+						   region, path);
+		return false;
+	}
+
+	*chunks = (PtrackMapChunkInfo *) pg_malloc(nchunks * sizeof(PtrackMapChunkInfo));
+	if (!ptrack_read_full(fd, path, (char *) *chunks,
+						  nchunks * sizeof(PtrackMapChunkInfo), errmsg))
+		return false;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, (char *) hdr, offsetof(PtrackMapFileHdr, crc));
+	COMP_CRC32C(crc, (char *) *chunks, nchunks * sizeof(PtrackMapChunkInfo));
+	FIN_CRC32C(crc);
+
+	if (!EQ_CRC32C(crc, hdr->crc) ||
+		hdr->generation % PTRACK_MAP_NREGIONS != region)
+	{
+		*errmsg = psprintf("incorrect checksum of header of region %u of file \"%s\"",
+						   region, path);
+		return false;
+	}
+
+	for (chunkno = 0; chunkno < nchunks; chunkno++)
+	{
+		if ((*chunks)[chunkno].size > PTRACK_MAP_CHUNK_SLOTS * sizeof(uint64))
+		{
+			*errmsg = psprintf("invalid size %u of chunk " UINT64_FORMAT " of file \"%s\"",
+							   (*chunks)[chunkno].size, chunkno, path);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Number of slots of the map stored in the file of 'size' bytes or 0 if
+ * there is no such map.  Regions are padded to PTRACK_MAP_IO_ALIGN, so
+ * different numbers of slots may give the same file size.  Thus the number
+ * of slots is taken from the header of any region with the right magic and
+ * then checked against the file size.  Header CRC is checked later.
+ */
+static uint64
+ptrack_nslots_by_file_size(int fd, const char *path, uint64 size)
+{
+	uint32		region;
+
+	for (region = 0; region < PTRACK_MAP_NREGIONS; region++)
+	{
+		PtrackMapFileHdr hdr;
+		off_t		offset = region * (size / PTRACK_MAP_NREGIONS);
+		char	   *errmsg = NULL;
+
+		if (lseek(fd, offset, SEEK_SET) != offset ||
+			!ptrack_read_full(fd, path, (char *) &hdr, sizeof(hdr), &errmsg))
+			continue;
+
+		if (memcmp(hdr.magic, PTRACK_MAGIC, PTRACK_MAGIC_SIZE) == 0 &&
+			hdr.nslots > 0 &&
+			PTRACK_MAP_NREGIONS * PTRACK_MAP_REGION_SIZE(hdr.nslots) == size)
+			return hdr.nslots;
+	}
+
+	return 0;
+}
+
+/*
+ * Read ptrack.map into memory and check its magic, format version and CRC.
+ * The region with the greatest generation and valid header is used, see
+ * ptrack_map.h.  Returns NULL and sets errmsg if the file cannot be read or
+ * has no valid region.  Chunks with incorrect CRC are filled with flush_lsn
+ * just as the extension does it on startup and counted in damaged_chunks.
+ *
+ * Unlike the extension, the last checkpoint of the cluster is not checked
+ * here, so an older region is silently used if the newer one is broken.
+ */
+PtrackMapFile *
+ptrack_map_file_read(const char *path, char **errmsg)
+{
+	PtrackMapFile *map = NULL;
+	PtrackMapFileHdr hdrs[PTRACK_MAP_NREGIONS];
+	PtrackMapChunkInfo *region_chunks[PTRACK_MAP_NREGIONS];
+	PtrackMapFileHdr *hdr = NULL;
+	PtrackMapChunkInfo *chunks = NULL;
+	char	   *buf = NULL;
+	struct stat st;
+	uint64		nslots_total;
+	uint64		nchunks;
+	uint64		chunkno;
+	uint32		region;
+	int			fd;
+
+	memset(region_chunks, 0, sizeof(region_chunks));
+
+	fd = open(path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+	{
+		*errmsg = psprintf("could not open file \"%s\": %m", path);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) != 0)
+	{
+		*errmsg = psprintf("could not stat file \"%s\": %m", path);
+		goto fail;
+	}
+
+	nslots_total = ptrack_nslots_by_file_size(fd, path, st.st_size);
+	if (nslots_total == 0)
+	{
+		*errmsg = psprintf("unexpected size of file \"%s\": %lld",
+						   path, (long long) st.st_size);
+		goto fail;
+	}
+	nchunks = PTRACK_MAP_NCHUNKS(nslots_total);
+
+	for (region = 0; region < PTRACK_MAP_NREGIONS; region++)
+	{
+		char	   *region_errmsg = NULL;
+
+		if (ptrack_read_region_hdr(fd, path, nslots_total, region,
+								   &hdrs[region], &region_chunks[region],
+								   &region_errmsg))
+		{
+			if (hdr == NULL || hdrs[region].generation > hdr->generation)
+			{
+				hdr = &hdrs[region];
+				chunks = region_chunks[region];
+			}
+		}
+		else if (hdr == NULL)
+			*errmsg = region_errmsg;
+	}
+
+	if (hdr == NULL)
+		goto fail;
+
+	map = (PtrackMapFile *) pg_malloc0(sizeof(PtrackMapFile));
+	map->version_num = hdr->version_num;
+	map->init_lsn = hdr->init_lsn;
+	map->flush_lsn = hdr->flush_lsn;
+	map->generation = hdr->generation;
+	map->nslots = nslots_total;
+	map->nchunks = nchunks;
+	map->region_size = PTRACK_MAP_CHUNKS_OFFSET(nchunks);
+	map->entries = (uint64 *) pg_malloc(map->nslots * sizeof(uint64));
+
+	buf = pg_malloc(PTRACK_MAP_CHUNK_SLOTS * sizeof(uint64) + sizeof(pg_crc32c));
+
+	region = hdr->generation % PTRACK_MAP_NREGIONS;
+	if (lseek(fd, region * PTRACK_MAP_REGION_SIZE(nslots_total) +
+			  PTRACK_MAP_CHUNKS_OFFSET(nchunks), SEEK_SET) < 0)
+	{
+		*errmsg = psprintf("could not seek in file \"%s\": %m", path);
+		goto fail;
+	}
+
+	/* Decode slots directly into their place chunk by chunk */
+	for (chunkno = 0; chunkno < nchunks; chunkno++)
+	{
+		uint64		first = chunkno * PTRACK_MAP_CHUNK_SLOTS;
+		size_t		nslots = Min(map->nslots - first, PTRACK_MAP_CHUNK_SLOTS);
+		size_t		size = chunks[chunkno].size;
+		uint64	   *slots = map->entries + first;
+		pg_crc32c	file_crc;
+		size_t		i;
+
+		if (!ptrack_read_full(fd, path, buf, size + sizeof(pg_crc32c), errmsg))
+			goto fail;
+		memcpy(&file_crc, buf + size, sizeof(pg_crc32c));
+		map->region_size += size + sizeof(pg_crc32c);
+
+		if (chunks[chunkno].encoding == PTRACK_CHUNK_SPARSE)
+			map->sparse_chunks++;
+
+		if (!EQ_CRC32C(file_crc, ptrack_chunk_crc(hdr->generation, chunkno, buf, size)) ||
+			!ptrack_chunk_decode(chunks[chunkno].encoding, buf, size,
+								 slots, nslots))
+		{
+			for (i = 0; i < nslots; i++)
+				slots[i] = map->flush_lsn;
+			map->damaged_chunks++;
+		}
+	}
+
+	close(fd);
+	for (region = 0; region < PTRACK_MAP_NREGIONS; region++)
+		if (region_chunks[region] != NULL)
+			pg_free(region_chunks[region]);
+	pg_free(buf);
+
+	return map;
+
+fail:
+	close(fd);
+	for (region = 0; region < PTRACK_MAP_NREGIONS; region++)
+		if (region_chunks[region] != NULL)
+			pg_free(region_chunks[region]);
+	if (buf != NULL)
+		pg_free(buf);
+	if (map != NULL)
+		ptrack_map_file_free(map);
+	return NULL;
+}
+
+void
+ptrack_map_file_free(PtrackMapFile * map)
+{
+	pg_free(map->entries);
+	pg_free(map);
+}
+
+/*
+ * Check whether block is changed since specified LSN according to the map.
+ * It may return false positives exactly as ptrack_get_pagemapset() does.
+ */
+bool
+ptrack_map_block_changed(const PtrackMapFile * map,
+						 const PtrackBlockKey *key, XLogRecPtr lsn)
+{
+	uint64		hash = hash_bytes_extended((const unsigned char *) key,
+										   sizeof(PtrackBlockKey), 0);
+
+	if (map->entries[PTRACK_HASH_SLOT1(hash, map->nslots)] < lsn)
+		return false;
+
+	return map->entries[PTRACK_HASH_SLOT2(hash, map->nslots)] >= lsn;
+}
+
+static int
+ptrack_file_key_cmp(const void *a, const void *b)
+{
+	return memcmp(&((const PtrackFileEntry *) a)->key,
+				  &((const PtrackFileEntry *) b)->key,
+				  sizeof(PtrackFileKey));
+}
+
+/*
+ * Read and validate registry of files changed as a whole.  Missing file is
+ * an empty registry, since it is created only by the first checkpoint.
+ * Returns NULL and sets errmsg on error.
+ */
+PtrackFilesFile *
+ptrack_files_file_read(const char *path, char **errmsg)
+{
+	PtrackFilesFile *files = pg_malloc0(sizeof(PtrackFilesFile));
+	PtrackFilesHdr hdr;
+	pg_crc32c	crc;
+	int			fd;
+
+	fd = open(path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return files;
+		*errmsg = psprintf("could not open file \"%s\": %m", path);
+		goto fail;
+	}
+
+	if (!ptrack_read_full(fd, path, (char *) &hdr, sizeof(hdr), errmsg))
+		goto fail;
+
+	if (memcmp(hdr.magic, PTRACK_MAGIC, PTRACK_MAGIC_SIZE) != 0 ||
+		hdr.version_num != PTRACK_MAP_FILE_VERSION_NUM)
+	{
+		*errmsg = psprintf("wrong format of file \"%s\"", path);
+		goto fail;
+	}
+
+	/* Server never writes more than ptrack.file_registry_size entries */
+	if (hdr.nentries > 1024 * 1024)
+	{
+		*errmsg = psprintf("too many entries in file \"%s\": " UINT64_FORMAT,
+						   path, hdr.nentries);
+		goto fail;
+	}
+
+	files->nentries = hdr.nentries;
+	files->entries = pg_malloc(Max(hdr.nentries, 1) * sizeof(PtrackFileEntry));
+	if (!ptrack_read_full(fd, path, (char *) files->entries,
+						  hdr.nentries * sizeof(PtrackFileEntry), errmsg))
+		goto fail;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, (char *) &hdr, offsetof(PtrackFilesHdr, crc));
+	COMP_CRC32C(crc, (char *) files->entries, hdr.nentries * sizeof(PtrackFileEntry));
+	FIN_CRC32C(crc);
+
+	if (!EQ_CRC32C(crc, hdr.crc))
+	{
+		*errmsg = psprintf("incorrect checksum of file \"%s\"", path);
+		goto fail;
+	}
+
+	close(fd);
+
+	qsort(files->entries, files->nentries, sizeof(PtrackFileEntry),
+		  ptrack_file_key_cmp);
+
+	return files;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	ptrack_files_file_free(files);
+	return NULL;
+}
+
+void
+ptrack_files_file_free(PtrackFilesFile * files)
+{
+	pg_free(files->entries);
+	pg_free(files);
+}
+
+/*
+ * LSN of the last whole file change of the segment, which block 'key'
+ * belongs to, or InvalidXLogRecPtr if it is not registered.
+ */
+XLogRecPtr
+ptrack_files_file_lsn(const PtrackFilesFile * files, const PtrackBlockKey *key)
+{
+	PtrackFileEntry entry;
+	PtrackFileEntry *found;
+
+	if (files->nentries == 0)
+		return InvalidXLogRecPtr;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.key.spcOid = key->spcOid;
+	entry.key.dbOid = key->dbOid;
+	entry.key.relNumber = key->relNumber;
+	entry.key.forknum = key->forknum;
+	entry.key.segno = key->blocknum / RELSEG_SIZE;
+
+	found = bsearch(&entry, files->entries, files->nentries,
+					sizeof(PtrackFileEntry), ptrack_file_key_cmp);
+
+	return found != NULL ? found->lsn : InvalidXLogRecPtr;
+}
+
+/*
+ * Read tracking policy the maps were built with.  Missing file means the
+ * default policy.  Returns false and sets errmsg on error.
+ */
+bool
+ptrack_policy_file_read(const char *path, PtrackPolicy * policy,
+						char **errmsg)
+{
+	char		buf[PTRACK_POLICY_MAXLEN];
+	ssize_t		nread;
+	int			fd;
+
+	memset(policy, 0, sizeof(PtrackPolicy));
+	policy->forks = PTRACK_ALL_FORKS;
+	policy->track_unlogged = true;
+
+	fd = open(path, O_RDONLY | PG_BINARY, 0);
+	if (fd < 0)
+	{
+		if (errno == ENOENT)
+			return true;
+		*errmsg = psprintf("could not open file \"%s\": %m", path);
+		return false;
+	}
+
+	nread = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+
+	if (nread < 0)
+	{
+		*errmsg = psprintf("could not read file \"%s\": %m", path);
+		return false;
+	}
+	buf[nread] = '\0';
+
+	if (!ptrack_policy_parse(buf, policy))
+	{
+		*errmsg = psprintf("wrong format of file \"%s\"", path);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Parse name of a relation file like "16384", "16384_fsm" or "16384.1".
+ */
+static bool
+ptrack_parse_relfile_name(const char *name, Oid *relNumber,
+						  ForkNumber *forknum, uint32 *segno)
+{
+	const char *p = name;
+	char	   *end;
+	unsigned long val;
+
+	if (!isdigit((unsigned char) *p))
+		return false;
+
+	errno = 0;
+	val = strtoul(p, &end, 10);
+	if (errno != 0 || val == 0 || val > PG_UINT32_MAX)
+		return false;
+	*relNumber = (Oid) val;
+	p = end;
+
+	*forknum = MAIN_FORKNUM;
+	if (*p == '_')
+	{
+		int			forkchars = forkname_chars(p + 1, forknum);
+
+		if (forkchars <= 0)
+			return false;
+		p += forkchars + 1;
+	}
+
+	*segno = 0;
+	if (*p == '.')
+	{
+		if (!isdigit((unsigned char) p[1]))
+			return false;
+
+		errno = 0;
+		val = strtoul(p + 1, &end, 10);
+		if (errno != 0 || val == 0 || val > PG_UINT32_MAX / RELSEG_SIZE)
+			return false;
+		*segno = (uint32) val;
+		p = end;
+	}
+
+	return *p == '\0';
+}
+
+/*
+ * Call callback for every non-empty relation file in directory reldir
+ * (relative to datadir) of the database dbOid in tablespace spcOid.
+ */
+static bool
+ptrack_walk_dbdir(const char *datadir, const char *reldir, Oid spcOid, Oid dbOid,
+				  ptrack_file_callback callback, void *arg, char **errmsg)
+{
+	char		path[MAXPGPATH];
+	DIR		   *dir;
+	struct dirent *de;
+
+	snprintf(path, sizeof(path), "%s/%s", datadir, reldir);
+
+	dir = opendir(path);
+	if (dir == NULL)
+	{
+		*errmsg = psprintf("could not open directory \"%s\": %m", path);
+		return false;
+	}
+
+	while (errno = 0, (de = readdir(dir)) != NULL)
+	{
+		char		relpath[MAXPGPATH];
+		char		fullpath[MAXPGPATH * 2];
+		struct stat st;
+		PtrackBlockKey key;
+		ForkNumber	forknum;
+		uint32		segno;
+
+		if (!ptrack_parse_relfile_name(de->d_name, &key.relNumber, &forknum, &segno))
+			continue;
+
+		snprintf(relpath, sizeof(relpath), "%s/%s", reldir, de->d_name);
+		snprintf(fullpath, sizeof(fullpath), "%s/%s", datadir, relpath);
+
+		if (lstat(fullpath, &st) != 0)
+		{
+			/* Relation may be dropped concurrently */
+			if (errno == ENOENT)
+				continue;
+			*errmsg = psprintf("could not stat file \"%s\": %m", fullpath);
+			closedir(dir);
+			return false;
+		}
+
+		if (!S_ISREG(st.st_mode) || st.st_size == 0)
+			continue;
+
+		key.spcOid = spcOid;
+		key.dbOid = dbOid;
+		key.forknum = forknum;
+		key.blocknum = segno * RELSEG_SIZE;
+
+		callback(relpath, &key, (BlockNumber) (st.st_size / BLCKSZ), arg);
+	}
+
+	if (errno != 0)
+	{
+		*errmsg = psprintf("could not read directory \"%s\": %m", path);
+		closedir(dir);
+		return false;
+	}
+
+	closedir(dir);
+
+	return true;
+}
+
+/*
+ * Call callback for every database directory found in directory dbsdir
+ * (relative to datadir) of tablespace spcOid.
+ */
+static bool
+ptrack_walk_spcdir(const char *datadir, const char *dbsdir, Oid spcOid,
+				   ptrack_file_callback callback, void *arg, char **errmsg)
+{
+	char		path[MAXPGPATH];
+	DIR		   *dir;
+	struct dirent *de;
+
+	snprintf(path, sizeof(path), "%s/%s", datadir, dbsdir);
+
+	dir = opendir(path);
+	if (dir == NULL)
+	{
+		/* Tablespace may have no databases in it */
+		if (errno == ENOENT && spcOid != DEFAULTTABLESPACE_OID)
+			return true;
+		*errmsg = psprintf("could not open directory \"%s\": %m", path);
+		return false;
+	}
+
+	while (errno = 0, (de = readdir(dir)) != NULL)
+	{
+		char		reldir[MAXPGPATH];
+
+		if (strspn(de->d_name, "0123456789") != strlen(de->d_name) ||
+			de->d_name[0] == '\0')
+			continue;
+
+		snprintf(reldir, sizeof(reldir), "%s/%s", dbsdir, de->d_name);
+
+		if (!ptrack_walk_dbdir(datadir, reldir, spcOid, atooid(de->d_name),
+							   callback, arg, errmsg))
+		{
+			closedir(dir);
+			return false;
+		}
+	}
+
+	if (errno != 0)
+	{
+		*errmsg = psprintf("could not read directory \"%s\": %m", path);
+		closedir(dir);
+		return false;
+	}
+
+	closedir(dir);
+
+	return true;
+}
+
+/*
+ * Call callback for every segment of every relation file in global, base
+ * and pg_tblspc directories of the data directory, as ptrack_get_pagemapset()
+ * does.  Returns false and sets errmsg on error.
+ */
+bool
+ptrack_walk_datadir(const char *datadir, ptrack_file_callback callback,
+					void *arg, char **errmsg)
+{
+	char		path[MAXPGPATH];
+	DIR		   *dir;
+	struct dirent *de;
+
+	if (!ptrack_walk_dbdir(datadir, "global", GLOBALTABLESPACE_OID, InvalidOid,
+						   callback, arg, errmsg))
+		return false;
+
+	if (!ptrack_walk_spcdir(datadir, "base", DEFAULTTABLESPACE_OID,
+							callback, arg, errmsg))
+		return false;
+
+	snprintf(path, sizeof(path), "%s/pg_tblspc", datadir);
+
+	dir = opendir(path);
+	if (dir == NULL)
+	{
+		*errmsg = psprintf("could not open directory \"%s\": %m", path);
+		return false;
+	}
+
+	while (errno = 0, (de = readdir(dir)) != NULL)
+	{
+		char		dbsdir[MAXPGPATH];
+
+		if (strspn(de->d_name, "0123456789") != strlen(de->d_name) ||
+			de->d_name[0] == '\0')
+			continue;
+
+		snprintf(dbsdir, sizeof(dbsdir), "pg_tblspc/%s/%s",
+				 de->d_name, TABLESPACE_VERSION_DIRECTORY);
+
+		if (!ptrack_walk_spcdir(datadir, dbsdir, atooid(de->d_name),
+								callback, arg, errmsg))
+		{
+			closedir(dir);
+			return false;
+		}
+	}
+
+	if (errno != 0)
+	{
+		*errmsg = psprintf("could not read directory \"%s\": %m", path);
+		closedir(dir);
+		return false;
+	}
+
+	closedir(dir);
+
+	return true;
+}
@@ -0,0 +1,75 @@
+/*-------------------------------------------------------------------------
+ *
+ * ptrack_fe.h
+ *	  frontend routines for reading ptrack map without running server
+ *
+ * Copyright (c) 2019-2022, Postgres Professional
+ *
+ * ptrack/tools/ptrack_dump/ptrack_fe.h
+ *
+ *-------------------------------------------------------------------------
+ */
+#ifndef PTRACK_FE_H
+#define PTRACK_FE_H
+
+#include "access/xlogdefs.h"
+#include "storage/block.h"
+
+#include "ptrack_map.h"
+
+/*
+ * Content of ptrack.map loaded into memory.
+ */
+typedef struct PtrackMapFile
+{
+	uint32		version_num;
+	XLogRecPtr	init_lsn;
+	XLogRecPtr	flush_lsn;
+	/* Generation of the region the map is read from */
+	uint64		generation;
+	uint64		nslots;
+	uint64		nchunks;
+	/* Number of chunks stored with sparse encoding */
+	uint64		sparse_chunks;
+	/* Number of bytes used in the region the map is read from */
+	uint64		region_size;
+	/* Number of chunks with incorrect CRC, which are filled with flush_lsn */
+	uint64		damaged_chunks;
+	uint64	   *entries;
+}			PtrackMapFile;
+
+/*
+ * Registry of files changed as a whole (global/ptrack.files) loaded into
+ * memory.  Entries are sorted by key.
+ */
+typedef struct PtrackFilesFile
+{
+	uint64		nentries;
+	PtrackFileEntry *entries;
+}			PtrackFilesFile;
+
+/*
+ * Called for every segment of every relation file found in data directory.
+ * relpath is relative to the data directory, blocknum of key is the first
+ * block of the segment and nblocks is the number of blocks in the segment.
+ */
+typedef void (*ptrack_file_callback) (const char *relpath,
+									  const PtrackBlockKey *key,
+									  BlockNumber nblocks,
+									  void *arg);
+
+extern PtrackMapFile *ptrack_map_file_read(const char *path, char **errmsg);
+extern void ptrack_map_file_free(PtrackMapFile * map);
+extern bool ptrack_map_block_changed(const PtrackMapFile * map,
+									 const PtrackBlockKey *key, XLogRecPtr lsn);
+extern PtrackFilesFile *ptrack_files_file_read(const char *path, char **errmsg);
+extern void ptrack_files_file_free(PtrackFilesFile * files);
+extern XLogRecPtr ptrack_files_file_lsn(const PtrackFilesFile * files,
+										const PtrackBlockKey *key);
+extern bool ptrack_policy_file_read(const char *path, PtrackPolicy * policy,
+									char **errmsg);
+extern bool ptrack_walk_datadir(const char *datadir,
+								ptrack_file_callback callback, void *arg,
+								char **errmsg);
+
+#endif							/* PTRACK_FE_H */
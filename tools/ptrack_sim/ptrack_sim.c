@@ -0,0 +1,686 @@
+/*
+ * ptrack_sim.c
+ *		Simulate false positives of ptrack map for block write traces
+ *
+ * Copyright (c) 2019-2022, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  ptrack/tools/ptrack_sim/ptrack_sim.c
+ *
+ * Blocks written since a backup are marked in maps of the given sizes and
+ * then all blocks of the cluster are probed in the order of
+ * ptrack_get_pagemapset(), i.e. file by file and block by block.  For every
+ * map size it reports the share of unchanged blocks reported as changed,
+ * the estimate of ptrack_map_occupancy() for comparison, the share of probes
+ * reaching the second slot and the share of probes hitting the same 4 KB
+ * page of the map as the previous one.
+ *
+ * Blocks are hashed into slots exactly as the extension does it (see
+ * ptrack_map.h).  Only the fact that a slot is marked since the backup
+ * matters for the result, since slots keep the greatest LSN, so a map is
+ * simulated with a bitmap of slots.  --probes and --layout give variants of
+ * the slot rule to compare with the current one.
+ *
+ * Blocks are either generated (--pattern) for a cluster of --relations
+ * relations of --blocks blocks each, or read from a trace (--trace).  Every
+ * line of a trace is either "spcOid dbOid relNumber forknum blocknum" or
+ * pg_waldump output, whose block references are taken.  The cluster then
+ * consists of relations of the trace up to their greatest written block.
+ */
+
+#include "postgres_fe.h"
+
+#include <math.h>
+
+#include "common/hashfn.h"
+#include "common/logging.h"
+#include "common/relpath.h"
+#include "getopt_long.h"
+
+#include "ptrack_map.h"
+
+/* Map of 'size' bytes has about this number of slots, header is ignored */
+#define SIM_MAP_NSLOTS(size) ((size) / sizeof(uint64))
+
+/* Slots in a 4 KB page of the map */
+#define SIM_PAGE_SLOTS (4096 / sizeof(uint64))
+
+/* Synthetic relations are numbered from here in the default tablespace */
+#define SIM_TABLESPACE_OID 1663
+#define SIM_DATABASE_OID 16384
+#define SIM_FIRST_REL 16384
+
+typedef enum SimPattern
+{
+	SIM_SEQUENTIAL,				/* bulk load of relations one by one */
+	SIM_UNIFORM,				/* random blocks of random relations */
+	SIM_ZIPF					/* hot set, block ranks follow Zipf's law */
+}			SimPattern;
+
+typedef enum SimLayout
+{
+	SIM_LAYOUT_DEFAULT,			/* PTRACK_HASH_SLOT1() and PTRACK_HASH_SLOT2() */
+	SIM_LAYOUT_PAGE				/* second slot in the page of the first one */
+}			SimLayout;
+
+/* Relation file of the cluster, its blocks are numbered from 'offset' */
+typedef struct SimRelation
+{
+	PtrackBlockKey key;
+	uint64		offset;
+	BlockNumber nblocks;
+}			SimRelation;
+
+typedef struct SimMap
+{
+	uint64		size_mb;
+	uint64		nslots;
+	uint8	   *slots;			/* bitmap of slots marked since backup */
+	uint64		used;
+	uint64		probes;
+	uint64		second_probes;
+	uint64		same_page;
+	uint64		false_positives;
+	size_t		prev_slot;
+}			SimMap;
+
+typedef struct SimCtx
+{
+	SimRelation *rels;
+	int			nrels;
+	uint64		nblocks;
+	uint8	   *changed;		/* bitmap of blocks changed since backup */
+	uint64		nchanged;
+	uint64		writes;
+	SimMap	   *maps;
+	int			nmaps;
+	int			probes;
+	SimLayout	layout;
+}			SimCtx;
+
+static const char *progname;
+
+static void
+usage(void)
+{
+	printf("%s simulates false positives of ptrack map for block write traces.\n\n", progname);
+	printf("Usage:\n");
+	printf("  %s [OPTION]...\n", progname);
+	printf("\nOptions:\n");
+	printf("  -m, --map-sizes=LIST   map sizes in MB (default: 1,16,128,1024)\n");
+	printf("  -p, --pattern=PATTERN  sequential, uniform or zipf (default: zipf)\n");
+	printf("  -r, --relations=NUM    number of synthetic relations (default: 1000)\n");
+	printf("  -b, --blocks=NUM       blocks in every synthetic relation (default: 16384)\n");
+	printf("  -w, --writes=NUM       block writes since backup (default: 10%% of blocks)\n");
+	printf("  -s, --seed=NUM         seed of synthetic writes (default: 0)\n");
+	printf("  -t, --trace=FILE       read block writes from FILE, - for stdin\n");
+	printf("  -k, --probes=NUM       slots per block, 1 or 2 (default: 2)\n");
+	printf("  -l, --layout=LAYOUT    default or page (default: default)\n");
+	printf("  -V, --version          output version information, then exit\n");
+	printf("  -?, --help             show this help, then exit\n");
+}
+
+/*
+ * splitmix64, so that the same seed gives the same writes on every platform
+ */
+static uint64
+sim_random(uint64 *state)
+{
+	uint64		z = (*state += UINT64CONST(0x9E3779B97F4A7C15));
+
+	z = (z ^ (z >> 30)) * UINT64CONST(0xBF58476D1CE4E5B9);
+	z = (z ^ (z >> 27)) * UINT64CONST(0x94D049BB133111EB);
+	return z ^ (z >> 31);
+}
+
+static void
+sim_mark_changed(SimCtx *ctx, uint64 blockno)
+{
+	ctx->writes++;
+	if (ctx->changed[blockno / 8] & (1 << (blockno % 8)))
+		return;
+	ctx->changed[blockno / 8] |= 1 << (blockno % 8);
+	ctx->nchanged++;
+}
+
+/*
+ * Cluster of 'nrels' relations of 'nblocks' blocks and 'nwrites' writes
+ * into it.  Zipf ranks are drawn from the continuous approximation of the
+ * distribution with exponent 1, so that the first blocks of the first
+ * relations are the hottest ones.
+ */
+static void
+sim_generate(SimCtx *ctx, SimPattern pattern, int nrels, BlockNumber nblocks,
+			 uint64 nwrites, uint64 seed)
+{
+	uint64		state = seed;
+	uint64		i;
+
+	ctx->nrels = nrels;
+	ctx->rels = pg_malloc0(nrels * sizeof(SimRelation));
+	for (i = 0; i < nrels; i++)
+	{
+		ctx->rels[i].key.spcOid = SIM_TABLESPACE_OID;
+		ctx->rels[i].key.dbOid = SIM_DATABASE_OID;
+		ctx->rels[i].key.relNumber = SIM_FIRST_REL + i;
+		ctx->rels[i].key.forknum = MAIN_FORKNUM;
+		ctx->rels[i].offset = i * nblocks;
+		ctx->rels[i].nblocks = nblocks;
+	}
+	ctx->nblocks = (uint64) nrels * nblocks;
+	ctx->changed = pg_malloc0(ctx->nblocks / 8 + 1);
+
+	for (i = 0; i < nwrites; i++)
+	{
+		uint64		n;
+
+		switch (pattern)
+		{
+			case SIM_SEQUENTIAL:
+				n = i % ctx->nblocks;
+				break;
+			case SIM_UNIFORM:
+				n = sim_random(&state) % ctx->nblocks;
+				break;
+			case SIM_ZIPF:
+			default:
+				{
+					double		u = (sim_random(&state) >> 11) * (1.0 / (UINT64CONST(1) << 53));
+
+					n = (uint64) exp(u * log((double) ctx->nblocks));
+					n = Min(n, ctx->nblocks) - 1;
+					break;
+				}
+		}
+
+		sim_mark_changed(ctx, n);
+	}
+}
+
+/*
+ * Parse block references of a line of pg_waldump output, e.g.
+ * "blkref #0: rel 1663/5/16384 fork fsm blk 2".  Main fork is omitted by
+ * older versions, and newer ones separate fields with commas.  Returns the
+ * number of references added to 'keys'.
+ */
+static int
+sim_parse_waldump(const char *line, PtrackBlockKey **keys, int *nkeys,
+				  int *maxkeys)
+{
+	const char *p = line;
+	int			n = 0;
+
+	while ((p = strstr(p, "rel ")) != NULL)
+	{
+		PtrackBlockKey key;
+		char		fork[16];
+		int			len = 0;
+
+		p += 4;
+		if (sscanf(p, "%u/%u/%u%n", &key.spcOid, &key.dbOid,
+				   &key.relNumber, &len) != 3)
+			continue;
+		p += strspn(p + len, ", ") + len;
+
+		key.forknum = MAIN_FORKNUM;
+		if (sscanf(p, "fork %15[a-z]%n", fork, &len) == 1)
+		{
+			key.forknum = forkname_to_number(fork);
+			if (key.forknum == InvalidForkNumber)
+				continue;
+			p += strspn(p + len, ", ") + len;
+		}
+		if (sscanf(p, "blk %u%n", &key.blocknum, &len) != 1)
+			continue;
+		p += len;
+
+		if (*nkeys == *maxkeys)
+		{
+			*maxkeys *= 2;
+			*keys = pg_realloc(*keys, *maxkeys * sizeof(PtrackBlockKey));
+		}
+		(*keys)[(*nkeys)++] = key;
+		n++;
+	}
+
+	return n;
+}
+
+static int
+sim_key_cmp(const void *a, const void *b)
+{
+	const PtrackBlockKey *ka = (const PtrackBlockKey *) a;
+	const PtrackBlockKey *kb = (const PtrackBlockKey *) b;
+
+	if (ka->spcOid != kb->spcOid)
+		return ka->spcOid < kb->spcOid ? -1 : 1;
+	if (ka->dbOid != kb->dbOid)
+		return ka->dbOid < kb->dbOid ? -1 : 1;
+	if (ka->relNumber != kb->relNumber)
+		return ka->relNumber < kb->relNumber ? -1 : 1;
+	if (ka->forknum != kb->forknum)
+		return ka->forknum < kb->forknum ? -1 : 1;
+	if (ka->blocknum != kb->blocknum)
+		return ka->blocknum < kb->blocknum ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Read writes from trace.  Relations of the cluster are those of the trace
+ * with sizes up to the greatest written block, so that sorted writes give
+ * both the relations and the blocks changed since backup.
+ */
+static void
+sim_read_trace(SimCtx *ctx, const char *path)
+{
+	FILE	   *file;
+	char		line[4096];
+	PtrackBlockKey *keys;
+	int			nkeys = 0;
+	int			maxkeys = 1024;
+	int			lineno = 0;
+	int			i;
+
+	if (strcmp(path, "-") == 0)
+		file = stdin;
+	else if ((file = fopen(path, "r")) == NULL)
+	{
+		pg_log_error("could not open file \"%s\": %m", path);
+		exit(1);
+	}
+
+	keys = pg_malloc(maxkeys * sizeof(PtrackBlockKey));
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		PtrackBlockKey key;
+
+		lineno++;
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+
+		if (sscanf(line, "%u %u %u %d %u", &key.spcOid, &key.dbOid,
+				   &key.relNumber, &key.forknum, &key.blocknum) == 5)
+		{
+			if (nkeys == maxkeys)
+			{
+				maxkeys *= 2;
+				keys = pg_realloc(keys, maxkeys * sizeof(PtrackBlockKey));
+			}
+			keys[nkeys++] = key;
+		}
+		else if (sim_parse_waldump(line, &keys, &nkeys, &maxkeys) == 0 &&
+				 strstr(line, "rmgr:") == NULL)
+		{
+			pg_log_error("invalid trace line %d in \"%s\"", lineno, path);
+			exit(1);
+		}
+	}
+
+	if (ferror(file))
+	{
+		pg_log_error("could not read file \"%s\": %m", path);
+		exit(1);
+	}
+	if (file != stdin)
+		fclose(file);
+
+	if (nkeys == 0)
+	{
+		pg_log_error("no block writes in \"%s\"", path);
+		exit(1);
+	}
+
+	qsort(keys, nkeys, sizeof(PtrackBlockKey), sim_key_cmp);
+
+	/* Relation file is the key without block number */
+	ctx->rels = pg_malloc0(nkeys * sizeof(SimRelation));
+	for (i = 0; i < nkeys; i++)
+	{
+		SimRelation *rel = ctx->nrels > 0 ? &ctx->rels[ctx->nrels - 1] : NULL;
+		PtrackBlockKey relkey = keys[i];
+
+		relkey.blocknum = 0;
+		if (rel == NULL || memcmp(&rel->key, &relkey, sizeof(relkey)) != 0)
+		{
+			rel = &ctx->rels[ctx->nrels++];
+			rel->key = relkey;
+			rel->offset = ctx->nblocks;
+		}
+		ctx->nblocks += keys[i].blocknum + 1 - rel->nblocks;
+		rel->nblocks = keys[i].blocknum + 1;
+	}
+
+	ctx->changed = pg_malloc0(ctx->nblocks / 8 + 1);
+	for (i = 0; i < nkeys; i++)
+	{
+		int			r = 0;
+		int			lo = 0;
+		int			hi = ctx->nrels - 1;
+		PtrackBlockKey relkey = keys[i];
+
+		relkey.blocknum = 0;
+		while (lo <= hi)
+		{
+			int			cmp;
+
+			r = (lo + hi) / 2;
+			cmp = sim_key_cmp(&ctx->rels[r].key, &relkey);
+			if (cmp == 0)
+				break;
+			if (cmp < 0)
+				lo = r + 1;
+			else
+				hi = r - 1;
+		}
+
+		sim_mark_changed(ctx, ctx->rels[r].offset + keys[i].blocknum);
+	}
+
+	pg_free(keys);
+}
+
+static inline void
+sim_slots(const SimCtx *ctx, const SimMap *map, uint64 hash,
+		  size_t *slot1, size_t *slot2)
+{
+	*slot1 = PTRACK_HASH_SLOT1(hash, map->nslots);
+
+	if (ctx->layout == SIM_LAYOUT_PAGE)
+	{
+		size_t		page = *slot1 - *slot1 % SIM_PAGE_SLOTS;
+		uint64		page_slots = Min(SIM_PAGE_SLOTS, map->nslots - page);
+
+		*slot2 = page + (hash >> 32) % page_slots;
+	}
+	else
+		*slot2 = PTRACK_HASH_SLOT2(hash, map->nslots);
+}
+
+static inline bool
+sim_slot_marked(const SimMap *map, size_t slot)
+{
+	return (map->slots[slot / 8] & (1 << (slot % 8))) != 0;
+}
+
+static inline void
+sim_slot_mark(SimMap *map, size_t slot)
+{
+	if (sim_slot_marked(map, slot))
+		return;
+	map->slots[slot / 8] |= 1 << (slot % 8);
+	map->used++;
+}
+
+/*
+ * Mark changed blocks in all maps and then probe all blocks of the cluster
+ * file by file as ptrack_get_pagemapset() does.
+ */
+static void
+sim_run(SimCtx *ctx)
+{
+	int			pass;
+	int			r;
+	int			m;
+
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (r = 0; r < ctx->nrels; r++)
+		{
+			SimRelation *rel = &ctx->rels[r];
+			PtrackBlockKey key = rel->key;
+
+			for (key.blocknum = 0; key.blocknum < rel->nblocks; key.blocknum++)
+			{
+				uint64		blockno = rel->offset + key.blocknum;
+				bool		changed = (ctx->changed[blockno / 8] & (1 << (blockno % 8))) != 0;
+				uint64		hash;
+
+				if (pass == 0 && !changed)
+					continue;
+
+				hash = hash_bytes_extended((const unsigned char *) &key,
+										   sizeof(PtrackBlockKey), 0);
+
+				for (m = 0; m < ctx->nmaps; m++)
+				{
+					SimMap	   *map = &ctx->maps[m];
+					size_t		slot1;
+					size_t		slot2;
+					bool		reported;
+
+					sim_slots(ctx, map, hash, &slot1, &slot2);
+
+					if (pass == 0)
+					{
+						sim_slot_mark(map, slot1);
+						if (ctx->probes > 1)
+							sim_slot_mark(map, slot2);
+						continue;
+					}
+
+					map->probes++;
+					if (map->probes > 1 &&
+						slot1 / SIM_PAGE_SLOTS == map->prev_slot / SIM_PAGE_SLOTS)
+						map->same_page++;
+					map->prev_slot = slot1;
+
+					reported = sim_slot_marked(map, slot1);
+					if (reported && ctx->probes > 1)
+					{
+						map->second_probes++;
+						reported = sim_slot_marked(map, slot2);
+					}
+
+					if (reported && !changed)
+						map->false_positives++;
+				}
+			}
+		}
+	}
+}
+
+static void
+sim_report(const SimCtx *ctx)
+{
+	uint64		unchanged = ctx->nblocks - ctx->nchanged;
+	int			m;
+
+	printf("# cluster blocks: " UINT64_FORMAT ", relations: %d, writes: " UINT64_FORMAT ", changed blocks: " UINT64_FORMAT "\n",
+		   ctx->nblocks, ctx->nrels, ctx->writes, ctx->nchanged);
+	printf("# probes: %d, layout: %s\n", ctx->probes,
+		   ctx->layout == SIM_LAYOUT_PAGE ? "page" : "default");
+	printf("map_mb\tmap_ratio\tslots\tused_slots\toccupancy\tfalse_positives\tfpr\tfpr_estimate\tsecond_probe_rate\tsame_page_rate\n");
+
+	for (m = 0; m < ctx->nmaps; m++)
+	{
+		const SimMap *map = &ctx->maps[m];
+		double		occupancy = (double) map->used / map->nslots;
+
+		printf(UINT64_FORMAT "\t%.6f\t" UINT64_FORMAT "\t" UINT64_FORMAT "\t%.6f\t" UINT64_FORMAT "\t%.6f\t%.6f\t%.6f\t%.6f\n",
+			   map->size_mb,
+			   (double) map->size_mb * 1024 * 1024 / ((double) ctx->nblocks * BLCKSZ),
+			   map->nslots,
+			   map->used,
+			   occupancy,
+			   map->false_positives,
+			   unchanged > 0 ? (double) map->false_positives / unchanged : 0,
+			   pow(occupancy, ctx->probes),
+			   (double) map->second_probes / map->probes,
+			   map->probes > 1 ? (double) map->same_page / (map->probes - 1) : 0);
+	}
+}
+
+static void
+sim_parse_map_sizes(SimCtx *ctx, const char *list)
+{
+	char	   *copy = pg_strdup(list);
+	char	   *tok;
+
+	for (tok = strtok(copy, ", "); tok != NULL; tok = strtok(NULL, ", "))
+	{
+		SimMap	   *map;
+		char	   *end;
+		uint64		size_mb = strtoull(tok, &end, 10);
+
+		if (*end != '\0' || size_mb == 0 || size_mb > 32 * 1024)
+		{
+			pg_log_error("invalid map size \"%s\", should be from 1 to 32768 MB", tok);
+			exit(1);
+		}
+
+		ctx->maps = pg_realloc(ctx->maps, (ctx->nmaps + 1) * sizeof(SimMap));
+		map = &ctx->maps[ctx->nmaps++];
+		MemSet(map, 0, sizeof(SimMap));
+		map->size_mb = size_mb;
+		map->nslots = SIM_MAP_NSLOTS(size_mb * 1024 * 1024);
+		map->slots = pg_malloc0(map->nslots / 8 + 1);
+	}
+
+	pg_free(copy);
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"map-sizes", required_argument, NULL, 'm'},
+		{"pattern", required_argument, NULL, 'p'},
+		{"relations", required_argument, NULL, 'r'},
+		{"blocks", required_argument, NULL, 'b'},
+		{"writes", required_argument, NULL, 'w'},
+		{"seed", required_argument, NULL, 's'},
+		{"trace", required_argument, NULL, 't'},
+		{"probes", required_argument, NULL, 'k'},
+		{"layout", required_argument, NULL, 'l'},
+		{NULL, 0, NULL, 0}
+	};
+	const char *map_sizes = "1,16,128,1024";
+	SimPattern	pattern = SIM_ZIPF;
+	int			nrels = 1000;
+	long		nblocks = 16384;
+	int64		nwrites = -1;
+	uint64		seed = 0;
+	char	   *trace = NULL;
+	SimCtx		ctx;
+	int			c;
+
+	pg_logging_init(argv[0]);
+	progname = get_progname(argv[0]);
+
+	if (argc > 1)
+	{
+		if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-?") == 0)
+		{
+			usage();
+			exit(0);
+		}
+		if (strcmp(argv[1], "--version") == 0 || strcmp(argv[1], "-V") == 0)
+		{
+			puts("ptrack_sim (PostgreSQL) " PG_VERSION);
+			exit(0);
+		}
+	}
+
+	MemSet(&ctx, 0, sizeof(ctx));
+	ctx.probes = 2;
+	ctx.layout = SIM_LAYOUT_DEFAULT;
+
+	while ((c = getopt_long(argc, argv, "m:p:r:b:w:s:t:k:l:", long_options, NULL)) != -1)
+	{
+		switch (c)
+		{
+			case 'm':
+				map_sizes = optarg;
+				break;
+			case 'p':
+				if (strcmp(optarg, "sequential") == 0)
+					pattern = SIM_SEQUENTIAL;
+				else if (strcmp(optarg, "uniform") == 0)
+					pattern = SIM_UNIFORM;
+				else if (strcmp(optarg, "zipf") == 0)
+					pattern = SIM_ZIPF;
+				else
+				{
+					pg_log_error("invalid pattern \"%s\"", optarg);
+					exit(1);
+				}
+				break;
+			case 'r':
+				nrels = atoi(optarg);
+				if (nrels <= 0)
+				{
+					pg_log_error("number of relations must be positive");
+					exit(1);
+				}
+				break;
+			case 'b':
+				nblocks = atol(optarg);
+				if (nblocks <= 0 || nblocks > MaxBlockNumber)
+				{
+					pg_log_error("invalid number of blocks \"%s\"", optarg);
+					exit(1);
+				}
+				break;
+			case 'w':
+				nwrites = strtoll(optarg, NULL, 10);
+				if (nwrites < 0)
+				{
+					pg_log_error("number of writes must not be negative");
+					exit(1);
+				}
+				break;
+			case 's':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+			case 't':
+				trace = pg_strdup(optarg);
+				break;
+			case 'k':
+				ctx.probes = atoi(optarg);
+				if (ctx.probes != 1 && ctx.probes != 2)
+				{
+					pg_log_error("number of probes must be 1 or 2");
+					exit(1);
+				}
+				break;
+			case 'l':
+				if (strcmp(optarg, "default") == 0)
+					ctx.layout = SIM_LAYOUT_DEFAULT;
+				else if (strcmp(optarg, "page") == 0)
+					ctx.layout = SIM_LAYOUT_PAGE;
+				else
+				{
+					pg_log_error("invalid layout \"%s\"", optarg);
+					exit(1);
+				}
+				break;
+			default:
+				fprintf(stderr, "Try \"%s --help\" for more information.\n", progname);
+				exit(1);
+		}
+	}
+
+	if (optind < argc)
+	{
+		pg_log_error("too many command-line arguments (first is \"%s\")", argv[optind]);
+		fprintf(stderr, "Try \"%s --help\" for more information.\n", progname);
+		exit(1);
+	}
+
+	sim_parse_map_sizes(&ctx, map_sizes);
+
+	if (trace != NULL)
+		sim_read_trace(&ctx, trace);
+	else
+	{
+		if (nwrites < 0)
+			nwrites = (uint64) nrels * nblocks / 10;
+		sim_generate(&ctx, pattern, nrels, (BlockNumber) nblocks, nwrites, seed);
+	}
+
+	sim_run(&ctx);
+	sim_report(&ctx);
+
+	return 0;
+}